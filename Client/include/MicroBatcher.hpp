@@ -0,0 +1,138 @@
+//
+// Created by Aman LaChapelle on 2/12/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_MICROBATCHER_HPP
+#define BATCHING_RPC_SERVER_MICROBATCHER_HPP
+
+// STL
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Project
+#include "TBClient.hpp"
+
+namespace Serving {
+
+/**
+ * @brief Tunes when a MicroBatcher sends what it has gathered.
+ */
+struct MicroBatcherOptions {
+  //! Send as soon as this many rows are waiting.
+  int max_rows = 32;
+  //! Send once the first row has waited this long, however few have come.
+  std::chrono::microseconds max_delay = std::chrono::microseconds(1000);
+  //! How many gathered calls may be in flight at once, each has a thread.
+  int senders = 4;
+};
+
+/**
+ * @class MicroBatcher
+ * @brief Gathers the rows many threads submit into fewer, larger calls.
+ *
+ * Callers producing a row at a time pay a whole RPC per row. The batcher
+ * instead holds each submitted request for up to
+ * MicroBatcherOptions::max_delay, appends the requests that arrive
+ * meanwhile to it, and sends them as one TensorMessage through a TBClient.
+ * The reply is sliced back into each caller's rows. The server's own
+ * batching still applies on top, this only cuts the number of calls that
+ * reach it.
+ *
+ * Only requests that agree on everything but their rows are gathered
+ * together: the model, the shape of a row, the priority, the postprocessing
+ * and the outputs asked for. A request whose rows can't be told apart (a
+ * serialized_buffer) is sent on its own straight away.
+ */
+class MicroBatcher {
+public:
+  /**
+   * @brief Starts the sending threads.
+   *
+   * @param client Sends the gathered calls, retries and splits them as it
+   * would any call. Not owned, it has to outlive the batcher.
+   * @param options When to send, see MicroBatcherOptions.
+   */
+  explicit MicroBatcher(TBClient *client, const MicroBatcherOptions &options =
+                                              MicroBatcherOptions());
+
+  /**
+   * @brief Sends whatever is still waiting, then stops.
+   */
+  ~MicroBatcher();
+
+  /**
+   * @brief Adds a request's rows to the next call.
+   *
+   * @param request One or more rows.
+   * @param deadline When to give up, the call the rows go in is given the
+   * earliest deadline of the requests in it.
+   * @return The reply for these rows alone, with the request's client_id,
+   * or the status of the call they went in.
+   */
+  std::future<ProcessResult>
+  Submit(const TensorMessage &request,
+         const std::chrono::system_clock::time_point &deadline =
+             std::chrono::system_clock::time_point::max());
+
+private:
+  // A caller waiting on its rows of a gathered call
+  struct Waiter_ {
+    int rows;
+    std::string client_id;
+    std::promise<ProcessResult> promise;
+  };
+
+  // The requests gathered for one call
+  struct Gathered_ {
+    TensorMessage request;
+    std::vector<Waiter_> waiters;
+    std::chrono::steady_clock::time_point first;
+    std::chrono::system_clock::time_point deadline;
+  };
+
+  static std::string Key_(const TensorMessage &request);
+
+  bool Due_(const Gathered_ &gathered,
+            const std::chrono::steady_clock::time_point &now) const;
+
+  void SendLoop_();
+
+  void Send_(Gathered_ &gathered);
+
+  TBClient *client_;
+  MicroBatcherOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::map<std::string, Gathered_> gathered_; // by what requests agree on
+  bool stop_ = false;
+  std::vector<std::thread> senders_;
+};
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_MICROBATCHER_HPP
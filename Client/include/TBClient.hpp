@@ -0,0 +1,216 @@
+//
+// Created by Aman LaChapelle on 2/11/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_TBCLIENT_HPP
+#define BATCHING_RPC_SERVER_TBCLIENT_HPP
+
+// STL
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Generated
+#include <BatchingRPC.grpc.pb.h>
+#include <BatchingRPC.pb.h>
+
+namespace Serving {
+
+/**
+ * @brief Tunes how a TBClient calls the server.
+ *
+ * The defaults open one channel, Connect for client ids, retry a full queue
+ * ten times and never hedge or split ahead of time.
+ */
+struct TBClientOptions {
+  //! Channels to the server, calls take them in turn. Each channel has its
+  //! own HTTP/2 connection, so more of them spread a busy client's calls
+  //! over more of the server's pollers.
+  int channels = 1;
+  //! Threads carrying ProcessAsync calls, each holds one call at a time.
+  int async_threads = 4;
+  //! Get client ids from Connect, one for each call in flight. Turn off for
+  //! servers started without require_connect, calls then carry the
+  //! request's own client_id.
+  bool connect = true;
+  //! How many times a call the server turns away with UNAVAILABLE (a full
+  //! queue, or a server that's shutting down) is tried again.
+  int max_retries = 10;
+  //! The first retry waits up to this long, every one after up to twice as
+  //! long as the one before, up to max_backoff. The wait is drawn uniformly
+  //! from that range so that clients turned away together don't all come
+  //! back together.
+  std::chrono::microseconds initial_backoff = std::chrono::microseconds(1000);
+  std::chrono::microseconds max_backoff = std::chrono::microseconds(100000);
+  //! Send a second copy of a call on the next channel if the first hasn't
+  //! been answered in this long, and take whichever answers first. Cuts the
+  //! tail a slow batch or connection adds, for the cost of the copies. 0
+  //! never hedges.
+  std::chrono::microseconds hedge_delay = std::chrono::microseconds(0);
+  //! The most rows to send in one call, larger requests are split and the
+  //! replies joined. 0 sends requests whole until the server says one is too
+  //! large for its batch, and from then on sends half as many rows.
+  int max_rows = 0;
+  //! The largest request and reply, 0 for gRPC's default and -1 for no
+  //! limit.
+  int max_message_bytes = 0;
+};
+
+/**
+ * @brief The outcome of a TBClient::ProcessAsync call.
+ */
+struct ProcessResult {
+  grpc::Status status;
+  TensorMessage reply;
+};
+
+/**
+ * @class TBClient
+ * @brief Calls a TBServer (or a TBRouter) the way its batching expects.
+ *
+ * Takes care of what every caller used to do by hand: Connect for a client
+ * id, retry a call the server couldn't queue (NEXT_BATCH comes back as
+ * UNAVAILABLE) after a jittered backoff, and split a request that's larger
+ * than the server's batch (BATCH_TOO_LARGE) into ones that fit. Calls can
+ * be hedged, see TBClientOptions::hedge_delay.
+ *
+ * The server keeps one result per client id, so the client keeps a pool of
+ * ids and gives each call in flight its own, calling Connect when the pool
+ * runs dry. A TBClient is safe to share between threads.
+ */
+class TBClient {
+public:
+  /**
+   * @brief Opens the channels, nothing is sent until the first call.
+   *
+   * @param address The server's address, TCP or Unix domain socket.
+   * @param options How to call it, see TBClientOptions.
+   */
+  explicit TBClient(const std::string &address,
+                    const TBClientOptions &options = TBClientOptions());
+
+  /**
+   * @brief Finishes the ProcessAsync calls already made, then closes.
+   */
+  ~TBClient();
+
+  /**
+   * @brief Processes a request, blocking until the reply is in.
+   *
+   * @param request The request, its client_id is only sent if
+   * TBClientOptions::connect is off.
+   * @param reply The reply, joined back together if the request was split.
+   * Its client_id is the request's.
+   * @param deadline When to give up, retries and all.
+   * @return The server's status for the last try, or for the first part of
+   * a split request that failed. INVALID_ARGUMENT if a request has to be
+   * split and can't be, see SliceRows.
+   */
+  grpc::Status Process(const TensorMessage &request, TensorMessage *reply,
+                       const std::chrono::system_clock::time_point &deadline =
+                           std::chrono::system_clock::time_point::max());
+
+  /**
+   * @brief Processes a request on one of the client's threads.
+   *
+   * @return The status and reply Process would have given.
+   */
+  std::future<ProcessResult>
+  ProcessAsync(const TensorMessage &request,
+               const std::chrono::system_clock::time_point &deadline =
+                   std::chrono::system_clock::time_point::max());
+
+  /**
+   * @brief The most rows the client sends in one call, 0 for no limit yet.
+   */
+  int MaxRows() const;
+
+private:
+  struct Attempt_ {
+    grpc::ClientContext context;
+    TensorMessage reply;
+    grpc::Status status;
+    std::string client_id;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<TensorMessage>> reader;
+  };
+
+  struct Call_ {
+    TensorMessage request;
+    std::chrono::system_clock::time_point deadline;
+    std::promise<ProcessResult> promise;
+  };
+
+  grpc::Status Process_(TensorMessage &request, TensorMessage *reply,
+                        const std::chrono::system_clock::time_point &deadline);
+
+  grpc::Status Retry_(TensorMessage &request, TensorMessage *reply,
+                      const std::chrono::system_clock::time_point &deadline);
+
+  grpc::Status Send_(TensorMessage &request, TensorMessage *reply,
+                     const std::chrono::system_clock::time_point &deadline);
+
+  bool Start_(Attempt_ &attempt, TensorMessage &request,
+              const std::chrono::system_clock::time_point &deadline,
+              grpc::CompletionQueue *cq);
+
+  grpc::Status AcquireId_(const std::chrono::system_clock::time_point &deadline,
+                          std::string *client_id);
+
+  void ReleaseId_(const std::string &client_id);
+
+  BatchingServer::Stub *NextStub_();
+
+  std::chrono::microseconds Backoff_(const int &retry);
+
+  void AsyncLoop_();
+
+  TBClientOptions options_;
+  std::vector<std::unique_ptr<BatchingServer::Stub>> stubs_;
+  std::atomic<unsigned> next_stub_{0};
+  std::atomic<int> max_rows_;
+
+  std::mutex ids_mutex_;
+  std::vector<std::string> free_ids_; // from Connect, not in use
+
+  std::mutex rng_mutex_;
+  std::mt19937 rng_;
+
+  std::mutex calls_mutex_;
+  std::condition_variable calls_cv_;
+  std::deque<Call_> calls_; // waiting for an async thread
+  bool stop_ = false;
+  std::vector<std::thread> async_threads_;
+};
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_TBCLIENT_HPP
@@ -0,0 +1,162 @@
+//
+// Created by Aman LaChapelle on 2/11/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_TENSORROWS_HPP
+#define BATCHING_RPC_SERVER_TENSORROWS_HPP
+
+// STL
+#include <numeric>
+
+// Generated
+#include <BatchingRPC.pb.h>
+
+namespace Serving {
+
+/**
+ * @brief Copies everything but the rows themselves: the shape (n included),
+ * the client and model, and what to do to the output.
+ */
+inline void CopyHeader(const TensorMessage &from, TensorMessage *to) {
+  to->set_n(from.n());
+  to->set_k(from.k());
+  to->set_nr(from.nr());
+  to->set_nc(from.nc());
+  to->set_client_id(from.client_id());
+  to->set_priority(from.priority());
+  to->set_model_name(from.model_name());
+  to->set_model_version(from.model_version());
+  if (from.has_postprocessing()) {
+    *to->mutable_postprocessing() = from.postprocessing();
+  }
+  *to->mutable_outputs() = from.outputs();
+}
+
+/**
+ * @brief Copies rows [first, first + rows) of a request or a reply.
+ *
+ * Every row of buffer (and of pixels) is the same length, or for a
+ * postprocessed reply as long as its entry in counts says, and images has
+ * one entry per row. Named outputs are sliced the same way.
+ *
+ * @return false if the rows can't be told apart: the message carries a
+ * serialized_buffer, its sizes aren't a whole number of rows, or the range
+ * isn't within n. slice is then left half written.
+ */
+inline bool SliceRows(const TensorMessage &message, const int &first,
+                      const int &rows, TensorMessage *slice) {
+  const int n = message.n();
+  if (n <= 0 || first < 0 || rows < 0 || first + rows > n ||
+      !message.serialized_buffer().empty()) {
+    return false;
+  }
+
+  slice->Clear();
+  CopyHeader(message, slice);
+  slice->set_n(rows);
+
+  if (message.counts_size() > 0) {
+    if (message.counts_size() != n) {
+      return false;
+    }
+    const int begin = std::accumulate(message.counts().begin(),
+                                      message.counts().begin() + first, 0);
+    const int end =
+        std::accumulate(message.counts().begin() + first,
+                        message.counts().begin() + first + rows, begin);
+    if (end > message.buffer_size() || end > message.indices_size()) {
+      return false;
+    }
+    slice->mutable_buffer()->Add(message.buffer().begin() + begin,
+                                 message.buffer().begin() + end);
+    slice->mutable_indices()->Add(message.indices().begin() + begin,
+                                  message.indices().begin() + end);
+    slice->mutable_counts()->Add(message.counts().begin() + first,
+                                 message.counts().begin() + first + rows);
+  } else {
+    if (message.buffer_size() % n != 0) {
+      return false;
+    }
+    const int cols = message.buffer_size() / n;
+    slice->mutable_buffer()->Add(message.buffer().begin() + first * cols,
+                                 message.buffer().begin() +
+                                     (first + rows) * cols);
+  }
+
+  if (!message.pixels().empty()) {
+    if (message.pixels().size() % n != 0) {
+      return false;
+    }
+    const size_t bytes = message.pixels().size() / n;
+    slice->set_pixels(message.pixels().substr(first * bytes, rows * bytes));
+  }
+
+  if (message.images_size() > 0) {
+    if (message.images_size() != n) {
+      return false;
+    }
+    slice->mutable_images()->CopyFrom(message.images());
+    slice->mutable_images()->DeleteSubrange(first + rows, n - first - rows);
+    slice->mutable_images()->DeleteSubrange(0, first);
+  }
+
+  for (const NamedTensor &named : message.named_outputs()) {
+    NamedTensor *sliced = slice->add_named_outputs();
+    sliced->set_name(named.name());
+    if (!SliceRows(named.tensor(), first, rows, sliced->mutable_tensor())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Appends the rows of part to whole, the reverse of SliceRows.
+ *
+ * An empty whole (n of 0) takes part's header first, after that the parts
+ * are expected to agree on everything but n.
+ */
+inline void AppendRows(const TensorMessage &part, TensorMessage *whole) {
+  if (whole->n() == 0) {
+    CopyHeader(part, whole);
+    whole->set_n(0);
+  }
+
+  whole->set_n(whole->n() + part.n());
+  whole->mutable_buffer()->MergeFrom(part.buffer());
+  whole->mutable_indices()->MergeFrom(part.indices());
+  whole->mutable_counts()->MergeFrom(part.counts());
+  whole->mutable_pixels()->append(part.pixels());
+  whole->mutable_images()->MergeFrom(part.images());
+
+  for (int i = 0; i < part.named_outputs_size(); i++) {
+    if (i == whole->named_outputs_size()) {
+      whole->add_named_outputs()->set_name(part.named_outputs(i).name());
+    }
+    AppendRows(part.named_outputs(i).tensor(),
+               whole->mutable_named_outputs(i)->mutable_tensor());
+  }
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_TENSORROWS_HPP
@@ -0,0 +1,177 @@
+//
+// Created by Aman LaChapelle on 2/12/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "MicroBatcher.hpp"
+
+// STL
+#include <algorithm>
+
+// Project
+#include "TensorRows.hpp"
+
+using grpc::Status;
+
+namespace Serving {
+
+MicroBatcher::MicroBatcher(TBClient *client,
+                           const MicroBatcherOptions &options)
+    : client_(client), options_(options) {
+  for (int i = 0; i < std::max(1, options_.senders); i++) {
+    senders_.emplace_back(&MicroBatcher::SendLoop_, this);
+  }
+}
+
+MicroBatcher::~MicroBatcher() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+
+  for (std::thread &sender : senders_) {
+    sender.join();
+  }
+}
+
+std::future<ProcessResult>
+MicroBatcher::Submit(const TensorMessage &request,
+                     const std::chrono::system_clock::time_point &deadline) {
+  if (request.n() <= 0 || !request.serialized_buffer().empty()) {
+    return client_->ProcessAsync(request, deadline); // can't be split back
+  }
+
+  Waiter_ waiter;
+  waiter.rows = request.n();
+  waiter.client_id = request.client_id();
+  std::future<ProcessResult> result = waiter.promise.get_future();
+
+  const std::string key = Key_(request);
+
+  bool wake = false;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    Gathered_ &gathered = gathered_[key];
+    if (gathered.waiters.empty()) {
+      gathered.first = std::chrono::steady_clock::now();
+      gathered.deadline = deadline;
+      wake = true; // a new delay to wait out
+    }
+    gathered.deadline = std::min(gathered.deadline, deadline);
+
+    AppendRows(request, &gathered.request);
+    gathered.waiters.push_back(std::move(waiter));
+    wake |= gathered.request.n() >= options_.max_rows;
+  }
+
+  if (wake) {
+    cv_.notify_one();
+  }
+
+  return result;
+}
+
+std::string MicroBatcher::Key_(const TensorMessage &request) {
+  TensorMessage header;
+  CopyHeader(request, &header);
+  header.clear_n();
+  header.clear_client_id();
+  return header.SerializeAsString();
+}
+
+bool MicroBatcher::Due_(
+    const Gathered_ &gathered,
+    const std::chrono::steady_clock::time_point &now) const {
+  return stop_ || gathered.request.n() >= options_.max_rows ||
+         now >= gathered.first + options_.max_delay;
+}
+
+void MicroBatcher::SendLoop_() {
+  while (true) {
+    Gathered_ gathered;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        const std::chrono::steady_clock::time_point now =
+            std::chrono::steady_clock::now();
+
+        // The longest waiting of those that are due goes first, otherwise
+        // wait for the longest waiting to become due
+        auto due = gathered_.end();
+        auto oldest = gathered_.end();
+        for (auto it = gathered_.begin(); it != gathered_.end(); ++it) {
+          if (Due_(it->second, now) &&
+              (due == gathered_.end() ||
+               it->second.first < due->second.first)) {
+            due = it;
+          }
+          if (oldest == gathered_.end() ||
+              it->second.first < oldest->second.first) {
+            oldest = it;
+          }
+        }
+
+        if (due != gathered_.end()) {
+          gathered = std::move(due->second);
+          gathered_.erase(due);
+          break;
+        }
+
+        if (oldest == gathered_.end()) {
+          if (stop_) {
+            return;
+          }
+          cv_.wait(lock);
+        } else {
+          cv_.wait_until(lock, oldest->second.first + options_.max_delay);
+        }
+      }
+    }
+
+    Send_(gathered);
+  }
+}
+
+void MicroBatcher::Send_(Gathered_ &gathered) {
+  TensorMessage reply;
+  grpc::Status status =
+      client_->Process(gathered.request, &reply, gathered.deadline);
+  if (status.ok() && reply.n() != gathered.request.n()) {
+    status = Status(grpc::INTERNAL, "Reply doesn't have a row per request row");
+  }
+
+  int first = 0;
+  for (Waiter_ &waiter : gathered.waiters) {
+    ProcessResult result;
+    result.status = status;
+    if (status.ok() &&
+        !SliceRows(reply, first, waiter.rows, &result.reply)) {
+      result.status = Status(grpc::INTERNAL,
+                             "Reply can't be split back into requests");
+    }
+    result.reply.set_client_id(waiter.client_id);
+    first += waiter.rows;
+
+    waiter.promise.set_value(std::move(result));
+  }
+}
+
+} // namespace Serving
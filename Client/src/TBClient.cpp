@@ -0,0 +1,349 @@
+//
+// Created by Aman LaChapelle on 2/11/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "TBClient.hpp"
+
+// STL
+#include <algorithm>
+
+// Project
+#include "TensorRows.hpp"
+
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using grpc::Status;
+
+namespace {
+// How TBServer words ReturnCodes::BATCH_TOO_LARGE, which shares its status
+// code with a badly shaped request
+const char kBatchTooLarge_[] = "Batch request was too large";
+
+bool TooLarge_(const grpc::Status &status) {
+  return status.error_code() == grpc::INVALID_ARGUMENT &&
+         status.error_message().compare(0, sizeof(kBatchTooLarge_) - 1,
+                                        kBatchTooLarge_) == 0;
+}
+
+// Whether the server may still be working on the call, in which case its
+// client id can't be given to another call yet
+bool MayBeQueued_(const grpc::Status &status) {
+  switch (status.error_code()) {
+  case grpc::OK:
+  case grpc::UNAVAILABLE:
+  case grpc::INVALID_ARGUMENT:
+  case grpc::NOT_FOUND:
+    return false;
+  default:
+    return true;
+  }
+}
+}
+
+namespace Serving {
+
+TBClient::TBClient(const std::string &address, const TBClientOptions &options)
+    : options_(options), max_rows_(options.max_rows),
+      rng_(std::random_device()()) {
+  for (int i = 0; i < std::max(1, options_.channels); i++) {
+    grpc::ChannelArguments args;
+    if (options_.max_message_bytes != 0) {
+      args.SetMaxReceiveMessageSize(options_.max_message_bytes);
+      args.SetMaxSendMessageSize(options_.max_message_bytes);
+    }
+    // Channels with the same arguments would share a connection
+    args.SetInt("batching.channel", i);
+
+    stubs_.push_back(BatchingServer::NewStub(grpc::CreateCustomChannel(
+        address, grpc::InsecureChannelCredentials(), args)));
+  }
+
+  for (int i = 0; i < std::max(1, options_.async_threads); i++) {
+    async_threads_.emplace_back(&TBClient::AsyncLoop_, this);
+  }
+}
+
+TBClient::~TBClient() {
+  {
+    std::lock_guard<std::mutex> guard(calls_mutex_);
+    stop_ = true;
+  }
+  calls_cv_.notify_all();
+
+  for (std::thread &thread : async_threads_) {
+    thread.join();
+  }
+}
+
+grpc::Status
+TBClient::Process(const TensorMessage &request, TensorMessage *reply,
+                  const std::chrono::system_clock::time_point &deadline) {
+  TensorMessage own = request; // each try stamps its client id on it
+  return Process_(own, reply, deadline);
+}
+
+std::future<ProcessResult>
+TBClient::ProcessAsync(const TensorMessage &request,
+                       const std::chrono::system_clock::time_point &deadline) {
+  Call_ call;
+  call.request = request;
+  call.deadline = deadline;
+  std::future<ProcessResult> result = call.promise.get_future();
+
+  {
+    std::lock_guard<std::mutex> guard(calls_mutex_);
+    calls_.push_back(std::move(call));
+  }
+  calls_cv_.notify_one();
+
+  return result;
+}
+
+int TBClient::MaxRows() const { return max_rows_; }
+
+grpc::Status
+TBClient::Process_(TensorMessage &request, TensorMessage *reply,
+                   const std::chrono::system_clock::time_point &deadline) {
+  const std::string client_id = request.client_id();
+  const int n = request.n();
+
+  TensorMessage joined;
+  int first = 0;
+  do {
+    const int max_rows = max_rows_;
+    const int rows = max_rows > 0 ? std::min(max_rows, n - first) : n - first;
+
+    grpc::Status status;
+    TensorMessage part;
+    if (first == 0 && rows >= n) {
+      status = Retry_(request, &part, deadline);
+    } else {
+      TensorMessage chunk;
+      if (!SliceRows(request, first, rows, &chunk)) {
+        grpc::Status early_exit_status(
+            grpc::INVALID_ARGUMENT,
+            "Request is too large for the server and can't be split");
+        return early_exit_status;
+      }
+      status = Retry_(chunk, &part, deadline);
+    }
+
+    if (TooLarge_(status) && rows > 1) {
+      // Send half as many from now on, and try these rows again
+      int current = max_rows_;
+      while ((current == 0 || current > rows / 2) &&
+             !max_rows_.compare_exchange_weak(current, rows / 2)) {
+      }
+      continue;
+    }
+
+    if (!status.ok()) {
+      return status;
+    }
+
+    if (first == 0 && rows >= n) {
+      reply->Swap(&part); // sent whole, nothing to join
+      reply->set_client_id(client_id);
+      return Status::OK;
+    }
+
+    AppendRows(part, &joined);
+    first += rows;
+  } while (first < n);
+
+  reply->Swap(&joined);
+  reply->set_client_id(client_id);
+  return Status::OK;
+}
+
+grpc::Status
+TBClient::Retry_(TensorMessage &request, TensorMessage *reply,
+                 const std::chrono::system_clock::time_point &deadline) {
+  for (int retry = 0;; retry++) {
+    grpc::Status status = Send_(request, reply, deadline);
+    if (status.error_code() != grpc::UNAVAILABLE ||
+        retry >= options_.max_retries) {
+      return status;
+    }
+
+    const std::chrono::microseconds backoff = Backoff_(retry);
+    if (deadline - std::chrono::system_clock::now() < backoff) {
+      return status; // wouldn't be back in time
+    }
+    std::this_thread::sleep_for(backoff);
+  }
+}
+
+grpc::Status
+TBClient::Send_(TensorMessage &request, TensorMessage *reply,
+                const std::chrono::system_clock::time_point &deadline) {
+  CompletionQueue cq;
+  Attempt_ attempts[2];
+  int started = 0;
+  int pending = 0;
+
+  if (!Start_(attempts[0], request, deadline, &cq)) {
+    return attempts[0].status;
+  }
+  started++;
+  pending++;
+
+  bool hedge = options_.hedge_delay.count() > 0;
+  const std::chrono::system_clock::time_point hedge_at =
+      std::chrono::system_clock::now() + options_.hedge_delay;
+
+  Attempt_ *winner = nullptr;
+  while (pending > 0) {
+    void *tag = nullptr;
+    bool ok = false;
+    if (hedge && started == 1) {
+      if (cq.AsyncNext(&tag, &ok, hedge_at) == CompletionQueue::TIMEOUT) {
+        // The first is slow, race a copy on another channel against it
+        hedge = false;
+        if (Start_(attempts[1], request, deadline, &cq)) {
+          started++;
+          pending++;
+        }
+        continue;
+      }
+    } else {
+      cq.Next(&tag, &ok);
+    }
+    pending--;
+
+    Attempt_ *attempt = static_cast<Attempt_ *>(tag);
+    if (winner != nullptr) {
+      continue; // the loser of a race we already called
+    }
+
+    // A failure only counts once there's nothing else left to wait for
+    if (attempt->status.ok() || pending == 0) {
+      winner = attempt;
+      hedge = false;
+      for (int i = 0; i < started; i++) {
+        if (&attempts[i] != winner) {
+          attempts[i].context.TryCancel();
+        }
+      }
+    }
+  }
+
+  cq.Shutdown();
+  void *tag = nullptr;
+  bool ok = false;
+  while (cq.Next(&tag, &ok)) {
+  }
+
+  for (int i = 0; i < started; i++) {
+    // Cancelled on our side doesn't mean the server dropped it, an id that
+    // may still have a result coming isn't used again
+    if (options_.connect && !MayBeQueued_(attempts[i].status)) {
+      ReleaseId_(attempts[i].client_id);
+    }
+  }
+
+  reply->Swap(&winner->reply);
+  return winner->status;
+}
+
+bool TBClient::Start_(Attempt_ &attempt, TensorMessage &request,
+                      const std::chrono::system_clock::time_point &deadline,
+                      CompletionQueue *cq) {
+  if (options_.connect) {
+    attempt.status = AcquireId_(deadline, &attempt.client_id);
+    if (!attempt.status.ok()) {
+      return false;
+    }
+    request.set_client_id(attempt.client_id);
+  }
+
+  if (deadline != std::chrono::system_clock::time_point::max()) {
+    attempt.context.set_deadline(deadline);
+  }
+
+  // The request is serialized here, so a hedge can change its client id
+  attempt.reader = NextStub_()->AsyncProcess(&attempt.context, request, cq);
+  attempt.reader->Finish(&attempt.reply, &attempt.status, &attempt);
+  return true;
+}
+
+grpc::Status
+TBClient::AcquireId_(const std::chrono::system_clock::time_point &deadline,
+                     std::string *client_id) {
+  {
+    std::lock_guard<std::mutex> guard(ids_mutex_);
+    if (!free_ids_.empty()) {
+      *client_id = free_ids_.back();
+      free_ids_.pop_back();
+      return Status::OK;
+    }
+  }
+
+  ClientContext context;
+  if (deadline != std::chrono::system_clock::time_point::max()) {
+    context.set_deadline(deadline);
+  }
+  ConnectionReply rep;
+  grpc::Status status =
+      NextStub_()->Connect(&context, ConnectionRequest(), &rep);
+  *client_id = rep.client_id();
+  return status;
+}
+
+void TBClient::ReleaseId_(const std::string &client_id) {
+  std::lock_guard<std::mutex> guard(ids_mutex_);
+  free_ids_.push_back(client_id);
+}
+
+BatchingServer::Stub *TBClient::NextStub_() {
+  return stubs_[next_stub_++ % stubs_.size()].get();
+}
+
+std::chrono::microseconds TBClient::Backoff_(const int &retry) {
+  const long cap = std::min<long>(options_.max_backoff.count(),
+                                  options_.initial_backoff.count()
+                                      << std::min(retry, 20));
+
+  std::lock_guard<std::mutex> guard(rng_mutex_);
+  return std::chrono::microseconds(
+      std::uniform_int_distribution<long>(0, std::max(0L, cap))(rng_));
+}
+
+void TBClient::AsyncLoop_() {
+  while (true) {
+    Call_ call;
+    {
+      std::unique_lock<std::mutex> lock(calls_mutex_);
+      calls_cv_.wait(lock, [this]() { return stop_ || !calls_.empty(); });
+      if (calls_.empty()) {
+        return; // stopping, and every call made has been answered
+      }
+      call = std::move(calls_.front());
+      calls_.pop_front();
+    }
+
+    ProcessResult result;
+    result.status = Process_(call.request, &result.reply, call.deadline);
+    call.promise.set_value(std::move(result));
+  }
+}
+
+} // namespace Serving
@@ -0,0 +1,368 @@
+//
+// Created by Aman LaChapelle on 2/11/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "MicroBatcher.hpp"
+#include "Servable.hpp"
+#include "TBClient.hpp"
+#include "TBServer.hpp"
+#include "TensorRows.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace Serving {
+namespace {
+
+// Hands each client its own request back
+class KeyedEchoServable : public Servable {
+public:
+  ReturnCodes SetBatchSize(const int &new_size) override { return OK; }
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pending_[message.client_id()] = message;
+    return OK;
+  }
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto result = pending_.find(client_id);
+    if (result == pending_.end()) {
+      return NEXT_BATCH;
+    }
+    message->Swap(&result->second);
+    pending_.erase(result);
+    return OK;
+  }
+
+  ReturnCodes Bind(BindArgs &args) override { return OK; }
+
+private:
+  std::mutex mutex_;
+  std::map<std::string, TensorMessage> pending_;
+};
+
+// Turns the first few requests away, as a full queue would
+class FlakyServable : public KeyedEchoServable {
+public:
+  explicit FlakyServable(const int &failures) : failures_(failures) {}
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    if (failures_-- > 0) {
+      return NEXT_BATCH;
+    }
+    return KeyedEchoServable::AddToBatch(message);
+  }
+
+private:
+  std::atomic<int> failures_;
+};
+
+// Batches of at most max_rows
+class LimitedServable : public KeyedEchoServable {
+public:
+  explicit LimitedServable(const int &max_rows) : max_rows_(max_rows) {}
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    if (message.n() > max_rows_) {
+      return BATCH_TOO_LARGE;
+    }
+    return KeyedEchoServable::AddToBatch(message);
+  }
+
+private:
+  int max_rows_;
+};
+
+// Holds the first request back until it's drained, like a slow batch
+class SlowFirstServable : public KeyedEchoServable {
+public:
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (calls_++ == 0) {
+        cv_.wait(lock, [this]() { return drained_; });
+      }
+    }
+    return KeyedEchoServable::GetResult(client_id, message);
+  }
+
+  void Drain() override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    drained_ = true;
+    cv_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int calls_ = 0;
+  bool drained_ = false;
+};
+
+// Counts the calls that reach it
+class CountingServable : public KeyedEchoServable {
+public:
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    calls++;
+    return KeyedEchoServable::AddToBatch(message);
+  }
+
+  std::atomic<int> calls{0};
+};
+
+TensorMessage Rows(const int &n, const int &cols) {
+  TensorMessage msg;
+  for (int i = 0; i < n * cols; i++) {
+    msg.add_buffer(static_cast<float>(i));
+  }
+  msg.set_n(n);
+  msg.set_k(cols);
+  msg.set_nr(1);
+  msg.set_nc(1);
+  return msg;
+}
+
+TEST(Client, Process) {
+  TBServer srv(new KeyedEchoServable());
+  srv.StartInsecure("localhost:50062");
+
+  TBClientOptions options;
+  options.channels = 2;
+  TBClient client("localhost:50062", options);
+
+  TensorMessage msg = Rows(2, 3);
+  msg.set_client_id("mine");
+  TensorMessage reply;
+  EXPECT_TRUE(client.Process(msg, &reply).ok());
+  EXPECT_EQ(reply.n(), 2);
+  EXPECT_EQ(reply.buffer_size(), 6);
+  EXPECT_EQ(reply.client_id(), "mine");
+
+  // Calls in flight together each get their own client id
+  std::vector<std::future<ProcessResult>> results;
+  for (int i = 0; i < 16; i++) {
+    msg = Rows(1, 1);
+    msg.set_buffer(0, static_cast<float>(i));
+    results.push_back(client.ProcessAsync(msg));
+  }
+  for (int i = 0; i < 16; i++) {
+    ProcessResult result = results[i].get();
+    EXPECT_TRUE(result.status.ok());
+    ASSERT_EQ(result.reply.buffer_size(), 1);
+    EXPECT_EQ(result.reply.buffer(0), static_cast<float>(i));
+  }
+
+  srv.Stop();
+}
+
+TEST(Client, Retry) {
+  TBServer srv(new FlakyServable(3));
+  srv.StartInsecure("localhost:50063");
+
+  TBClientOptions options;
+  options.initial_backoff = std::chrono::microseconds(100);
+  options.max_retries = 3;
+  TBClient client("localhost:50063", options);
+
+  TensorMessage reply;
+  EXPECT_TRUE(client.Process(Rows(1, 1), &reply).ok());
+
+  srv.Stop();
+
+  // Nobody there, and the retries run out
+  TensorMessage gone;
+  EXPECT_EQ(client.Process(Rows(1, 1), &gone).error_code(),
+            grpc::UNAVAILABLE);
+}
+
+TEST(Client, Split) {
+  TBServer srv(new LimitedServable(2));
+  srv.StartInsecure("localhost:50064");
+
+  TBClient client("localhost:50064");
+  EXPECT_EQ(client.MaxRows(), 0);
+
+  // Too large as a whole, sent in pieces of 2, 2 and 1
+  TensorMessage msg = Rows(5, 3);
+  TensorMessage reply;
+  EXPECT_TRUE(client.Process(msg, &reply).ok());
+  EXPECT_EQ(client.MaxRows(), 2);
+  EXPECT_EQ(reply.n(), 5);
+  EXPECT_EQ(reply.k(), 3);
+  ASSERT_EQ(reply.buffer_size(), 15);
+  for (int i = 0; i < 15; i++) {
+    EXPECT_EQ(reply.buffer(i), static_cast<float>(i));
+  }
+
+  // Can't be told apart into rows
+  msg.set_serialized_buffer("opaque");
+  EXPECT_EQ(client.Process(msg, &reply).error_code(),
+            grpc::INVALID_ARGUMENT);
+
+  srv.Stop();
+}
+
+TEST(Client, Hedge) {
+  TBServer srv(new SlowFirstServable());
+  srv.StartInsecure("localhost:50065");
+
+  TBClientOptions options;
+  options.channels = 2;
+  options.hedge_delay = std::chrono::microseconds(20000);
+  TBClient client("localhost:50065", options);
+
+  // The first copy is stuck, the hedge answers
+  TensorMessage reply;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  EXPECT_TRUE(client.Process(Rows(1, 1), &reply).ok());
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  EXPECT_EQ(reply.n(), 1);
+
+  srv.Stop();
+}
+
+TEST(MicroBatcher, Gathers) {
+  CountingServable *servable = new CountingServable();
+  TBServer srv(servable);
+  srv.StartInsecure("localhost:50066");
+
+  TBClient client("localhost:50066");
+  MicroBatcherOptions options;
+  options.max_rows = 8;
+  options.max_delay = std::chrono::microseconds(10000000); // only when full
+
+  {
+    MicroBatcher batcher(&client, options);
+
+    // Eight threads with a row each fill one call
+    std::vector<ProcessResult> results(8);
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 8; i++) {
+      callers.emplace_back([&, i]() {
+        TensorMessage msg = Rows(1, 2);
+        msg.set_buffer(0, static_cast<float>(i));
+        msg.set_client_id("caller-" + std::to_string(i));
+        results[i] = batcher.Submit(msg).get();
+      });
+    }
+    for (std::thread &caller : callers) {
+      caller.join();
+    }
+
+    EXPECT_EQ(servable->calls, 1);
+    for (int i = 0; i < 8; i++) {
+      EXPECT_TRUE(results[i].status.ok());
+      EXPECT_EQ(results[i].reply.n(), 1);
+      ASSERT_EQ(results[i].reply.buffer_size(), 2);
+      EXPECT_EQ(results[i].reply.buffer(0), static_cast<float>(i));
+      EXPECT_EQ(results[i].reply.client_id(), "caller-" + std::to_string(i));
+    }
+  }
+
+  srv.Stop();
+}
+
+TEST(MicroBatcher, Delay) {
+  CountingServable *servable = new CountingServable();
+  TBServer srv(servable);
+  srv.StartInsecure("localhost:50067");
+
+  TBClient client("localhost:50067");
+  MicroBatcherOptions options;
+  options.max_rows = 8;
+  options.max_delay = std::chrono::microseconds(5000);
+
+  {
+    MicroBatcher batcher(&client, options);
+
+    // Not enough to fill a call, sent once the first has waited long enough.
+    // Rows of a different shape never share a call.
+    std::future<ProcessResult> first = batcher.Submit(Rows(2, 2));
+    std::future<ProcessResult> second = batcher.Submit(Rows(1, 2));
+    std::future<ProcessResult> other = batcher.Submit(Rows(1, 3));
+
+    ProcessResult result = first.get();
+    EXPECT_TRUE(result.status.ok());
+    EXPECT_EQ(result.reply.n(), 2);
+    EXPECT_EQ(result.reply.buffer_size(), 4);
+
+    result = second.get();
+    EXPECT_TRUE(result.status.ok());
+    ASSERT_EQ(result.reply.buffer_size(), 2);
+    EXPECT_EQ(result.reply.buffer(0), 0.f);
+
+    result = other.get();
+    EXPECT_TRUE(result.status.ok());
+    EXPECT_EQ(result.reply.buffer_size(), 3);
+
+    EXPECT_EQ(servable->calls, 2);
+  }
+
+  srv.Stop();
+}
+
+TEST(TensorRows, SliceAndAppend) {
+  TensorMessage reply;
+  reply.set_n(3);
+  reply.set_k(2);
+  reply.set_client_id("mine");
+  // Postprocessed, the rows kept 2, 0 and 1 values
+  for (float value : {0.9f, 0.1f, 0.7f}) {
+    reply.add_buffer(value);
+  }
+  for (int index : {4, 2, 0}) {
+    reply.add_indices(index);
+  }
+  for (int count : {2, 0, 1}) {
+    reply.add_counts(count);
+  }
+  NamedTensor *named = reply.add_named_outputs();
+  named->set_name("features");
+  *named->mutable_tensor() = Rows(3, 2);
+
+  TensorMessage first, rest;
+  ASSERT_TRUE(SliceRows(reply, 0, 1, &first));
+  ASSERT_TRUE(SliceRows(reply, 1, 2, &rest));
+  EXPECT_EQ(first.buffer_size(), 2);
+  EXPECT_EQ(rest.buffer_size(), 1);
+  EXPECT_EQ(rest.indices(0), 0);
+  EXPECT_EQ(rest.named_outputs(0).tensor().buffer(0), 2.f);
+  EXPECT_FALSE(SliceRows(reply, 2, 2, &rest));
+
+  TensorMessage joined;
+  AppendRows(first, &joined);
+  AppendRows(rest, &joined);
+  EXPECT_EQ(joined.SerializeAsString(), reply.SerializeAsString());
+}
+}
+} // namespace Serving::
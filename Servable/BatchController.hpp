@@ -0,0 +1,300 @@
+//
+// Created by Aman LaChapelle on 2/4/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_BATCHCONTROLLER_HPP
+#define BATCHING_RPC_SERVER_BATCHCONTROLLER_HPP
+
+// STL
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Project
+#include "Servable.hpp"
+
+namespace Serving {
+
+/**
+ * @class BatchController
+ * @brief Picks the batch size and flush timeout a Servable batches with, from
+ * what it measures of the traffic and the model.
+ *
+ * The controller records the rows that arrive, how long each forward pass
+ * takes at each batch size and how long each request takes from being queued
+ * to having its result. After every BatchingOptions::autotune_window requests
+ * it compares their p99 latency with BatchingOptions::target_p99. Over the
+ * target the batch size shrinks by a quarter, comfortably under it the batch
+ * size grows by an eighth, up to the bound batch size. The flush timeout is
+ * half of what the target leaves after a forward pass at the chosen size, so a
+ * partial batch is sent before its oldest request runs out of time.
+ *
+ * Without a target the controller only measures, the Servable batches at its
+ * bound size and waits for full batches as before. Each decision is logged to
+ * std::clog and the latest is available from Stats().
+ *
+ * The controller does its own locking, it's called from AddToBatch and from
+ * every replica's batching thread. It also keeps the Servable's current load,
+ * see Load(), in atomics so that health checks never wait on the batching.
+ */
+class BatchController {
+public:
+  explicit BatchController(const BatchingOptions &options);
+
+  /**
+   * @brief Whether the controller picks the batch size and flush timeout.
+   */
+  bool Enabled() const;
+
+  /**
+   * @brief The number of rows to batch.
+   *
+   * @param max_rows The bound batch size, which the result never exceeds.
+   */
+  int BatchSize(const int &max_rows);
+
+  /**
+   * @brief The longest the oldest pending request waits for its batch to
+   * fill, only meaningful when Enabled().
+   */
+  std::chrono::microseconds FlushTimeout();
+
+  /**
+   * @brief Records rows accepted into the queue.
+   */
+  void RecordArrival(const int &rows);
+
+  /**
+   * @brief Records how many rows are waiting in the queue now.
+   */
+  void RecordQueued(const int &rows);
+
+  /**
+   * @brief Records a batch taken from the queue, its forward pass is starting.
+   */
+  void RecordBatchStart();
+
+  /**
+   * @brief Records a finished batch.
+   *
+   * @param rows The rows the forward pass ran at, padding included.
+   * @param forward How long the forward pass took.
+   * @param latencies How long each request in the batch took from being
+   * queued to having its result.
+   */
+  void RecordBatch(const int &rows, const std::chrono::microseconds &forward,
+                   const std::vector<std::chrono::microseconds> &latencies);
+
+  /**
+   * @brief The controller's latest measurements and decisions.
+   */
+  BatchingStats Stats();
+
+  /**
+   * @brief The Servable's current load, doesn't lock.
+   */
+  LoadStats Load() const;
+
+private:
+  void Adjust_();
+
+  double ForwardAt_(const int &rows) const;
+
+  const BatchingOptions options_;
+
+  std::mutex mutex_;
+  int batch_size_; // 0 until the first batch tells us the bound size
+  int max_rows_;
+  std::chrono::microseconds flush_timeout_;
+  std::map<int, double> forward_us_; // smoothed forward time by batch rows
+  std::vector<double> latencies_us_; // this window's requests
+  int arrived_rows_;                 // this window's arrivals
+  std::chrono::steady_clock::time_point window_start_;
+  BatchingStats stats_;
+
+  std::atomic<int> queued_rows_;
+  std::atomic<int> batches_in_flight_;
+  std::atomic<int64_t> recent_forward_us_; // smoothed over all batch sizes
+};
+
+// Implementation
+
+inline BatchController::BatchController(const BatchingOptions &options)
+    : options_(options), batch_size_(0), max_rows_(0),
+      flush_timeout_(options.target_p99 / 2), arrived_rows_(0),
+      window_start_(std::chrono::steady_clock::now()), queued_rows_(0),
+      batches_in_flight_(0), recent_forward_us_(0) {
+  stats_.flush_timeout_us = static_cast<int>(flush_timeout_.count());
+}
+
+inline bool BatchController::Enabled() const {
+  return options_.target_p99.count() > 0;
+}
+
+inline int BatchController::BatchSize(const int &max_rows) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  max_rows_ = max_rows;
+  if (!Enabled() || batch_size_ <= 0 || batch_size_ > max_rows) {
+    return max_rows;
+  }
+  return batch_size_;
+}
+
+inline std::chrono::microseconds BatchController::FlushTimeout() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return flush_timeout_;
+}
+
+inline void BatchController::RecordArrival(const int &rows) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  arrived_rows_ += rows;
+}
+
+inline void BatchController::RecordQueued(const int &rows) {
+  queued_rows_ = rows;
+}
+
+inline void BatchController::RecordBatchStart() { batches_in_flight_++; }
+
+inline void BatchController::RecordBatch(
+    const int &rows, const std::chrono::microseconds &forward,
+    const std::vector<std::chrono::microseconds> &latencies) {
+  batches_in_flight_--;
+
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  const int64_t recent = recent_forward_us_;
+  recent_forward_us_ = recent == 0 ? forward.count()
+                                   : (4 * recent + forward.count()) / 5;
+
+  auto smoothed = forward_us_.find(rows);
+  if (smoothed == forward_us_.end()) {
+    forward_us_[rows] = forward.count();
+  } else {
+    smoothed->second = 0.8 * smoothed->second + 0.2 * forward.count();
+  }
+
+  for (const std::chrono::microseconds &latency : latencies) {
+    latencies_us_.push_back(latency.count());
+  }
+
+  if (static_cast<int>(latencies_us_.size()) >=
+      std::max(1, options_.autotune_window)) {
+    Adjust_();
+  }
+}
+
+inline BatchingStats BatchController::Stats() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  BatchingStats stats = stats_;
+  stats.batch_size = !Enabled() || batch_size_ <= 0 || batch_size_ > max_rows_
+                         ? max_rows_
+                         : batch_size_;
+  return stats;
+}
+
+inline LoadStats BatchController::Load() const {
+  LoadStats load;
+  load.queued_rows = queued_rows_;
+  load.batches_in_flight = batches_in_flight_;
+  load.forward_us = static_cast<double>(recent_forward_us_);
+  return load;
+}
+
+inline void BatchController::Adjust_() {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  const double seconds =
+      std::chrono::duration<double>(now - window_start_).count();
+
+  std::sort(latencies_us_.begin(), latencies_us_.end());
+  const double p99 = latencies_us_[std::min(
+      latencies_us_.size() - 1,
+      static_cast<size_t>(0.99 * latencies_us_.size()))];
+
+  stats_.p99_us = p99;
+  stats_.arrival_rate = seconds > 0.0 ? arrived_rows_ / seconds : 0.0;
+
+  latencies_us_.clear();
+  arrived_rows_ = 0;
+  window_start_ = now;
+
+  if (max_rows_ <= 0) {
+    return; // no batch has been formed yet
+  }
+
+  const int previous = batch_size_ <= 0 ? max_rows_ : batch_size_;
+  int next = std::min(previous, max_rows_);
+
+  if (Enabled()) {
+    const double target = options_.target_p99.count();
+    if (p99 > target) {
+      next = std::max(1, std::min(next - 1, next * 3 / 4));
+    } else if (p99 < 0.8 * target) {
+      next = std::min(max_rows_, next + std::max(1, next / 8));
+    }
+
+    // Whatever the target leaves once the batch has run is split between
+    // waiting for the batch to fill and queueing behind other batches
+    const double slack = std::max(0.0, target - ForwardAt_(next));
+    flush_timeout_ = std::chrono::microseconds(static_cast<long>(slack / 2));
+    batch_size_ = next;
+  }
+
+  stats_.forward_us = ForwardAt_(next);
+  stats_.flush_timeout_us = static_cast<int>(flush_timeout_.count());
+
+  if (next != previous) {
+    stats_.adjustments++;
+
+    std::ostringstream report;
+    report << "BatchController batch size " << previous << " -> " << next
+           << ", flush timeout " << flush_timeout_.count() << " us (p99 "
+           << static_cast<long>(p99) << " us, target "
+           << options_.target_p99.count() << " us, "
+           << static_cast<long>(stats_.arrival_rate) << " rows/s)\n";
+    std::clog << report.str();
+  }
+}
+
+inline double BatchController::ForwardAt_(const int &rows) const {
+  if (forward_us_.empty()) {
+    return 0.0;
+  }
+
+  // Nothing measured at this size yet, scale the nearest larger measurement
+  // down (or the largest up) by rows
+  auto measured = forward_us_.lower_bound(rows);
+  if (measured == forward_us_.end()) {
+    --measured;
+  }
+  return measured->second * rows / measured->first;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_BATCHCONTROLLER_HPP
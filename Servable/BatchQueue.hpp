@@ -0,0 +1,380 @@
+//
+// Created by Aman LaChapelle on 1/14/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_BATCHQUEUE_HPP
+#define BATCHING_RPC_SERVER_BATCHQUEUE_HPP
+
+// STL
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+// Project
+#include "Servable.hpp"
+
+namespace Serving {
+
+/**
+ * @brief A single request waiting to be placed into a batch.
+ *
+ * @tparam Payload The servable-specific representation of the request's rows,
+ * an mx::NDArray for the MXNetServable for example.
+ */
+template <typename Payload> struct PendingRequest {
+  std::string client_id; //!< the key the result is stored under
+  std::string flow;      //!< the client the rows count against for FAIR
+  int n;
+  int priority;
+  std::chrono::system_clock::time_point deadline;
+  uint64_t arrival;
+  std::chrono::steady_clock::time_point queued;
+  Payload payload;
+};
+
+/**
+ * @class BatchQueue
+ * @brief Holds the requests a Servable has accepted but not yet processed and
+ * decides which of them go into the next batch.
+ *
+ * With SchedulingPolicy::FIFO requests leave the queue in arrival order. With
+ * SchedulingPolicy::EDF they leave by priority class, then earliest deadline,
+ * then arrival order, and smaller requests may backfill a batch that the
+ * request at the head of the queue does not fit in. With
+ * SchedulingPolicy::FAIR each client has its own arrival ordered queue and
+ * batches are filled from them by deficit round-robin: every visit credits a
+ * client with its weight in rows, and its requests join the batch while its
+ * credit covers them. A client sending large requests therefore waits a few
+ * rounds for its credit to build up while clients sending small ones are
+ * served every round.
+ *
+ * The queue does no locking of its own, the owning Servable guards it with its
+ * input mutex.
+ */
+template <typename Payload> class BatchQueue {
+public:
+  explicit BatchQueue(const SchedulingPolicy &policy,
+                      const std::map<std::string, double> &weights = {});
+
+  /**
+   * @brief Adds a request to the queue in scheduling order.
+   *
+   * @param client_id The client the rows belong to.
+   * @param flow The client the rows are charged to under
+   * SchedulingPolicy::FAIR, which may differ from client_id when results are
+   * routed per call.
+   * @param n The number of rows in the request.
+   * @param priority The request's priority class, higher goes first.
+   * @param info The request's deadline.
+   * @param payload The rows themselves.
+   */
+  void Push(const std::string &client_id, const std::string &flow,
+            const int &n, const int &priority, const RequestInfo &info,
+            Payload &&payload);
+
+  /**
+   * @brief Removes the requests that make up the next batch.
+   *
+   * Requests from the same client are placed next to each other so that each
+   * client's rows form one contiguous range of the batch.
+   *
+   * A request larger than max_rows, queued before the batch size shrank,
+   * makes up a batch on its own once it reaches the head of the queue (under
+   * FAIR, once its client's turn comes), so the batch is never empty while
+   * requests are waiting.
+   *
+   * @param max_rows The size of the batch.
+   * @return The requests in the batch, with at most max_rows rows in total
+   * unless it is a single larger request.
+   */
+  std::vector<PendingRequest<Payload>> PopBatch(const int &max_rows);
+
+  /**
+   * @brief The number of rows waiting in the queue.
+   */
+  int PendingRows() const;
+
+  /**
+   * @brief Whether there are no requests waiting in the queue.
+   */
+  bool Empty() const;
+
+  /**
+   * @brief When the longest waiting request was queued, only meaningful when
+   * the queue isn't Empty().
+   */
+  std::chrono::steady_clock::time_point OldestQueued() const;
+
+private:
+  struct Flow_ {
+    std::list<PendingRequest<Payload>> requests;
+    double deficit = 0.0;
+  };
+
+  bool Before_(const PendingRequest<Payload> &lhs,
+               const PendingRequest<Payload> &rhs) const;
+
+  bool PopOversized_(const int &max_rows,
+                     std::vector<PendingRequest<Payload>> *batch);
+
+  int PopFair_(const int &max_rows,
+               std::vector<PendingRequest<Payload>> *batch);
+
+  double Weight_(const std::string &flow) const;
+
+  SchedulingPolicy policy_;
+  std::list<PendingRequest<Payload>> queue_;
+  std::map<std::string, Flow_> flows_;
+  std::list<std::string> round_; // flows with requests waiting, in turn order
+  std::map<std::string, double> weights_;
+  int pending_rows_;
+  uint64_t arrivals_;
+};
+
+// Implementation
+
+template <typename Payload>
+BatchQueue<Payload>::BatchQueue(
+    const SchedulingPolicy &policy,
+    const std::map<std::string, double> &weights)
+    : policy_(policy), weights_(weights), pending_rows_(0), arrivals_(0) {}
+
+template <typename Payload>
+void BatchQueue<Payload>::Push(const std::string &client_id,
+                               const std::string &flow, const int &n,
+                               const int &priority, const RequestInfo &info,
+                               Payload &&payload) {
+  PendingRequest<Payload> request{client_id,
+                                  flow,
+                                  n,
+                                  priority,
+                                  info.deadline,
+                                  arrivals_++,
+                                  std::chrono::steady_clock::now(),
+                                  std::move(payload)};
+  pending_rows_ += n;
+
+  if (policy_ == FAIR) {
+    Flow_ &share = flows_[flow];
+    if (share.requests.empty()) {
+      round_.push_back(flow); // newcomers take their turn after everyone else
+    }
+    share.requests.push_back(std::move(request));
+    return;
+  }
+
+  // New requests usually belong at (or near) the back, so search from there
+  auto position = queue_.end();
+  while (position != queue_.begin() &&
+         Before_(request, *std::prev(position))) {
+    --position;
+  }
+
+  queue_.insert(position, std::move(request));
+}
+
+template <typename Payload>
+std::vector<PendingRequest<Payload>>
+BatchQueue<Payload>::PopBatch(const int &max_rows) {
+  std::vector<PendingRequest<Payload>> batch;
+  if (PopOversized_(max_rows, &batch)) {
+    pending_rows_ -= batch.front().n;
+    return batch;
+  }
+
+  int rows = policy_ == FAIR ? PopFair_(max_rows, &batch) : 0;
+
+  auto request = queue_.begin();
+  while (request != queue_.end() && rows < max_rows) {
+    if (rows + request->n > max_rows) {
+      if (policy_ == FIFO) {
+        break; // arrival order is strict, nobody jumps the queue
+      }
+      ++request;
+      continue;
+    }
+
+    rows += request->n;
+    batch.push_back(std::move(*request));
+    request = queue_.erase(request);
+  }
+
+  pending_rows_ -= rows;
+
+  // Group each client's requests together, keeping the order of first arrival
+  std::vector<PendingRequest<Payload>> grouped;
+  grouped.reserve(batch.size());
+  std::vector<bool> taken(batch.size(), false);
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (taken[i]) {
+      continue;
+    }
+    const std::string client_id = batch[i].client_id;
+    for (size_t j = i; j < batch.size(); j++) {
+      if (!taken[j] && batch[j].client_id == client_id) {
+        taken[j] = true;
+        grouped.push_back(std::move(batch[j]));
+      }
+    }
+  }
+
+  return grouped;
+}
+
+template <typename Payload> int BatchQueue<Payload>::PendingRows() const {
+  return pending_rows_;
+}
+
+template <typename Payload> bool BatchQueue<Payload>::Empty() const {
+  return queue_.empty() && round_.empty();
+}
+
+template <typename Payload>
+std::chrono::steady_clock::time_point
+BatchQueue<Payload>::OldestQueued() const {
+  std::chrono::steady_clock::time_point oldest =
+      std::chrono::steady_clock::time_point::max();
+  for (const PendingRequest<Payload> &request : queue_) {
+    oldest = std::min(oldest, request.queued);
+  }
+  for (const auto &flow : flows_) {
+    if (!flow.second.requests.empty()) { // each client's queue is in order
+      oldest = std::min(oldest, flow.second.requests.front().queued);
+    }
+  }
+  return oldest;
+}
+
+template <typename Payload>
+bool BatchQueue<Payload>::Before_(const PendingRequest<Payload> &lhs,
+                                  const PendingRequest<Payload> &rhs) const {
+  if (policy_ == EDF) {
+    if (lhs.priority != rhs.priority) {
+      return lhs.priority > rhs.priority;
+    }
+    if (lhs.deadline != rhs.deadline) {
+      return lhs.deadline < rhs.deadline;
+    }
+  }
+
+  return lhs.arrival < rhs.arrival;
+}
+
+template <typename Payload>
+bool BatchQueue<Payload>::PopOversized_(
+    const int &max_rows, std::vector<PendingRequest<Payload>> *batch) {
+  if (policy_ != FAIR) {
+    if (queue_.empty() || queue_.front().n <= max_rows) {
+      return false;
+    }
+    batch->push_back(std::move(queue_.front()));
+    queue_.pop_front();
+    return true;
+  }
+
+  if (round_.empty()) {
+    return false;
+  }
+  const std::string flow = round_.front();
+  Flow_ &share = flows_[flow];
+  if (share.requests.front().n <= max_rows) {
+    return false;
+  }
+
+  // A whole batch to itself uses up all of the client's credit
+  round_.pop_front();
+  batch->push_back(std::move(share.requests.front()));
+  share.requests.pop_front();
+  if (share.requests.empty()) {
+    flows_.erase(flow);
+  } else {
+    share.deficit = 0.0;
+    round_.push_back(flow);
+  }
+  return true;
+}
+
+template <typename Payload>
+int BatchQueue<Payload>::PopFair_(
+    const int &max_rows, std::vector<PendingRequest<Payload>> *batch) {
+  int rows = 0;
+
+  while (rows < max_rows) {
+    // Stop once no client's next request fits in what is left of the batch,
+    // otherwise every round brings someone closer to being served
+    bool fits = false;
+    for (const std::string &flow : round_) {
+      if (rows + flows_[flow].requests.front().n <= max_rows) {
+        fits = true;
+        break;
+      }
+    }
+    if (!fits) {
+      break;
+    }
+
+    for (size_t turns = round_.size(); turns > 0 && rows < max_rows; turns--) {
+      const std::string flow = round_.front();
+      round_.pop_front();
+
+      Flow_ &share = flows_[flow];
+      share.deficit += Weight_(flow);
+
+      while (!share.requests.empty() &&
+             share.requests.front().n <= share.deficit &&
+             rows + share.requests.front().n <= max_rows) {
+        rows += share.requests.front().n;
+        share.deficit -= share.requests.front().n;
+        batch->push_back(std::move(share.requests.front()));
+        share.requests.pop_front();
+      }
+
+      if (share.requests.empty()) {
+        flows_.erase(flow); // credit isn't saved up while a client is idle
+      } else {
+        // A request that didn't fit keeps its credit for the next batch, but
+        // no more than a batch's worth
+        share.deficit = std::min(share.deficit, static_cast<double>(max_rows));
+        round_.push_back(flow);
+      }
+    }
+  }
+
+  return rows;
+}
+
+template <typename Payload>
+double BatchQueue<Payload>::Weight_(const std::string &flow) const {
+  auto weight = weights_.find(flow);
+  if (weight == weights_.end() || weight->second <= 0.0) {
+    return 1.0;
+  }
+  return weight->second;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_BATCHQUEUE_HPP
@@ -0,0 +1,127 @@
+//
+// Created by Aman LaChapelle on 2/7/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_DLIBIMAGEDECODER_HPP
+#define BATCHING_RPC_SERVER_DLIBIMAGEDECODER_HPP
+
+// STL
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// POSIX
+#include <unistd.h>
+
+// Dlib
+#include "dlib/image_io.h"
+#include "dlib/image_transforms.h"
+
+// Project
+#include "MappedFile.hpp"
+
+namespace Serving {
+
+template <typename PixelType>
+bool DecodeImage_(const std::string &path, const int &rows, const int &cols,
+                  uint8_t *pixels) {
+  dlib::matrix<PixelType> image;
+  try {
+    dlib::load_image(image, path); // picks the format from the header
+  } catch (const dlib::error &) {
+    return false;
+  }
+  if (image.size() == 0) {
+    return false;
+  }
+
+  dlib::matrix<PixelType> resized(rows, cols);
+  dlib::resize_image(image, resized);
+
+  const int channels = sizeof(PixelType);
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < cols; c++) {
+      const uint8_t *pixel = reinterpret_cast<const uint8_t *>(&resized(r, c));
+      std::copy(pixel, pixel + channels, pixels + (r * cols + c) * channels);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Decodes a JPEG or PNG image and resizes it, for
+ * PreprocessingOptions::decoder.
+ *
+ * dlib only loads images from files, so the encoded bytes are written to an
+ * anonymous in-memory file (see CreateSharedMemory) that dlib reads back
+ * through /dev/fd. Images are resized bilinearly to rows x cols whatever
+ * their aspect ratio.
+ *
+ * @param encoded The file's bytes, JPEG and PNG need dlib built with
+ * DLIB_JPEG_SUPPORT and DLIB_PNG_SUPPORT.
+ * @param rows The height to resize to.
+ * @param cols The width to resize to.
+ * @param channels 3 for RGB or 1 for grayscale.
+ * @param pixels Room for rows * cols * channels bytes, written in HWC order.
+ * @return false if the image couldn't be decoded.
+ */
+inline bool DlibDecodeImage(const std::string &encoded, const int &rows,
+                            const int &cols, const int &channels,
+                            uint8_t *pixels) {
+  if (channels != 1 && channels != 3) {
+    return false;
+  }
+
+  static std::atomic<unsigned> decodes(0);
+  const int fd =
+      CreateSharedMemory("BatchingRPCServer-decode-" +
+                         std::to_string(decodes.fetch_add(1)));
+  if (fd < 0) {
+    return false;
+  }
+
+  // pwrite leaves the offset at 0, where a /dev/fd that shares it with fd
+  // starts reading
+  size_t written = 0;
+  while (written < encoded.size()) {
+    const ssize_t n = pwrite(fd, encoded.data() + written,
+                             encoded.size() - written, written);
+    if (n <= 0) {
+      close(fd);
+      return false;
+    }
+    written += n;
+  }
+
+  const std::string path = "/dev/fd/" + std::to_string(fd);
+  const bool decoded =
+      channels == 3
+          ? DecodeImage_<dlib::rgb_pixel>(path, rows, cols, pixels)
+          : DecodeImage_<unsigned char>(path, rows, cols, pixels);
+
+  close(fd);
+  return decoded;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_DLIBIMAGEDECODER_HPP
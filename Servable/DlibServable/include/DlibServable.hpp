@@ -24,16 +24,27 @@
 #define BATCHINGRPCSERVER_DLIBSERVABLE_HPP
 
 // STL
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <sstream>
 #include <thread>
+#include <vector>
 
 // Dlib
 #include "dlib/dnn.h"
 
 // Project
+#include "BatchController.hpp"
+#include "BatchQueue.hpp"
+#include "MappedFile.hpp"
+#include "Placement.hpp"
 #include "Servable.hpp"
 
 // Generated
@@ -57,31 +68,85 @@ template <
     >
 class DlibServable : public Servable {
 public:
-  DlibServable(const int &batch_size);
+  DlibServable(const int &batch_size,
+               const BatchingOptions &options = BatchingOptions());
   ~DlibServable() override;
 
   ReturnCodes SetBatchSize(const int &new_size) override;
 
   ReturnCodes AddToBatch(const TensorMessage &message) override;
 
+  ReturnCodes AddToBatch(const TensorMessage &message,
+                         const RequestInfo &info) override;
+
   ReturnCodes GetResult(const std::string &client_id,
                         TensorMessage *message) override;
 
   ReturnCodes Bind(BindArgs &args) override;
 
+  bool IsReady() override;
+
+  void Discard(const std::string &client_id) override;
+
+  void Drain() override;
+
+  BatchingStats GetBatchingStats() override;
+
+  LoadStats GetLoad() override;
+
+  /**
+   * @brief Sets the input used to build synthetic batches for warmup.
+   *
+   * dlib can't make up a valid input for an arbitrary network, so warmup only
+   * runs once an example input has been given. Call this before Bind.
+   *
+   * @param input A valid input for the network, its content doesn't matter.
+   */
+  void SetWarmupInput(const InputType &input);
+
 private:
+  // Where a replica runs, its network lives in the bound Model_
+  struct Replica_ {
+    std::mutex mutex;      // held while a batch is in the network
+    std::vector<int> cpus; // empty if the replica isn't pinned
+    int node = -1;         // the NUMA node of cpus[0]
+  };
+
+  // Everything that's replaced when a new model is bound. dlib networks hold
+  // per-call state, so each replica gets a full copy of the network. Each
+  // batch holds a reference, so a model is freed once the last batch using it
+  // is done.
+  struct Model_ {
+    std::vector<NetType> nets; // the first is the master
+  };
+
   void SetBatchSize_(const int &new_size);
-  void ProcessCurrentBatch_();
+  void CopyReplicas_(Model_ &model);
+  void WarmUp_(Model_ &model, const int &batch_size);
+  bool BatchReady_();
+  int BatchRows_();
+  void BatchLoop_(const int &replica);
+  void ProcessBatch_(std::vector<PendingRequest<std::vector<InputType>>> &batch,
+                     NetType &net);
 
 private:
-  NetType servable_;
 
   std::mutex input_mutex_;
-  std::map<std::string, std::pair<int, int>> idx_by_client_;
-  std::vector<InputType> current_batch_;
+  std::condition_variable batch_cv_; // wakes the batching threads
+  std::condition_variable space_cv_; // wakes callers waiting for queue space
+  BatchQueue<std::vector<InputType>> pending_;
+  bool flush_requested_;
+  bool draining_; // partial batches go straight away
+  bool stop_;
+  BatchController controller_;
+
+  std::vector<std::unique_ptr<Replica_>> replicas_;
+  std::vector<std::thread> batch_threads_; // one per replica
+  std::shared_ptr<Model_> model_;          // swapped under input_mutex_
 
-  int current_n_;
   int batch_size_;
+  BatchingOptions options_;
+  std::unique_ptr<InputType> warmup_input_;
 
   std::atomic<bool> bind_called_;
 
@@ -89,23 +154,47 @@ private:
   std::condition_variable result_cv_;
   std::set<std::string> done_processing_by_client_;
   std::map<std::string, std::vector<OutputType>> result_by_client_;
+  std::set<std::string> discarded_; // dropped as they come out of a batch
 };
 
 // Implementation
 
 template <class NetType, class InputType, class OutputType>
 DlibServable<NetType, InputType, OutputType>::DlibServable(
-    const int &batch_size) {
-  servable_ = NetType();
-  current_n_ = 0;
+    const int &batch_size, const BatchingOptions &options)
+    : pending_(options.policy, options.client_weights), controller_(options) {
+  flush_requested_ = false;
+  draining_ = false;
+  stop_ = false;
   batch_size_ = batch_size;
+  options_ = options;
   bind_called_ = false;
-  current_batch_.reserve(batch_size_);
+
+  const int n_replicas = std::max(1, options_.replicas);
+  for (int i = 0; i < n_replicas; i++) {
+    replicas_.emplace_back(new Replica_);
+    if (!options_.replica_cpus.empty()) {
+      replicas_.back()->cpus =
+          options_.replica_cpus[i % options_.replica_cpus.size()];
+      replicas_.back()->node = NumaNodeOf(replicas_.back()->cpus.front());
+    }
+  }
+
+  for (int i = 0; i < n_replicas; i++) {
+    batch_threads_.emplace_back(&DlibServable::BatchLoop_, this, i);
+  }
 }
 
 template <class NetType, class InputType, class OutputType>
 DlibServable<NetType, InputType, OutputType>::~DlibServable() {
-  ;
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    stop_ = true;
+  }
+  batch_cv_.notify_all();
+  for (auto &batch_thread : batch_threads_) {
+    batch_thread.join();
+  }
 }
 
 template <class NetType, class InputType, class OutputType>
@@ -113,11 +202,12 @@ ReturnCodes DlibServable<NetType, InputType, OutputType>::SetBatchSize(
     const int &new_size) {
   std::lock_guard<std::mutex> guard_input(input_mutex_);
 
-  if (new_size <= current_n_) {
+  if (new_size <= pending_.PendingRows()) {
     return ReturnCodes::NEXT_BATCH;
   }
 
   this->SetBatchSize_(new_size);
+  space_cv_.notify_all();
 
   return ReturnCodes::OK;
 }
@@ -125,7 +215,14 @@ ReturnCodes DlibServable<NetType, InputType, OutputType>::SetBatchSize(
 template <class NetType, class InputType, class OutputType>
 ReturnCodes DlibServable<NetType, InputType, OutputType>::AddToBatch(
     const TensorMessage &message) {
-  const std::string &client_id = message.client_id();
+  return AddToBatch(message, RequestInfo());
+}
+
+template <class NetType, class InputType, class OutputType>
+ReturnCodes DlibServable<NetType, InputType, OutputType>::AddToBatch(
+    const TensorMessage &message, const RequestInfo &info) {
+  const std::string &client_id =
+      info.result_key.empty() ? message.client_id() : info.result_key;
   std::vector<InputType> message_input(message.n());
   std::istringstream message_stream(message.serialized_buffer(),
                                     std::ios::binary);
@@ -147,33 +244,41 @@ ReturnCodes DlibServable<NetType, InputType, OutputType>::AddToBatch(
 
   {
 
-    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    std::unique_lock<std::mutex> lk(input_mutex_);
 
-    if (message.n() + current_n_ > batch_size_) {
-      this->SetBatchSize_(current_n_);
-      ProcessCurrentBatch_();
-      return ReturnCodes::NEXT_BATCH;
-    }
+    const int max_pending = batch_size_ * options_.max_pending_batches;
 
-    result_by_client_.erase(client_id); // clears room for the new result
+    // If a full batch is waiting on the batching thread then there will be
+    // room once it has been taken
+    space_cv_.wait(lk, [&, this]() {
+      return message.n() + pending_.PendingRows() <= max_pending ||
+             pending_.PendingRows() < batch_size_;
+    });
 
-    if (idx_by_client_.find(client_id) == idx_by_client_.end()) {
-      idx_by_client_[client_id] =
-          std::make_pair(current_n_, current_n_ + message.n());
-    } else {
-      idx_by_client_[client_id].second += message.n();
+    if (message.n() + pending_.PendingRows() > max_pending) {
+      flush_requested_ = true;
+      batch_cv_.notify_one();
+      return ReturnCodes::NEXT_BATCH;
     }
 
-    // Clients could send us multiple inputs, we need to deal with that
-    // properly.
-    current_batch_.insert(current_batch_.end(), message_input.begin(),
-                          message_input.end());
+    {
+      std::lock_guard<std::mutex> guard_result(result_mutex_);
+      result_by_client_.erase(client_id); // clears room for the new result
+    }
 
-    current_n_ += message.n();
-    if (current_n_ <= batch_size_) {
-      if (current_n_ == batch_size_) {
-        ProcessCurrentBatch_();
-      }
+    // Clients could send us multiple inputs, they stay together as one
+    // request in the queue.
+    pending_.Push(client_id, message.client_id(), message.n(),
+                  message.priority(), info,
+                  std::move(message_input));
+    controller_.RecordArrival(message.n());
+    controller_.RecordQueued(pending_.PendingRows());
+
+    // A flush timeout starts counting from the oldest request, so the
+    // batching thread has to hear about every arrival
+    if (pending_.PendingRows() >= BatchRows_() || draining_ ||
+        controller_.Enabled()) {
+      batch_cv_.notify_one();
     }
   }
 
@@ -211,51 +316,308 @@ ReturnCodes DlibServable<NetType, InputType, OutputType>::GetResult(
 
 template <class NetType, class InputType, class OutputType>
 ReturnCodes DlibServable<NetType, InputType, OutputType>::Bind(BindArgs &args) {
+  // The new model is built to the side, the old one keeps serving meanwhile
+  std::shared_ptr<Model_> model(new Model_);
+  model->nets.resize(replicas_.size());
+
+  bool loaded = false;
+
   try {
     DlibFileBindArgs &file_args = dynamic_cast<DlibFileBindArgs &>(args);
-    dlib::deserialize(file_args.filename) >> servable_;
-    bind_called_ = true;
-    return ReturnCodes::OK;
+
+    // Deserialize straight out of the page cache instead of through a
+    // buffered stream
+    MappedFile file;
+    if (file.Open(file_args.filename)) {
+      MappedStreamBuf file_buffer(file);
+      std::istream file_stream(&file_buffer);
+      dlib::deserialize(model->nets[0], file_stream);
+    } else {
+      dlib::deserialize(file_args.filename) >> model->nets[0];
+    }
+    loaded = true;
   } catch (std::bad_cast &e) {
     ;
   }
   try {
     DlibRawBindArgs<NetType> &raw_args =
         dynamic_cast<DlibRawBindArgs<NetType> &>(args);
-    servable_ = std::move(raw_args.net);
-    bind_called_ = true;
-    return ReturnCodes::OK;
+    model->nets[0] = std::move(raw_args.net);
+    loaded = true;
   } catch (std::bad_cast &e) {
     ;
   }
 
-  return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+  if (!loaded) {
+    return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+  }
+
+  CopyReplicas_(*model);
+
+  int batch_size;
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    batch_size = batch_size_;
+  }
+  WarmUp_(*model, batch_size);
+
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+
+    // Batches that are already running keep their reference to the old model,
+    // it's freed when the last of them finishes
+    model_.swap(model);
+    bind_called_ = true;
+  }
+
+  return ReturnCodes::OK;
+}
+
+template <class NetType, class InputType, class OutputType>
+bool DlibServable<NetType, InputType, OutputType>::IsReady() {
+  return bind_called_;
+}
+
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::Discard(
+    const std::string &client_id) {
+  std::lock_guard<std::mutex> guard_result(result_mutex_);
+  if (done_processing_by_client_.erase(client_id) > 0) {
+    result_by_client_.erase(client_id);
+  } else {
+    discarded_.insert(client_id);
+  }
+}
+
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::Drain() {
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    draining_ = true;
+  }
+  batch_cv_.notify_all();
+}
+
+template <class NetType, class InputType, class OutputType>
+BatchingStats
+DlibServable<NetType, InputType, OutputType>::GetBatchingStats() {
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    BatchRows_(); // tells the controller the bound batch size
+  }
+  return controller_.Stats();
+}
+
+template <class NetType, class InputType, class OutputType>
+LoadStats DlibServable<NetType, InputType, OutputType>::GetLoad() {
+  return controller_.Load();
+}
+
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::SetWarmupInput(
+    const InputType &input) {
+  warmup_input_.reset(new InputType(input));
 }
 
 template <class NetType, class InputType, class OutputType>
 void DlibServable<NetType, InputType, OutputType>::SetBatchSize_(
     const int &new_size) {
+  // Wait for the batches in the networks (if any) to finish
+  std::vector<std::unique_lock<std::mutex>> guard_replicas;
+  for (auto &replica : replicas_) {
+    guard_replicas.emplace_back(replica->mutex);
+  }
+
   batch_size_ = new_size;
-  current_batch_.reserve(batch_size_);
+
+  // The first batches at the new size would otherwise allocate the tensors
+  if (model_) {
+    WarmUp_(*model_, batch_size_);
+  }
 }
 
-template <class NetType, class InputType, typename OutputType>
-void DlibServable<NetType, InputType, OutputType>::ProcessCurrentBatch_() {
-  std::vector<OutputType> outputs = servable_(current_batch_);
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::CopyReplicas_(
+    Model_ &model) {
+  for (size_t i = 1; i < model.nets.size(); i++) {
+    model.nets[i] = model.nets[0];
+  }
+
+#ifndef DLIB_USE_CUDA
+  // The weights live in host memory, move each replica's copy next to it.
+  // Working buffers are allocated by the pinned thread on first use and so
+  // land on the right node by themselves.
+  if (options_.numa_local) {
+    for (size_t i = 0; i < model.nets.size(); i++) {
+      const int node = replicas_[i]->node;
+      dlib::visit_layer_parameters(
+          model.nets[i], [node](size_t, dlib::tensor &parameters) {
+            MoveToNumaNode(parameters.host(), parameters.size() * sizeof(float),
+                           node);
+          });
+    }
+  }
+#endif
+}
+
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::WarmUp_(
+    Model_ &model, const int &batch_size) {
+  if (!warmup_input_ || options_.warmup_iterations <= 0) {
+    return;
+  }
+
+  std::set<int> batch_sizes{batch_size};
+  for (const int &bucket : options_.batch_buckets) {
+    if (bucket > 0 && bucket < batch_size) {
+      batch_sizes.insert(bucket);
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  // dlib allocates its tensors on the first call at each size
+  for (const int &size : batch_sizes) {
+    std::vector<InputType> batch(size, *warmup_input_);
+    for (int i = 0; i < options_.warmup_iterations; i++) {
+      for (auto &net : model.nets) {
+        net(batch);
+      }
+    }
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  std::ostringstream report;
+  report << "DlibServable warmed up batch sizes";
+  for (const int &size : batch_sizes) {
+    report << " " << size;
+  }
+  report << " in " << elapsed.count() << " ms\n";
+  std::clog << report.str();
+}
+
+template <class NetType, class InputType, class OutputType>
+bool DlibServable<NetType, InputType, OutputType>::BatchReady_() {
+  if (stop_ || flush_requested_) {
+    return true;
+  }
+  if (pending_.Empty()) {
+    return false;
+  }
+
+  return draining_ || pending_.PendingRows() >= BatchRows_() ||
+         (controller_.Enabled() &&
+          std::chrono::steady_clock::now() >=
+              pending_.OldestQueued() + controller_.FlushTimeout());
+}
+
+template <class NetType, class InputType, class OutputType>
+int DlibServable<NetType, InputType, OutputType>::BatchRows_() {
+  return controller_.BatchSize(batch_size_);
+}
+
+template <class NetType, class InputType, class OutputType>
+void DlibServable<NetType, InputType, OutputType>::BatchLoop_(
+    const int &replica) {
+  const std::vector<int> &cpus = replicas_[replica]->cpus;
+  if (!cpus.empty()) {
+    const bool pinned = PinThread(cpus);
+    std::clog << DescribePlacement("DlibServable", replica, cpus,
+                                   replicas_[replica]->node, pinned);
+  }
+
+  while (true) {
+    std::unique_lock<std::mutex> lk(input_mutex_);
+    while (!BatchReady_()) {
+      if (controller_.Enabled() && !pending_.Empty()) {
+        batch_cv_.wait_until(lk, pending_.OldestQueued() +
+                                     controller_.FlushTimeout());
+      } else {
+        batch_cv_.wait(lk);
+      }
+    }
+
+    if (stop_) {
+      return;
+    }
+
+    flush_requested_ = false;
+    std::vector<PendingRequest<std::vector<InputType>>> batch =
+        pending_.PopBatch(BatchRows_());
+    controller_.RecordQueued(pending_.PendingRows());
+    space_cv_.notify_all();
+
+    // Another batch is ready to go, hand it to an idle replica
+    if (BatchReady_()) {
+      batch_cv_.notify_one();
+    }
+
+    if (batch.empty()) {
+      continue; // a flush with nothing queued, PopBatch takes something else
+    }
+    controller_.RecordBatchStart();
+
+    // The batch runs on whichever model is bound when it's formed, a Bind
+    // that happens meanwhile only affects the next batch
+    std::shared_ptr<Model_> model = model_;
+
+    std::lock_guard<std::mutex> guard_replica(replicas_[replica]->mutex);
+    lk.unlock();
 
-  for (auto &client_idx : idx_by_client_) {
-    result_by_client_[client_idx.first] =
-        std::vector<OutputType>(outputs.begin() + client_idx.second.first,
-                                outputs.begin() + client_idx.second.second);
-    done_processing_by_client_.emplace(client_idx.first);
+    ProcessBatch_(batch, model->nets[replica]);
   }
+}
 
-  idx_by_client_.clear();
+template <class NetType, class InputType, typename OutputType>
+void DlibServable<NetType, InputType, OutputType>::ProcessBatch_(
+    std::vector<PendingRequest<std::vector<InputType>>> &batch, NetType &net) {
+  std::map<std::string, std::pair<int, int>> idx_by_client;
+  std::vector<InputType> current_batch;
+  int current_n = 0;
+
+  for (auto &request : batch) {
+    if (idx_by_client.find(request.client_id) == idx_by_client.end()) {
+      idx_by_client[request.client_id] =
+          std::make_pair(current_n, current_n + request.n);
+    } else {
+      idx_by_client[request.client_id].second += request.n;
+    }
+    current_batch.insert(current_batch.end(), request.payload.begin(),
+                         request.payload.end());
+    current_n += request.n;
+  }
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<OutputType> outputs = net(current_batch);
+  const std::chrono::microseconds forward =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
 
-  // Reset everyone
-  current_batch_.clear();
+  {
+    std::lock_guard<std::mutex> guard_result(result_mutex_);
+    for (auto &client_idx : idx_by_client) {
+      if (discarded_.erase(client_idx.first) > 0) {
+        continue;
+      }
+      result_by_client_[client_idx.first] =
+          std::vector<OutputType>(outputs.begin() + client_idx.second.first,
+                                  outputs.begin() + client_idx.second.second);
+      done_processing_by_client_.emplace(client_idx.first);
+    }
+  }
   result_cv_.notify_all();
-  current_n_ = 0;
+
+  std::chrono::steady_clock::time_point done =
+      std::chrono::steady_clock::now();
+  std::vector<std::chrono::microseconds> latencies;
+  for (const auto &request : batch) {
+    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+        done - request.queued));
+  }
+  controller_.RecordBatch(current_n, forward, latencies);
 }
 
 } // namespace Serving
@@ -21,7 +21,9 @@
  */
 
 #include <dlib/data_io.h>
+#include <iostream>
 #include <sstream>
+#include <thread>
 
 #include "BatchingRPC.pb.h"
 #include "DlibServable.hpp"
@@ -210,4 +212,413 @@ TEST_F(TestDlibServable, NextBatch) {
   EXPECT_EQ(r, Serving::ReturnCodes::NEXT_BATCH);
 }
 
+TEST_F(TestDlibServable, DeadlineOrder) {
+  Serving::BatchingOptions options;
+  options.policy = Serving::EDF;
+  options.max_pending_batches = 2;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(3, options);
+
+  servable.Bind(raw_args);
+
+  Serving::RequestInfo relaxed;
+  relaxed.deadline =
+      std::chrono::system_clock::now() + std::chrono::seconds(3600);
+  Serving::RequestInfo urgent;
+  urgent.deadline = std::chrono::system_clock::now() + std::chrono::seconds(1);
+
+  Serving::TensorMessage msg1 = ToMessage({input_[0]});
+  msg1.set_client_id("relaxed1");
+  Serving::TensorMessage msg2 = ToMessage({input_[1]});
+  msg2.set_client_id("relaxed2");
+  Serving::TensorMessage big = ToMessage({input_[0], input_[1]});
+  big.set_client_id("urgent");
+
+  Serving::ReturnCodes r;
+  r = servable.AddToBatch(msg1, relaxed);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.AddToBatch(msg2, relaxed);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  // Arrives last but has the earliest deadline, so it goes in the first batch
+  // along with relaxed1 - in arrival order it wouldn't fit in the first batch
+  r = servable.AddToBatch(big, urgent);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("urgent", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  std::istringstream output_buffer(output.serialized_buffer(),
+                                   std::ios::binary);
+  std::vector<unsigned long> results;
+  deserialize(results, output_buffer);
+  EXPECT_EQ(results.size(), 2);
+  EXPECT_EQ(results[0], 7);
+
+  r = servable.GetResult("relaxed1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // relaxed2 is still pending, fill the batch so it gets processed
+  Serving::TensorMessage fill = ToMessage({input_[0], input_[1]});
+  fill.set_client_id("fill");
+  r = servable.AddToBatch(fill);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  r = servable.GetResult("relaxed2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+}
+
+TEST_F(TestDlibServable, Replicas) {
+  Serving::BatchingOptions options;
+  options.replicas = 2;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(1, options);
+
+  int n_clients = 8;
+  std::vector<unsigned long> expected = raw_args.net(
+      std::vector<matrix<unsigned char>>(input_.begin(),
+                                         input_.begin() + n_clients));
+
+  servable.Bind(raw_args);
+
+  std::vector<std::thread> add_threads;
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage msg = ToMessage({input_[i]});
+    msg.set_client_id("test" + std::to_string(i));
+    add_threads.emplace_back([&servable, msg]() {
+      EXPECT_EQ(servable.AddToBatch(msg), Serving::ReturnCodes::OK);
+    });
+  }
+
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage output;
+    Serving::ReturnCodes r =
+        servable.GetResult("test" + std::to_string(i), &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    std::istringstream output_buffer(output.serialized_buffer(),
+                                     std::ios::binary);
+    std::vector<unsigned long> results;
+    deserialize(results, output_buffer);
+    EXPECT_EQ(results.size(), 1);
+    // Every replica is a copy of the same network
+    EXPECT_EQ(results[0], expected[i]);
+  }
+
+  for (auto &add_thread : add_threads) {
+    add_thread.join();
+  }
+}
+
+TEST_F(TestDlibServable, Pinned) {
+  Serving::BatchingOptions options;
+  options.replicas = 2;
+  options.replica_cpus = {{0}};
+  options.numa_local = true;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(1, options);
+
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage({input_[0]});
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  std::istringstream output_buffer(output.serialized_buffer(),
+                                   std::ios::binary);
+
+  std::vector<unsigned long> results;
+  deserialize(results, output_buffer);
+  // Placement must not change the prediction
+  EXPECT_EQ(results[0], 7);
+}
+
+TEST_F(TestDlibServable, Rebind) {
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(1);
+
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage({input_[0]});
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Rebinding while a request is in flight doesn't disturb it
+  r = servable.Bind(file_args);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  for (int i = 0; i < 2; i++) {
+    Serving::TensorMessage output;
+    r = servable.GetResult("test", &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+    std::istringstream output_buffer(output.serialized_buffer(),
+                                     std::ios::binary);
+
+    std::vector<unsigned long> results;
+    deserialize(results, output_buffer);
+    EXPECT_EQ(results[0], 7);
+
+    if (i == 0) {
+      r = servable.AddToBatch(msg);
+      EXPECT_EQ(r, Serving::ReturnCodes::OK);
+    }
+  }
+}
+
+TEST_F(TestDlibServable, Warmup) {
+  Serving::BatchingOptions options;
+  options.batch_buckets = {1, 2};
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(4, options);
+
+  EXPECT_FALSE(servable.IsReady());
+  servable.SetWarmupInput(input_[0]);
+  servable.Bind(raw_args);
+  EXPECT_TRUE(servable.IsReady());
+
+  Serving::TensorMessage msg = ToMessage({input_[0], input_[0]});
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  std::istringstream output_buffer(output.serialized_buffer(),
+                                   std::ios::binary);
+
+  std::vector<unsigned long> results;
+  deserialize(results, output_buffer);
+  EXPECT_EQ(results.size(), 4);
+  for (auto &result : results) {
+    EXPECT_EQ(result, 7);
+  }
+
+  // A new batch size is warmed up before SetBatchSize returns
+  std::ostringstream report;
+  std::streambuf *clog_buffer = std::clog.rdbuf(report.rdbuf());
+  r = servable.SetBatchSize(8);
+  std::clog.rdbuf(clog_buffer);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_NE(report.str().find("warmed up batch sizes 1 2 8 "),
+            std::string::npos);
+}
+
+TEST_F(TestDlibServable, Drain) {
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(4);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage({input_[0]});
+  msg.set_client_id("test");
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Nothing else is coming, the partial batch runs as it is
+  servable.Drain();
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Requests that arrive afterwards don't wait either
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+}
+
+TEST_F(TestDlibServable, ResultKey) {
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(2);
+  servable.Bind(raw_args);
+
+  // Two calls from the same client, each with its own result
+  Serving::TensorMessage msg = ToMessage({input_[0]});
+  msg.set_client_id("test");
+  Serving::RequestInfo info;
+  info.result_key = "call-1";
+  Serving::ReturnCodes r = servable.AddToBatch(msg, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  info.result_key = "call-2";
+  r = servable.AddToBatch(msg, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("call-1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("call-2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+}
+
+TEST_F(TestDlibServable, FairShare) {
+  Serving::BatchingOptions options;
+  options.policy = Serving::FAIR;
+  options.max_pending_batches = 2;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(4, options);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage small = ToMessage({input_[0]});
+  small.set_client_id("heavy");
+  Serving::TensorMessage big = ToMessage({input_[1], input_[2]});
+  big.set_client_id("heavy");
+  Serving::TensorMessage light = ToMessage({input_[3], input_[4]});
+  light.set_client_id("light");
+
+  Serving::RequestInfo info;
+  Serving::ReturnCodes r;
+  info.result_key = "heavy-1";
+  r = servable.AddToBatch(small, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  info.result_key = "heavy-2";
+  r = servable.AddToBatch(big, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  // Arrives last, but heavy has already had its turn so light goes in the
+  // first batch - in arrival order it wouldn't fit
+  info.result_key = "light";
+  r = servable.AddToBatch(light, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("light", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("heavy-1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // heavy-2 is still pending
+  servable.Drain();
+
+  r = servable.GetResult("heavy-2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  std::istringstream output_buffer(output.serialized_buffer(),
+                                   std::ios::binary);
+  std::vector<unsigned long> results;
+  deserialize(results, output_buffer);
+  EXPECT_EQ(results.size(), 2);
+}
+
+TEST_F(TestDlibServable, Autotune) {
+  Serving::BatchingOptions options;
+  options.target_p99 = std::chrono::microseconds(1); // can't be met
+  options.autotune_window = 1;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(4, options);
+  servable.Bind(raw_args);
+
+  EXPECT_EQ(servable.GetBatchingStats().batch_size, 4);
+
+  // Each request goes on its own once the flush timeout passes, and every
+  // batch misses the target so the batch size comes down each time
+  for (int i = 0; i < 4; i++) {
+    Serving::TensorMessage msg = ToMessage({input_[i]});
+    msg.set_client_id("test");
+    Serving::ReturnCodes r = servable.AddToBatch(msg);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    Serving::TensorMessage output;
+    r = servable.GetResult("test", &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  }
+
+  Serving::BatchingStats stats = servable.GetBatchingStats();
+  EXPECT_EQ(stats.batch_size, 1);
+  EXPECT_EQ(stats.adjustments, 3);
+  EXPECT_GT(stats.p99_us, 0.0);
+}
+
+TEST_F(TestDlibServable, AutotuneShrunk) {
+  Serving::BatchingOptions options;
+  options.target_p99 = std::chrono::microseconds(1); // can't be met
+  options.autotune_window = 1;
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(4, options);
+  servable.Bind(raw_args);
+
+  for (int i = 0; i < 4; i++) {
+    Serving::TensorMessage msg = ToMessage({input_[i]});
+    msg.set_client_id("test");
+    Serving::ReturnCodes r = servable.AddToBatch(msg);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    Serving::TensorMessage output;
+    r = servable.GetResult("test", &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  }
+  EXPECT_EQ(servable.GetBatchingStats().batch_size, 1);
+
+  // Fits the bound size but not the shrunken one, it goes on its own and
+  // what's queued behind it follows
+  Serving::TensorMessage big = ToMessage({input_[0], input_[0], input_[0]});
+  big.set_client_id("big");
+  Serving::ReturnCodes r = servable.AddToBatch(big);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  Serving::TensorMessage small = ToMessage({input_[0]});
+  small.set_client_id("small");
+  r = servable.AddToBatch(small);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("big", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  std::istringstream output_buffer(output.serialized_buffer(),
+                                   std::ios::binary);
+  std::vector<unsigned long> results;
+  deserialize(results, output_buffer);
+  EXPECT_EQ(results.size(), 3);
+  for (auto &result : results) {
+    EXPECT_EQ(result, 7);
+  }
+
+  r = servable.GetResult("small", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+}
+
+TEST_F(TestDlibServable, Load) {
+  Serving::DlibServable<net_type, matrix<unsigned char>, unsigned long>
+      servable(2);
+  EXPECT_FALSE(servable.IsReady());
+  servable.Bind(raw_args);
+  EXPECT_TRUE(servable.IsReady());
+
+  Serving::LoadStats load = servable.GetLoad();
+  EXPECT_EQ(load.queued_rows, 0);
+  EXPECT_EQ(load.batches_in_flight, 0);
+  EXPECT_EQ(load.forward_us, 0.0);
+
+  // Half a batch waits in the queue
+  Serving::TensorMessage msg = ToMessage({input_[0]});
+  msg.set_client_id("first");
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(servable.GetLoad().queued_rows, 1);
+
+  msg.set_client_id("second");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  EXPECT_EQ(servable.GetResult("first", &output), Serving::ReturnCodes::OK);
+  EXPECT_EQ(servable.GetResult("second", &output), Serving::ReturnCodes::OK);
+
+  // The batch is counted out just after its results are handed over
+  while (servable.GetLoad().batches_in_flight > 0) {
+    std::this_thread::yield();
+  }
+  load = servable.GetLoad();
+  EXPECT_EQ(load.queued_rows, 0);
+  EXPECT_GT(load.forward_us, 0.0);
+}
+
 } // namespace
@@ -27,13 +27,21 @@
 #include <atomic>
 #include <condition_variable>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
+#include <vector>
 
 // MXNet
 #include "mxnet-cpp/MxNetCpp.h"
 
 // Project
+#include "BatchController.hpp"
+#include "BatchQueue.hpp"
+#include "MappedFile.hpp"
+#include "Placement.hpp"
+#include "Postprocessing.hpp"
 #include "Servable.hpp"
 
 // Generated
@@ -53,10 +61,20 @@ struct FileBindArgs : public BindArgs {
   std::string parameters_filename;
 };
 
+/**
+ * @brief Binds from a parameter file in the mapped format, see
+ * MappedParameters. Convert a .params file once with ConvertParameters.
+ */
+struct MappedBindArgs : public BindArgs {
+  std::string symbol_filename;
+  std::string parameters_filename;
+};
+
 class MXNetServable : public Servable {
 public:
-  MXNetServable(const mx::Shape &input_shape, const mx::Shape &output_shape,
-                const mx::DeviceType &type, const int &device_id);
+  MXNetServable(const mx::Shape &input_shape, const mx::DeviceType &type,
+                const int &device_id,
+                const BatchingOptions &options = BatchingOptions());
 
   ~MXNetServable() override;
 
@@ -64,46 +82,113 @@ public:
 
   ReturnCodes AddToBatch(const TensorMessage &message) override;
 
+  ReturnCodes AddToBatch(const TensorMessage &message,
+                         const RequestInfo &info) override;
+
   ReturnCodes GetResult(const std::string &client_id,
                         TensorMessage *message) override;
 
   ReturnCodes Bind(BindArgs &args) override;
 
+  bool IsReady() override;
+
+  void Discard(const std::string &client_id) override;
+
+  void Drain() override;
+
+  BatchingStats GetBatchingStats() override;
+
+  LoadStats GetLoad() override;
+
 private:
+  // Where a replica runs, its executor lives in the bound Model_
+  struct Replica_ {
+    std::mutex mutex;      // held while a batch is in the executor
+    std::vector<int> cpus; // empty if the replica isn't pinned
+    int node = -1;         // the NUMA node of cpus[0]
+  };
+
+  // Everything that's replaced when a new model is bound. Each batch holds a
+  // reference, so a model is freed once the last batch using it is done.
+  struct Model_ {
+    ~Model_();
+
+    mx::Symbol symbol;
+    std::map<std::string, mx::NDArray>
+        args_map; // model parameters are args, each replica adds its data
+    std::map<std::string, mx::NDArray> aux_map; // everyone else is aux
+    std::vector<std::string> output_names;      // in executor output order
+    // One input and executor per replica for each bound batch size
+    std::map<mx_uint, std::vector<mx::NDArray>> data;
+    std::map<mx_uint, std::vector<mx::Executor *>> executors;
+  };
+
   void SetBatchSize_(const int &new_size);
 
-  void BindExecutor_();
+  void BindExecutor_(Model_ &model, const mx::Shape &input_shape);
 
-  void LoadParameters_(std::map<std::string, mx::NDArray> &parameters);
+  void WarmUp_(Model_ &model);
 
-  void ProcessCurrentBatch_();
+  void LoadParameters_(std::map<std::string, mx::NDArray> &parameters,
+                       Model_ &model, const bool &owned);
+
+  bool LoadMappedParameters_(const std::string &filename, Model_ &model);
+
+  bool NumaLocal_(const Replica_ &replica) const;
+
+  std::map<std::string, mx::NDArray>
+  CopyToNode_(const std::map<std::string, mx::NDArray> &arrays,
+              const int &node);
+
+  void MoveToNode_(const mx::NDArray &array, const int &node);
+
+  bool BatchReady_();
+
+  int BatchRows_();
+
+  void BatchLoop_(const int &replica);
+
+  void ProcessBatch_(std::vector<PendingRequest<mx::NDArray>> &batch,
+                     Model_ &model, const int &replica);
+
+  void CopyOutput_(const mx::NDArray &output, const int &first,
+                   const int &rows, const Postprocessing &postprocessing,
+                   TensorMessage *message);
+
+  // What a client asked to have sent back
+  struct ResultOptions_ {
+    Postprocessing postprocessing;
+    std::vector<std::string> outputs; // empty for the first output
+  };
 
   // Basic I/O requirements
   std::atomic<bool> bind_called_;
-  mx::Shape input_shape_;
-  mx::Shape output_shape_;
+  mx::Shape input_shape_; // outputs take whatever shape the model gives them
+  BatchingOptions options_;
 
   // Information for processing
   std::mutex input_mutex_;
-  std::map<std::string, std::pair<mx_uint, mx_uint>> idx_by_client_;
-  std::vector<mx::NDArray> current_batch_; // TODO: 2 current_batches so we can
-                                           // have a daemon thread running
-                                           // processing?
+  std::condition_variable batch_cv_; // wakes the batching threads
+  std::condition_variable space_cv_; // wakes callers waiting for queue space
+  BatchQueue<mx::NDArray> pending_;
+  bool flush_requested_;
+  bool draining_; // partial batches go straight away
+  bool stop_;
+  BatchController controller_;
 
-  mx_uint current_n_;
+  std::vector<std::unique_ptr<Replica_>> replicas_;
+  std::vector<std::thread> batch_threads_; // one per replica
 
   std::mutex result_mutex_;
   std::condition_variable result_cv_;
   std::set<std::string> done_processing_by_client_;
-  std::map<std::string, mx::NDArray> result_by_client_;
+  std::map<std::string, TensorMessage> result_by_client_;
+  std::map<std::string, ResultOptions_> result_options_by_client_;
+  std::set<std::string> discarded_; // dropped as they come out of a batch
 
   // MXNet requirements for running
   mx::Context ctx_;
-  mx::Symbol servable_;
-  mx::Executor *executor_;
-  std::map<std::string, mx::NDArray>
-      args_map_; // inputs (data and model parameters) are args
-  std::map<std::string, mx::NDArray> aux_map_; // everyone else is aux
+  std::shared_ptr<Model_> model_; // swapped under input_mutex_
 };
 
 } // namespace Serving
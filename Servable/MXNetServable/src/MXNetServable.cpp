@@ -22,37 +22,80 @@
 
 #include "MXNetServable.hpp"
 
+// STL
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
 namespace Serving {
 
 MXNetServable::MXNetServable(const mx::Shape &input_shape,
-                             const mx::Shape &output_shape,
-                             const mx::DeviceType &type, const int &device_id)
-    : input_shape_(input_shape), output_shape_(output_shape),
-      ctx_(type, device_id), bind_called_(false), current_n_(0) {
+                             const mx::DeviceType &type, const int &device_id,
+                             const BatchingOptions &options)
+    : bind_called_(false), input_shape_(input_shape), options_(options),
+      pending_(options.policy, options.client_weights), flush_requested_(false),
+      draining_(false), stop_(false), controller_(options),
+      ctx_(type, device_id) {
+
+  const int n_replicas = std::max(1, options_.replicas);
+
+  // The engine reads these when it starts, each replica's operators run on
+  // their own engine worker with replica_threads OpenMP threads
+  if (options_.replica_threads > 0) {
+    setenv("MXNET_CPU_WORKER_NTHREADS", std::to_string(n_replicas).c_str(), 0);
+    setenv("OMP_NUM_THREADS",
+           std::to_string(options_.replica_threads).c_str(), 0);
+  }
+
+  for (int i = 0; i < n_replicas; i++) {
+    replicas_.emplace_back(new Replica_);
+    if (!options_.replica_cpus.empty()) {
+      replicas_.back()->cpus =
+          options_.replica_cpus[i % options_.replica_cpus.size()];
+      replicas_.back()->node = NumaNodeOf(replicas_.back()->cpus.front());
+    }
+  }
 
-  args_map_["data"] = mx::NDArray(input_shape_, ctx_);
+  for (int i = 0; i < n_replicas; i++) {
+    batch_threads_.emplace_back(&MXNetServable::BatchLoop_, this, i);
+  }
 }
 
 MXNetServable::~MXNetServable() {
-  if (bind_called_)
-    delete executor_;
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    stop_ = true;
+  }
+  batch_cv_.notify_all();
+  for (auto &batch_thread : batch_threads_) {
+    batch_thread.join();
+  }
 }
 
 ReturnCodes MXNetServable::SetBatchSize(const int &new_size) {
   std::lock_guard<std::mutex> guard_input(input_mutex_);
 
-  if (new_size <= current_n_) {
+  if (new_size <= pending_.PendingRows()) {
     return ReturnCodes::NEXT_BATCH;
   }
 
   this->SetBatchSize_(new_size);
+  space_cv_.notify_all();
 
   return ReturnCodes::OK;
 }
 
 ReturnCodes MXNetServable::AddToBatch(const TensorMessage &message) {
+  return AddToBatch(message, RequestInfo());
+}
 
-  const std::string &client_id = message.client_id();
+ReturnCodes MXNetServable::AddToBatch(const TensorMessage &message,
+                                      const RequestInfo &info) {
+
+  const std::string &client_id =
+      info.result_key.empty() ? message.client_id() : info.result_key;
 
   if (!bind_called_) {
     return ReturnCodes::NEED_BIND_CALL;
@@ -63,40 +106,68 @@ ReturnCodes MXNetServable::AddToBatch(const TensorMessage &message) {
   }
 
   if (message.k() != input_shape_[1] || message.nr() != input_shape_[2] ||
-      message.nc() != input_shape_[3]) {
+      message.nc() != input_shape_[3] ||
+      CheckPostprocessing(message.postprocessing()) != ReturnCodes::OK) {
     return ReturnCodes::SHAPE_INCORRECT;
   }
 
   {
 
-    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    std::unique_lock<std::mutex> lk(input_mutex_);
 
-    if (message.n() + current_n_ > input_shape_[0]) {
-      this->SetBatchSize_(current_n_);
-      ProcessCurrentBatch_();
-      return ReturnCodes::NEXT_BATCH;
+    const int batch_size = input_shape_[0];
+    const int max_pending = batch_size * options_.max_pending_batches;
+
+    // Names are checked against the model that's bound now
+    for (const std::string &name : message.outputs()) {
+      const std::vector<std::string> &names = model_->output_names;
+      if (std::find(names.begin(), names.end(), name) == names.end()) {
+        return ReturnCodes::SHAPE_INCORRECT;
+      }
     }
 
-    result_by_client_.erase(client_id); // clears room for the new result
+    // If a full batch is waiting on the batching thread then there will be
+    // room once it has been taken
+    space_cv_.wait(lk, [&, this]() {
+      return message.n() + pending_.PendingRows() <= max_pending ||
+             pending_.PendingRows() < batch_size;
+    });
 
-    if (idx_by_client_.find(client_id) == idx_by_client_.end()) {
-      idx_by_client_[client_id] =
-          std::make_pair(current_n_, current_n_ + message.n());
-    } else {
-      idx_by_client_[client_id].second += message.n();
+    if (message.n() + pending_.PendingRows() > max_pending) {
+      flush_requested_ = true;
+      batch_cv_.notify_one();
+      return ReturnCodes::NEXT_BATCH;
     }
 
-    current_batch_.emplace_back(mx::NDArray(
-        message.buffer().data(), mx::Shape(message.n(), input_shape_[1],
-                                           input_shape_[2], input_shape_[3]),
-        ctx_));
-
-    current_n_ += message.n();
-    if (current_n_ <= input_shape_[0]) {
-      if (current_n_ == input_shape_[0]) {
-        ProcessCurrentBatch_();
+    {
+      std::lock_guard<std::mutex> guard_result(result_mutex_);
+      result_by_client_.erase(client_id); // clears room for the new result
+      if (WantsPostprocessing(message.postprocessing()) ||
+          message.outputs_size() > 0) {
+        ResultOptions_ &result_options = result_options_by_client_[client_id];
+        result_options.postprocessing = message.postprocessing();
+        result_options.outputs.assign(message.outputs().begin(),
+                                      message.outputs().end());
+      } else {
+        result_options_by_client_.erase(client_id);
       }
     }
+
+    pending_.Push(client_id, message.client_id(), message.n(),
+                  message.priority(), info,
+                  mx::NDArray(message.buffer().data(),
+                              mx::Shape(message.n(), input_shape_[1],
+                                        input_shape_[2], input_shape_[3]),
+                              ctx_));
+    controller_.RecordArrival(message.n());
+    controller_.RecordQueued(pending_.PendingRows());
+
+    // A flush timeout starts counting from the oldest request, so the
+    // batching thread has to hear about every arrival
+    if (pending_.PendingRows() >= BatchRows_() || draining_ ||
+        controller_.Enabled()) {
+      batch_cv_.notify_one();
+    }
   }
 
   return ReturnCodes::OK;
@@ -118,120 +189,547 @@ ReturnCodes MXNetServable::GetResult(const std::string &client_id,
         }
       });
 
+  // Built by the batching thread, there's nothing left to copy
   auto result = result_by_client_.find(client_id);
-  mx::NDArray &result_array = result->second;
-
-  std::vector<mx_uint> result_shape = result_array.GetShape();
-
-  google::protobuf::RepeatedField<float> data(
-      result_array.GetData(), result_array.GetData() + result_array.Size());
-  message->mutable_buffer()->Swap(&data);
+  message->Swap(&result->second);
   result = result_by_client_.erase(result);
 
-  message->set_n(result_shape[0]);
-  message->set_k(result_shape[1]);
-  message->set_nr(result_shape[2]);
-  message->set_nc(result_shape[3]);
   message->set_client_id(client_id);
 
   return ReturnCodes::OK;
 }
 
 ReturnCodes MXNetServable::Bind(BindArgs &args) {
-  bind_called_ = true;
+  // The new model is built to the side, the old one keeps serving meanwhile
+  std::shared_ptr<Model_> model(new Model_);
+
+  bool loaded = false;
 
   try {
     RawBindArgs &raw_args = dynamic_cast<RawBindArgs &>(args);
-    servable_ = raw_args.net;
-    LoadParameters_(raw_args.parameters);
-    BindExecutor_();
-    return ReturnCodes::OK;
+    model->symbol = raw_args.net;
+    LoadParameters_(raw_args.parameters, *model, false);
+    loaded = true;
   } catch (std::bad_cast &e) {
     ;
   }
 
   try {
     FileBindArgs &file_args = dynamic_cast<FileBindArgs &>(args);
-    servable_ = mx::Symbol::Load(file_args.symbol_filename);
+    model->symbol = mx::Symbol::Load(file_args.symbol_filename);
     std::map<std::string, mx::NDArray> parameters =
         mx::NDArray::LoadToMap(file_args.parameters_filename);
-    LoadParameters_(parameters);
-    BindExecutor_();
-    return ReturnCodes::OK;
+    LoadParameters_(parameters, *model, true);
+    loaded = true;
   } catch (std::bad_cast &e) {
     ;
   }
 
-  return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+  try {
+    MappedBindArgs &mapped_args = dynamic_cast<MappedBindArgs &>(args);
+    model->symbol = mx::Symbol::Load(mapped_args.symbol_filename);
+    loaded = LoadMappedParameters_(mapped_args.parameters_filename, *model);
+  } catch (std::bad_cast &e) {
+    ;
+  }
+
+  if (!loaded) {
+    return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+  }
+
+  mx::Shape input_shape;
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    input_shape = input_shape_;
+  }
+
+  model->output_names = model->symbol.ListOutputs();
+  BindExecutor_(*model, input_shape);
+  WarmUp_(*model);
+
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+
+    // SetBatchSize ran while we were binding
+    if (input_shape[0] != input_shape_[0]) {
+      BindExecutor_(*model, input_shape_);
+      WarmUp_(*model);
+    }
+
+    // Batches that are already running keep their reference to the old model,
+    // it's freed when the last of them finishes
+    model_.swap(model);
+    bind_called_ = true;
+  }
+
+  return ReturnCodes::OK;
 }
 
+bool MXNetServable::IsReady() { return bind_called_; }
+
+void MXNetServable::Discard(const std::string &client_id) {
+  std::lock_guard<std::mutex> guard_result(result_mutex_);
+  if (done_processing_by_client_.erase(client_id) > 0) {
+    result_by_client_.erase(client_id);
+  } else {
+    discarded_.insert(client_id);
+  }
+}
+
+void MXNetServable::Drain() {
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    draining_ = true;
+  }
+  batch_cv_.notify_all();
+}
+
+BatchingStats MXNetServable::GetBatchingStats() {
+  {
+    std::lock_guard<std::mutex> guard_input(input_mutex_);
+    BatchRows_(); // tells the controller the bound batch size
+  }
+  return controller_.Stats();
+}
+
+LoadStats MXNetServable::GetLoad() { return controller_.Load(); }
+
 // Private methods //
 
+MXNetServable::Model_::~Model_() {
+  for (auto &bucket : executors) {
+    for (auto &executor : bucket.second) {
+      delete executor;
+    }
+  }
+}
+
 void MXNetServable::SetBatchSize_(const int &new_size) {
+  // Wait for the batches in the executors (if any) to finish
+  std::vector<std::unique_lock<std::mutex>> guard_replicas;
+  for (auto &replica : replicas_) {
+    guard_replicas.emplace_back(replica->mutex);
+  }
+
   // Reshape the input
   input_shape_ =
       mx::Shape(new_size, input_shape_[1], input_shape_[2], input_shape_[3]);
 
-  // Re-bind the executor with the new batch size
-  args_map_["data"] = mx::NDArray(input_shape_, ctx_);
-  BindExecutor_();
+  // Re-bind the executors with the new batch size
+  if (model_) {
+    BindExecutor_(*model_, input_shape_);
+    WarmUp_(*model_);
+  }
 }
 
-void MXNetServable::BindExecutor_() {
+void MXNetServable::BindExecutor_(Model_ &model, const mx::Shape &input_shape) {
+
+  // One copy of the parameters per NUMA node that has a replica on it
+  std::map<int, std::map<std::string, mx::NDArray>> args_by_node;
+  std::map<int, std::map<std::string, mx::NDArray>> aux_by_node;
+
+  // The full batch size is always bound, smaller buckets only if asked for
+  std::set<mx_uint> batch_sizes{input_shape[0]};
+  for (const int &bucket : options_.batch_buckets) {
+    if (bucket > 0 && bucket < static_cast<int>(input_shape[0])) {
+      batch_sizes.insert(bucket);
+    }
+  }
+
+  for (auto &bucket : model.executors) {
+    for (auto &executor : bucket.second) {
+      delete executor;
+    }
+  }
+  model.data.clear();
+  model.executors.clear();
+
+  for (const mx_uint &batch_size : batch_sizes) {
+    const mx::Shape bucket_shape(batch_size, input_shape[1], input_shape[2],
+                                 input_shape[3]);
+
+    for (size_t i = 0; i < replicas_.size(); i++) {
+      const Replica_ &replica = *replicas_[i];
+
+      // Allocated now rather than on first use so it can be placed
+      mx::NDArray data(bucket_shape, ctx_, false);
+      data = 0.f;
+
+      // The parameters are shared by every replica and bucket, only the input
+      // belongs to the executor
+      std::map<std::string, mx::NDArray> args(model.args_map);
+      std::map<std::string, mx::NDArray> aux(model.aux_map);
+
+      if (NumaLocal_(replica)) {
+        if (args_by_node.find(replica.node) == args_by_node.end()) {
+          args_by_node[replica.node] =
+              CopyToNode_(model.args_map, replica.node);
+          aux_by_node[replica.node] = CopyToNode_(model.aux_map, replica.node);
+        }
+        args = args_by_node[replica.node];
+        aux = aux_by_node[replica.node];
+        MoveToNode_(data, replica.node);
+      }
+
+      args["data"] = data;
+
+      mx::Executor *executor = model.symbol.SimpleBind(
+          ctx_, args, std::map<std::string, mx::NDArray>(),
+          std::map<std::string, mx::OpReqType>(), aux);
+
+      if (NumaLocal_(replica)) {
+        for (auto &output : executor->outputs) {
+          MoveToNode_(output, replica.node);
+        }
+      }
+
+      model.data[batch_size].push_back(data);
+      model.executors[batch_size].push_back(executor);
+    }
+  }
+}
+
+void MXNetServable::WarmUp_(Model_ &model) {
+  if (options_.warmup_iterations <= 0) {
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
 
-  executor_ = servable_.SimpleBind(
-      ctx_, args_map_, std::map<std::string, mx::NDArray>(),
-      std::map<std::string, mx::OpReqType>(), aux_map_);
+  // MXNet allocates its workspace and picks its kernels on the first Forward,
+  // get that out of the way before the model sees any traffic
+  for (auto &bucket : model.executors) {
+    for (int i = 0; i < options_.warmup_iterations; i++) {
+      for (auto &executor : bucket.second) {
+        executor->Forward(false);
+      }
+      for (auto &executor : bucket.second) {
+        executor->outputs[0].WaitToRead();
+      }
+    }
+  }
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
 
-  bind_called_ = true;
+  std::ostringstream report;
+  report << "MXNetServable warmed up batch sizes";
+  for (auto &bucket : model.executors) {
+    report << " " << bucket.first;
+  }
+  report << " in " << elapsed.count() << " ms\n";
+  std::clog << report.str();
 }
 
 void MXNetServable::LoadParameters_(
-    std::map<std::string, mx::NDArray> &parameters) {
+    std::map<std::string, mx::NDArray> &parameters, Model_ &model,
+    const bool &owned) {
   for (const auto &k : parameters) {
+    // Arrays we loaded ourselves are used as they are if they're already in
+    // the right place, the caller's arrays are always copied
+    mx::Context array_ctx = k.second.GetContext();
+    bool copy = !owned || array_ctx.GetDeviceType() != ctx_.GetDeviceType() ||
+                array_ctx.GetDeviceId() != ctx_.GetDeviceId();
+
     if (k.first.substr(0, 4) == "aux:") {
       auto name = k.first.substr(4, k.first.size() - 4);
-      aux_map_[name] = k.second.Copy(ctx_);
+      model.aux_map[name] = copy ? k.second.Copy(ctx_) : k.second;
     }
     if (k.first.substr(0, 4) == "arg:") {
       auto name = k.first.substr(4, k.first.size() - 4);
-      args_map_[name] = k.second.Copy(ctx_);
+      model.args_map[name] = copy ? k.second.Copy(ctx_) : k.second;
+    }
+  }
+
+  // Only wait on our own copies, batches may be running on the old model
+  for (const auto &k : model.aux_map) {
+    k.second.WaitToRead();
+  }
+  for (const auto &k : model.args_map) {
+    k.second.WaitToRead();
+  }
+}
+
+bool MXNetServable::LoadMappedParameters_(const std::string &filename,
+                                          Model_ &model) {
+  MappedParameters parameters;
+  if (!parameters.Open(filename)) {
+    return false;
+  }
+
+  // Each array goes from the page cache straight to the context, there's no
+  // parsing and no intermediate copy
+  for (const MappedArray &array : parameters.Arrays()) {
+    std::vector<mx_uint> shape(array.shape.begin(), array.shape.end());
+    mx::NDArray parameter(array.data, mx::Shape(shape), ctx_);
+
+    if (array.name.substr(0, 4) == "aux:") {
+      model.aux_map[array.name.substr(4)] = parameter;
     }
+    if (array.name.substr(0, 4) == "arg:") {
+      model.args_map[array.name.substr(4)] = parameter;
+    }
+  }
+
+  return true;
+}
+
+bool MXNetServable::NumaLocal_(const Replica_ &replica) const {
+  return options_.numa_local && replica.node >= 0 &&
+         ctx_.GetDeviceType() == mx::kCPU;
+}
+
+std::map<std::string, mx::NDArray>
+MXNetServable::CopyToNode_(const std::map<std::string, mx::NDArray> &arrays,
+                           const int &node) {
+  std::map<std::string, mx::NDArray> copies;
+  for (const auto &array : arrays) {
+    copies[array.first] = array.second.Copy(ctx_);
+  }
+
+  for (const auto &copy : copies) {
+    MoveToNode_(copy.second, node);
+  }
+
+  return copies;
+}
+
+void MXNetServable::MoveToNode_(const mx::NDArray &array, const int &node) {
+  array.WaitToRead(); // the pages have to exist before they can move
+  MoveToNumaNode(array.GetData(), array.Size() * sizeof(mx_float), node);
+}
+
+bool MXNetServable::BatchReady_() {
+  if (stop_ || flush_requested_) {
+    return true;
+  }
+  if (pending_.Empty()) {
+    return false;
   }
 
-  mx::NDArray::WaitAll();
+  return draining_ || pending_.PendingRows() >= BatchRows_() ||
+         (controller_.Enabled() &&
+          std::chrono::steady_clock::now() >=
+              pending_.OldestQueued() + controller_.FlushTimeout());
 }
 
-void MXNetServable::ProcessCurrentBatch_() {
+int MXNetServable::BatchRows_() {
+  return controller_.BatchSize(input_shape_[0]);
+}
+
+void MXNetServable::BatchLoop_(const int &replica) {
+  const std::vector<int> &cpus = replicas_[replica]->cpus;
+  if (!cpus.empty()) {
+    const bool pinned = PinThread(cpus);
+    std::clog << DescribePlacement("MXNetServable", replica, cpus,
+                                   replicas_[replica]->node, pinned);
+  }
+
+  while (true) {
+    std::unique_lock<std::mutex> lk(input_mutex_);
+    while (!BatchReady_()) {
+      if (controller_.Enabled() && !pending_.Empty()) {
+        batch_cv_.wait_until(lk, pending_.OldestQueued() +
+                                     controller_.FlushTimeout());
+      } else {
+        batch_cv_.wait(lk);
+      }
+    }
+
+    if (stop_) {
+      return;
+    }
+
+    flush_requested_ = false;
+    std::vector<PendingRequest<mx::NDArray>> batch =
+        pending_.PopBatch(BatchRows_());
+    controller_.RecordQueued(pending_.PendingRows());
+    space_cv_.notify_all();
+
+    // Another batch is ready to go, hand it to an idle replica
+    if (BatchReady_()) {
+      batch_cv_.notify_one();
+    }
+
+    if (batch.empty()) {
+      continue; // a flush with nothing queued, PopBatch takes something else
+    }
+    controller_.RecordBatchStart();
+
+    // The batch runs on whichever model is bound when it's formed, a Bind
+    // that happens meanwhile only affects the next batch
+    std::shared_ptr<Model_> model = model_;
+
+    // Take the executor before letting go of the queue so the batch size
+    // can't change underneath us
+    std::lock_guard<std::mutex> guard_replica(replicas_[replica]->mutex);
+    lk.unlock();
+
+    ProcessBatch_(batch, *model, replica);
+  }
+}
+
+void MXNetServable::ProcessBatch_(
+    std::vector<PendingRequest<mx::NDArray>> &batch, Model_ &model,
+    const int &replica) {
 
   //    mx::Operator("_contrib_MultiProposal")(current_batch_).Invoke(args_map_["data"]);
   //    // c++ just has to use the names
 
-  mx::Operator("concat")(current_batch_)
-      .SetParam("dim", 0)
-      .SetParam("num_args", current_batch_.size())
-      .Invoke(args_map_["data"]);
+  std::map<std::string, std::pair<mx_uint, mx_uint>> idx_by_client;
+  std::vector<mx::NDArray> current_batch;
+  mx_uint current_n = 0;
+
+  for (auto &request : batch) {
+    if (idx_by_client.find(request.client_id) == idx_by_client.end()) {
+      idx_by_client[request.client_id] =
+          std::make_pair(current_n, current_n + request.n);
+    } else {
+      idx_by_client[request.client_id].second += request.n;
+    }
+    current_batch.push_back(request.payload);
+    current_n += request.n;
+  }
 
-  executor_->Forward(false);
+  // A partial batch runs on the smallest bucket it fits in, padded out to
+  // that bucket's size rather than re-binding the executor
+  auto bucket = model.executors.lower_bound(current_n);
+  const mx_uint batch_size = bucket->first;
+  mx::Executor *executor = bucket->second[replica];
+
+  if (current_n < batch_size) {
+    mx::NDArray padding(mx::Shape(batch_size - current_n, input_shape_[1],
+                                  input_shape_[2], input_shape_[3]),
+                        ctx_);
+    padding = 0.f;
+    current_batch.push_back(padding);
+  }
 
-  mx::NDArray &result = executor_->outputs[0];
-  mx::NDArray::WaitAll();
+  // Only the outputs someone asked for are waited on and copied out
+  std::map<std::string, ResultOptions_> result_options;
+  std::set<size_t> heads;
+  {
+    std::lock_guard<std::mutex> guard_result(result_mutex_);
+    for (auto &client_idx : idx_by_client) {
+      auto options = result_options_by_client_.find(client_idx.first);
+      if (options != result_options_by_client_.end()) {
+        result_options[client_idx.first] = options->second;
+        result_options_by_client_.erase(options);
+      }
 
-  for (auto &client_idx : idx_by_client_) {
-    int client_batch_size = client_idx.second.second - client_idx.second.first;
-    result_by_client_[client_idx.first] =
-        mx::NDArray(mx::Shape(client_batch_size, output_shape_[1]), ctx_);
-    result.Slice(client_idx.second.first, client_idx.second.second)
-        .CopyTo(&result_by_client_[client_idx.first]);
-    done_processing_by_client_.emplace(client_idx.first);
+      const std::vector<std::string> &outputs =
+          result_options[client_idx.first].outputs;
+      if (outputs.empty()) {
+        heads.insert(0);
+      }
+      for (const std::string &name : outputs) {
+        heads.insert(std::find(model.output_names.begin(),
+                               model.output_names.end(), name) -
+                     model.output_names.begin());
+      }
+    }
   }
 
-  idx_by_client_.clear();
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  mx::Operator("concat")(current_batch)
+      .SetParam("dim", 0)
+      .SetParam("num_args", current_batch.size())
+      .Invoke(model.data[batch_size][replica]);
+
+  executor->Forward(false);
 
-  // Reset everyone
-  current_batch_.clear();
+  // Only wait on this replica's work, the other replicas keep running
+  for (const size_t &head : heads) {
+    if (head < executor->outputs.size()) {
+      executor->outputs[head].WaitToRead();
+    }
+  }
+
+  const std::chrono::microseconds forward =
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start);
+
+  // Each client's rows go straight from the executor's outputs into its
+  // response, postprocessed on the way if it asked, so the copy out is no
+  // bigger than what's sent back. The replica is ours until we return, its
+  // outputs can't be overwritten meanwhile.
+  std::map<std::string, TensorMessage> results;
+  for (auto &client_idx : idx_by_client) {
+    const int first = client_idx.second.first;
+    const int rows = client_idx.second.second - first;
+    const ResultOptions_ &options = result_options[client_idx.first];
+    TensorMessage &client_result = results[client_idx.first];
+
+    if (options.outputs.empty()) {
+      CopyOutput_(executor->outputs[0], first, rows, options.postprocessing,
+                  &client_result);
+    }
+    for (const std::string &name : options.outputs) {
+      // A model bound since the request was checked may not have it
+      const size_t head = std::find(model.output_names.begin(),
+                                    model.output_names.end(), name) -
+                          model.output_names.begin();
+      if (head >= executor->outputs.size()) {
+        continue;
+      }
+
+      NamedTensor *named = client_result.add_named_outputs();
+      named->set_name(name);
+      CopyOutput_(executor->outputs[head], first, rows,
+                  options.postprocessing, named->mutable_tensor());
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard_result(result_mutex_);
+    for (auto &client_result : results) {
+      if (discarded_.erase(client_result.first) > 0) {
+        continue;
+      }
+      result_by_client_[client_result.first].Swap(&client_result.second);
+      done_processing_by_client_.emplace(client_result.first);
+    }
+  }
   result_cv_.notify_all();
-  current_n_ = 0;
+
+  std::chrono::steady_clock::time_point done =
+      std::chrono::steady_clock::now();
+  std::vector<std::chrono::microseconds> latencies;
+  for (const auto &request : batch) {
+    latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+        done - request.queued));
+  }
+  // The forward pass ran at the bucket's size, padding included
+  controller_.RecordBatch(batch_size, forward, latencies);
+}
+
+void MXNetServable::CopyOutput_(const mx::NDArray &output, const int &first,
+                                const int &rows,
+                                const Postprocessing &postprocessing,
+                                TensorMessage *message) {
+  std::vector<mx_uint> shape = output.GetShape();
+  const int cols = static_cast<int>(output.Size() / shape[0]);
+  const mx_float *data = output.GetData() + first * cols;
+
+  if (WantsPostprocessing(postprocessing)) {
+    Postprocess(postprocessing, data, rows, cols, message);
+    return;
+  }
+
+  // Missing dimensions are 1, any past the fourth are folded into nc
+  shape.resize(std::max<size_t>(shape.size(), 4), 1);
+  for (size_t i = 4; i < shape.size(); i++) {
+    shape[3] *= shape[i];
+  }
+
+  google::protobuf::RepeatedField<float> buffer(data, data + rows * cols);
+  message->mutable_buffer()->Swap(&buffer);
+  message->set_n(rows);
+  message->set_k(shape[1]);
+  message->set_nr(shape[2]);
+  message->set_nc(shape[3]);
 }
 
 } // namespace Serving
@@ -20,12 +20,19 @@
     limitations under the License.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <map>
+#include <thread>
 
 #include "mxnet-cpp/MxNetCpp.h"
 
 #include "BatchingRPC.pb.h"
 #include "MXNetServable.hpp"
+#include "PipelineServable.hpp"
+#include "PreprocessingServable.hpp"
 #include "Servable.hpp"
 
 #include "gtest/gtest.h"
@@ -118,22 +125,19 @@ protected:
 };
 
 TEST_F(TestMXNetServable, Bind) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   EXPECT_NO_THROW(servable.Bind(raw_args));
 }
 
 TEST_F(TestMXNetServable, BindFile) {
-  Serving::MXNetServable servable(mx::Shape(16, 3, 256, 256),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(16, 3, 256, 256), mx::kCPU, 0);
 
   EXPECT_NO_THROW(servable.Bind(file_args));
 }
 
 TEST_F(TestMXNetServable, Single) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -154,8 +158,7 @@ TEST_F(TestMXNetServable, Single) {
 }
 
 TEST_F(TestMXNetServable, NoBind) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   Serving::TensorMessage msg = ToMessage(input);
   msg.set_client_id("no_bind");
@@ -165,8 +168,7 @@ TEST_F(TestMXNetServable, NoBind) {
 }
 
 TEST_F(TestMXNetServable, BadShape) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -178,8 +180,7 @@ TEST_F(TestMXNetServable, BadShape) {
 }
 
 TEST_F(TestMXNetServable, TooBig) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -191,8 +192,7 @@ TEST_F(TestMXNetServable, TooBig) {
 }
 
 TEST_F(TestMXNetServable, NextBatch) {
-  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -209,8 +209,7 @@ TEST_F(TestMXNetServable, NextBatch) {
 }
 
 TEST_F(TestMXNetServable, Multiple) {
-  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -236,8 +235,7 @@ TEST_F(TestMXNetServable, Multiple) {
 }
 
 TEST_F(TestMXNetServable, MultipleClients) {
-  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -276,8 +274,7 @@ TEST_F(TestMXNetServable, MultipleClients) {
 }
 
 TEST_F(TestMXNetServable, UpdateBatchSuccess) {
-  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 1);
+  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 1);
 
   servable.Bind(raw_args);
 
@@ -320,8 +317,7 @@ TEST_F(TestMXNetServable, UpdateBatchSuccess) {
 }
 
 TEST_F(TestMXNetServable, UpdateBatchFail) {
-  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 1);
+  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden), mx::kCPU, 1);
 
   servable.Bind(raw_args);
 
@@ -367,8 +363,7 @@ TEST_F(TestMXNetServable, UpdateBatchFail) {
 }
 
 TEST_F(TestMXNetServable, MultipleBatches) {
-  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden),
-                                  mx::Shape(1, n_hidden), mx::kCPU, 0);
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
 
   servable.Bind(raw_args);
 
@@ -416,4 +411,900 @@ TEST_F(TestMXNetServable, MultipleBatches) {
     EXPECT_EQ(output.buffer(i), 1.f);
   }
 }
+TEST_F(TestMXNetServable, DeadlineOrder) {
+  Serving::BatchingOptions options;
+  options.policy = Serving::EDF;
+  options.max_pending_batches = 2;
+  Serving::MXNetServable servable(mx::Shape(3, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+
+  servable.Bind(raw_args);
+
+  Serving::RequestInfo relaxed;
+  relaxed.deadline =
+      std::chrono::system_clock::now() + std::chrono::seconds(3600);
+  Serving::RequestInfo urgent;
+  urgent.deadline = std::chrono::system_clock::now() + std::chrono::seconds(1);
+
+  Serving::TensorMessage msg1 = ToMessage(input);
+  msg1.set_client_id("relaxed1");
+  Serving::TensorMessage msg2 = ToMessage(input);
+  msg2.set_client_id("relaxed2");
+  Serving::TensorMessage big = ToMessage(too_big);
+  big.set_client_id("urgent");
+
+  Serving::ReturnCodes r;
+  r = servable.AddToBatch(msg1, relaxed);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.AddToBatch(msg2, relaxed);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  // Arrives last but has the earliest deadline, so it goes in the first batch
+  // along with relaxed1 - in arrival order it wouldn't fit in the first batch
+  r = servable.AddToBatch(big, urgent);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("urgent", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 2);
+  output.clear_buffer();
+
+  r = servable.GetResult("relaxed1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+  output.clear_buffer();
+
+  // relaxed2 is still pending, fill the batch so it gets processed
+  Serving::TensorMessage fill = ToMessage(too_big);
+  fill.set_client_id("fill");
+  r = servable.AddToBatch(fill);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  r = servable.GetResult("relaxed2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+}
+
+TEST_F(TestMXNetServable, Replicas) {
+  Serving::BatchingOptions options;
+  options.replicas = 2;
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+
+  servable.Bind(raw_args);
+
+  int n_clients = 8;
+  std::vector<std::thread> add_threads;
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage msg = ToMessage(i % 2 == 0 ? input : zeros);
+    msg.set_client_id("test" + std::to_string(i));
+    add_threads.emplace_back(ThreadedAdd, &servable, msg);
+  }
+
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage output;
+    Serving::ReturnCodes r =
+        servable.GetResult("test" + std::to_string(i), &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+    EXPECT_EQ(output.n(), 1);
+
+    float expected = i % 2 == 0 ? 2.f * n_hidden + 1 : 1.f;
+    int buflen = output.buffer().size();
+    for (int j = 0; j < buflen; j++) {
+      EXPECT_EQ(output.buffer(j), expected);
+    }
+  }
+
+  for (auto &add_thread : add_threads) {
+    add_thread.join();
+  }
+}
+
+TEST_F(TestMXNetServable, Pinned) {
+  Serving::BatchingOptions options;
+  options.replicas = 2;
+  options.replica_cpus = {{0}};
+  options.numa_local = true;
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Placement must not change the result
+  int buflen = msg.buffer().size();
+  for (int i = 0; i < buflen; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+}
+
+TEST_F(TestMXNetServable, Rebind) {
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
+
+  servable.Bind(raw_args);
+
+  int n_clients = 8;
+  std::vector<std::thread> add_threads;
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage msg = ToMessage(input);
+    msg.set_client_id("test" + std::to_string(i));
+    add_threads.emplace_back(ThreadedAdd, &servable, msg);
+  }
+
+  // Swap in a new model while the clients are being served
+  Serving::RawBindArgs new_args;
+  new_args.net = fc;
+  mx::NDArray m(mx::Shape(n_hidden, n_hidden), *ctx);
+  m = 3.f;
+  new_args.parameters["arg:m"] = m;
+  new_args.parameters["arg:b"] = parms["arg:b"];
+  Serving::ReturnCodes r = servable.Bind(new_args);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  for (int i = 0; i < n_clients; i++) {
+    Serving::TensorMessage output;
+    r = servable.GetResult("test" + std::to_string(i), &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    // Each batch ran entirely on one model or the other
+    float first = output.buffer(0);
+    EXPECT_TRUE(first == 2.f * n_hidden + 1 || first == 3.f * n_hidden + 1);
+    int buflen = output.buffer().size();
+    for (int j = 0; j < buflen; j++) {
+      EXPECT_EQ(output.buffer(j), first);
+    }
+  }
+
+  for (auto &add_thread : add_threads) {
+    add_thread.join();
+  }
+
+  // Everything after the swap sees the new model
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  int buflen = output.buffer().size();
+  for (int i = 0; i < buflen; i++) {
+    EXPECT_EQ(output.buffer(i), 3.f * n_hidden + 1);
+  }
+}
+
+TEST_F(TestMXNetServable, Buckets) {
+  Serving::BatchingOptions options;
+  options.batch_buckets = {1};
+  options.warmup_iterations = 2;
+  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+
+  EXPECT_FALSE(servable.IsReady());
+  servable.Bind(raw_args);
+  EXPECT_TRUE(servable.IsReady());
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Doesn't fit, so the single pending row goes out on the size 1 bucket
+  Serving::TensorMessage big_msg = ToMessage(too_big);
+  big_msg.set_client_id("big");
+  r = servable.AddToBatch(big_msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::NEXT_BATCH);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+
+  int buflen = output.buffer().size();
+  for (int i = 0; i < buflen; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+}
+
+TEST_F(TestMXNetServable, Drain) {
+  Serving::MXNetServable servable(mx::Shape(4, 1, 1, n_hidden), mx::kCPU, 0);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Nothing else is coming, the partial batch runs as it is
+  servable.Drain();
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+
+  // Requests that arrive afterwards don't wait either
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+}
+
+TEST_F(TestMXNetServable, ResultKey) {
+  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0);
+  servable.Bind(raw_args);
+
+  // Two calls from the same client, each with its own result
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  Serving::RequestInfo info;
+  info.result_key = "call-1";
+  Serving::ReturnCodes r = servable.AddToBatch(msg, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  info.result_key = "call-2";
+  r = servable.AddToBatch(msg, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("call-1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+  r = servable.GetResult("call-2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+}
+
+TEST_F(TestMXNetServable, FairShare) {
+  Serving::BatchingOptions options;
+  options.policy = Serving::FAIR;
+  options.max_pending_batches = 2;
+  Serving::MXNetServable servable(mx::Shape(4, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage small = ToMessage(input);
+  small.set_client_id("heavy");
+  Serving::TensorMessage big = ToMessage(too_big);
+  big.set_client_id("heavy");
+  Serving::TensorMessage light = ToMessage(too_big);
+  light.set_client_id("light");
+
+  Serving::RequestInfo info;
+  Serving::ReturnCodes r;
+  info.result_key = "heavy-1";
+  r = servable.AddToBatch(small, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  info.result_key = "heavy-2";
+  r = servable.AddToBatch(big, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  // Arrives last, but heavy has already had its turn so light goes in the
+  // first batch - in arrival order it wouldn't fit
+  info.result_key = "light";
+  r = servable.AddToBatch(light, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("light", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 2);
+  output.clear_buffer();
+
+  r = servable.GetResult("heavy-1", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+  output.clear_buffer();
+
+  // heavy-2 is still pending
+  servable.Drain();
+
+  r = servable.GetResult("heavy-2", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 2);
+}
+
+TEST_F(TestMXNetServable, Autotune) {
+  Serving::BatchingOptions options;
+  options.target_p99 = std::chrono::microseconds(1); // can't be met
+  options.autotune_window = 1;
+  Serving::MXNetServable servable(mx::Shape(4, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+  servable.Bind(raw_args);
+
+  EXPECT_EQ(servable.GetBatchingStats().batch_size, 4);
+
+  // Each request goes on its own once the flush timeout passes, and every
+  // batch misses the target so the batch size comes down each time
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  for (int i = 0; i < 4; i++) {
+    Serving::ReturnCodes r = servable.AddToBatch(msg);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    Serving::TensorMessage output;
+    r = servable.GetResult("test", &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+    EXPECT_EQ(output.n(), 1);
+  }
+
+  Serving::BatchingStats stats = servable.GetBatchingStats();
+  EXPECT_EQ(stats.batch_size, 1);
+  EXPECT_EQ(stats.adjustments, 3);
+  EXPECT_GT(stats.p99_us, 0.0);
+}
+
+TEST_F(TestMXNetServable, AutotuneShrunk) {
+  Serving::BatchingOptions options;
+  options.target_p99 = std::chrono::microseconds(1); // can't be met
+  options.autotune_window = 1;
+  Serving::MXNetServable servable(mx::Shape(4, 1, 1, n_hidden), mx::kCPU, 0,
+                                  options);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  for (int i = 0; i < 4; i++) {
+    Serving::ReturnCodes r = servable.AddToBatch(msg);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+    Serving::TensorMessage output;
+    r = servable.GetResult("test", &output);
+    EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  }
+  EXPECT_EQ(servable.GetBatchingStats().batch_size, 1);
+
+  // Fits the bound size but not the shrunken one, it goes on its own and
+  // what's queued behind it follows
+  Serving::TensorMessage big = ToMessage(too_big);
+  big.set_client_id("big");
+  Serving::ReturnCodes r = servable.AddToBatch(big);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  msg.set_client_id("small");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("big", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 2);
+  for (int i = 0; i < output.buffer_size(); i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+
+  r = servable.GetResult("small", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+}
+
+TEST_F(TestMXNetServable, Load) {
+  Serving::MXNetServable servable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0);
+  EXPECT_FALSE(servable.IsReady());
+  servable.Bind(raw_args);
+  EXPECT_TRUE(servable.IsReady());
+
+  Serving::LoadStats load = servable.GetLoad();
+  EXPECT_EQ(load.queued_rows, 0);
+  EXPECT_EQ(load.batches_in_flight, 0);
+  EXPECT_EQ(load.forward_us, 0.0);
+
+  // Half a batch waits in the queue
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("first");
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(servable.GetLoad().queued_rows, 1);
+
+  msg.set_client_id("second");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  EXPECT_EQ(servable.GetResult("first", &output), Serving::ReturnCodes::OK);
+  EXPECT_EQ(servable.GetResult("second", &output), Serving::ReturnCodes::OK);
+
+  // The batch is counted out just after its results are handed over
+  while (servable.GetLoad().batches_in_flight > 0) {
+    std::this_thread::yield();
+  }
+  load = servable.GetLoad();
+  EXPECT_EQ(load.queued_rows, 0);
+  EXPECT_GT(load.forward_us, 0.0);
+}
+
+TEST_F(TestMXNetServable, Preprocessing) {
+  Serving::PreprocessingOptions options;
+  options.mean = {1.f};
+  options.stddev = {2.f};
+  Serving::PreprocessingServable servable(
+      new Serving::MXNetServable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0),
+      options);
+  servable.Bind(raw_args);
+
+  // (3 - 1) / 2 makes the same input of ones as the float tests
+  Serving::TensorMessage msg;
+  msg.set_pixels(std::string(n_hidden, 3));
+  msg.set_n(1);
+  msg.set_k(1);
+  msg.set_nr(1);
+  msg.set_nc(n_hidden);
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  for (int i = 0; i < n_hidden; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+
+  // Found once the request reaches the MXNetServable
+  msg.set_k(2);
+  msg.set_nc(n_hidden / 2);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+}
+
+TEST_F(TestMXNetServable, PreprocessingDecode) {
+  Serving::PreprocessingOptions options;
+  options.mean = {1.f};
+  options.stddev = {2.f};
+  // Every image decodes to 3s, unless it's bad
+  options.decoder = [](const std::string &encoded, const int &rows,
+                       const int &cols, const int &channels, uint8_t *pixels) {
+    std::fill(pixels, pixels + rows * cols * channels, 3);
+    return encoded != "bad";
+  };
+  options.max_floats = 2 * n_hidden;
+  Serving::PreprocessingServable servable(
+      new Serving::MXNetServable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0),
+      options);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg;
+  msg.add_images("first");
+  msg.add_images("second");
+  msg.set_n(2);
+  msg.set_k(1);
+  msg.set_nr(1);
+  msg.set_nc(n_hidden);
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 2);
+  for (int i = 0; i < 2 * n_hidden; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+
+  msg.set_images(1, "bad");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+
+  // One image per row
+  msg.set_n(1);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+
+  // The shape is refused before anything is allocated for it, whether it's
+  // nonsense, overflows or is more than max_floats
+  msg.set_n(2);
+  msg.set_k(-1);
+  msg.set_nc(-n_hidden);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+
+  msg.set_k(1 << 20);
+  msg.set_nr(1 << 20);
+  msg.set_nc(1 << 20);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+
+  msg.set_k(1);
+  msg.set_nr(1);
+  msg.set_nc(n_hidden);
+  msg.add_images("third");
+  msg.set_n(3);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::BATCH_TOO_LARGE);
+}
+
+TEST(Preprocessing, NormalizeImages) {
+  const int n = 2, channels = 3, plane = 37; // SIMD body and a tail
+  std::vector<uint8_t> pixels(n * channels * plane);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = static_cast<uint8_t>(i * 7);
+  }
+  const float mean[] = {123.f, 117.f, 104.f};
+  const float scale[] = {1.f / 58.f, 1.f / 57.f, 1.f / 57.5f};
+
+  std::vector<float> out(pixels.size());
+  Serving::NormalizeImages(pixels.data(), n, channels, plane, mean, scale,
+                           out.data());
+
+  for (int image = 0; image < n; image++) {
+    for (int c = 0; c < channels; c++) {
+      for (int i = 0; i < plane; i++) {
+        const int hwc = (image * plane + i) * channels + c;
+        const int chw = (image * channels + c) * plane + i;
+        EXPECT_FLOAT_EQ(out[chw], (pixels[hwc] - mean[c]) * scale[c]);
+      }
+    }
+  }
+}
+
+TEST_F(TestMXNetServable, Postprocessing) {
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
+  servable.Bind(raw_args);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  msg.mutable_postprocessing()->set_top_k(5);
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Every output is the same, ties go to the first columns
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  ASSERT_EQ(output.buffer_size(), 5);
+  ASSERT_EQ(output.indices_size(), 5);
+  ASSERT_EQ(output.counts_size(), 1);
+  EXPECT_EQ(output.counts(0), 5);
+  for (int i = 0; i < 5; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+    EXPECT_EQ(output.indices(i), i);
+  }
+
+  msg.mutable_postprocessing()->set_top_k(0);
+  msg.mutable_postprocessing()->set_softmax(true);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  ASSERT_EQ(output.buffer_size(), n_hidden);
+  EXPECT_EQ(output.indices_size(), 0);
+  EXPECT_FLOAT_EQ(output.buffer(0), 1.f / n_hidden);
+
+  msg.mutable_postprocessing()->set_top_k(-1);
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+}
+
+TEST_F(TestMXNetServable, NamedOutputs) {
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
+
+  // A second head on the same layer, tanh of the fc output is 1
+  Serving::RawBindArgs args = raw_args;
+  args.net = mx::Symbol::Group(
+      {fc, mx::Activation("act", fc, mx::ActivationActType::kTanh)});
+  servable.Bind(args);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  msg.add_outputs("act_output");
+  msg.add_outputs("fc1_output");
+
+  Serving::ReturnCodes r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.buffer_size(), 0);
+  ASSERT_EQ(output.named_outputs_size(), 2);
+  EXPECT_EQ(output.named_outputs(0).name(), "act_output");
+  EXPECT_EQ(output.named_outputs(1).name(), "fc1_output");
+
+  const Serving::TensorMessage &act = output.named_outputs(0).tensor();
+  const Serving::TensorMessage &fc1 = output.named_outputs(1).tensor();
+  EXPECT_EQ(act.n(), 1);
+  EXPECT_EQ(act.k(), n_hidden);
+  ASSERT_EQ(act.buffer_size(), n_hidden);
+  ASSERT_EQ(fc1.buffer_size(), n_hidden);
+  for (int i = 0; i < n_hidden; i++) {
+    EXPECT_EQ(act.buffer(i), 1.f);
+    EXPECT_EQ(fc1.buffer(i), 2.f * n_hidden + 1);
+  }
+
+  // Without names the first output comes back in buffer
+  msg.clear_outputs();
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.named_outputs_size(), 0);
+  ASSERT_EQ(output.buffer_size(), n_hidden);
+  EXPECT_EQ(output.buffer(0), 2.f * n_hidden + 1);
+
+  msg.add_outputs("missing_output");
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+}
+
+TEST_F(TestMXNetServable, Pipeline) {
+  // The first model's output is reshaped into the second model's input
+  Serving::StagePrepare reshape =
+      [this](const Serving::TensorMessage &request,
+             const std::vector<const Serving::TensorMessage *> &inputs,
+             Serving::TensorMessage *stage_request) {
+        if (inputs[0]->buffer_size() != n_hidden) {
+          return Serving::ReturnCodes::SHAPE_INCORRECT;
+        }
+        *stage_request->mutable_buffer() = inputs[0]->buffer();
+        return Serving::ReturnCodes::OK;
+      };
+
+  Serving::PipelineServable pipeline;
+  ASSERT_TRUE(pipeline.AddStage(
+      "first",
+      new Serving::MXNetServable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0)));
+  ASSERT_TRUE(pipeline.AddStage(
+      "second",
+      new Serving::MXNetServable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0),
+      {"first"}, reshape));
+  EXPECT_FALSE(pipeline.IsReady());
+
+  Serving::PipelineBindArgs args;
+  args.stages["first"] = &raw_args;
+  args.stages["second"] = &raw_args;
+  EXPECT_EQ(pipeline.Bind(args), Serving::ReturnCodes::OK);
+  EXPECT_TRUE(pipeline.IsReady());
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+
+  Serving::ReturnCodes r = pipeline.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  // Each of the first model's outputs is 2 * n_hidden + 1
+  Serving::TensorMessage output;
+  r = pipeline.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  ASSERT_EQ(output.buffer_size(), n_hidden);
+  for (int i = 0; i < n_hidden; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden * (2.f * n_hidden + 1) + 1);
+  }
+
+  // The first stage refuses it straight away
+  msg = ToMessage(wrong_size);
+  msg.set_client_id("test");
+  r = pipeline.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::SHAPE_INCORRECT);
+
+  EXPECT_FALSE(pipeline.AddStage("third", nullptr, {"missing"}));
+}
+
+TEST_F(TestMXNetServable, PipelineDiscard) {
+  // Holds a request back until a second one fills its batch
+  Serving::MXNetServable *waiting =
+      new Serving::MXNetServable(mx::Shape(2, 1, 1, n_hidden), mx::kCPU, 0);
+
+  Serving::PipelineServable pipeline;
+  ASSERT_TRUE(pipeline.AddStage("waiting", waiting));
+  ASSERT_TRUE(pipeline.AddStage(
+      "unbound",
+      new Serving::MXNetServable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0)));
+
+  Serving::PipelineBindArgs args;
+  args.stages["waiting"] = &raw_args;
+  EXPECT_EQ(pipeline.Bind(args), Serving::ReturnCodes::OK);
+
+  // The second root refuses it, the first root's row is discarded rather
+  // than waited for
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+  Serving::ReturnCodes r = pipeline.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::NEED_BIND_CALL);
+
+  // The discarded row still runs, with the next request
+  Serving::RequestInfo info;
+  info.result_key = "next";
+  r = waiting->AddToBatch(msg, info);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = waiting->GetResult("next", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+  EXPECT_EQ(output.n(), 1);
+}
+
+TEST(Postprocessing, Postprocess) {
+  const float output[] = {1.f, 3.f, 2.f, 5.f, 0.f, 0.f, 4.f, 0.f};
+  Serving::TensorMessage message;
+
+  Serving::Postprocessing options;
+  options.set_top_k(2);
+  Serving::Postprocess(options, output, 2, 4, &message);
+  EXPECT_EQ(message.n(), 2);
+  EXPECT_EQ(message.k(), 2);
+  ASSERT_EQ(message.buffer_size(), 4);
+  EXPECT_EQ(message.buffer(0), 5.f);
+  EXPECT_EQ(message.indices(0), 3);
+  EXPECT_EQ(message.buffer(1), 3.f);
+  EXPECT_EQ(message.indices(1), 1);
+  EXPECT_EQ(message.buffer(2), 4.f);
+  EXPECT_EQ(message.indices(2), 2);
+  EXPECT_EQ(message.indices(3), 0);
+
+  // The second row only has one value over the threshold
+  options.set_use_threshold(true);
+  options.set_threshold(2.5f);
+  Serving::Postprocess(options, output, 2, 4, &message);
+  ASSERT_EQ(message.counts_size(), 2);
+  EXPECT_EQ(message.counts(0), 2);
+  EXPECT_EQ(message.counts(1), 1);
+  EXPECT_EQ(message.buffer_size(), 3);
+
+  options.set_top_k(0);
+  Serving::Postprocess(options, output, 1, 4, &message);
+  ASSERT_EQ(message.buffer_size(), 2);
+  EXPECT_EQ(message.indices(0), 1);
+  EXPECT_EQ(message.indices(1), 3);
+
+  options.Clear();
+  options.set_softmax(true);
+  Serving::Postprocess(options, output, 2, 4, &message);
+  ASSERT_EQ(message.buffer_size(), 8);
+  float sum = 0.f;
+  for (int i = 0; i < 4; i++) {
+    sum += message.buffer(i);
+  }
+  EXPECT_FLOAT_EQ(sum, 1.f);
+  EXPECT_GT(message.buffer(3), message.buffer(1));
+}
+
+TEST(Postprocessing, Kernels) {
+  const int cols = 37; // SIMD body and a tail
+  std::vector<float> row(cols);
+  for (int c = 0; c < cols; c++) {
+    row[c] = static_cast<float>((c * 7) % 11) - 20.f; // with ties
+  }
+
+  // Whichever path this CPU takes against the one done a value at a time
+  std::vector<float> softmax(cols), expected(cols);
+  Serving::Softmax(row.data(), cols, softmax.data());
+  Serving::SoftmaxScalar_(row.data(), cols, expected.data());
+  for (int c = 0; c < cols; c++) {
+    EXPECT_NEAR(softmax[c], expected[c], 1e-5f * expected[c]);
+  }
+
+  // Largest first, ties to the earlier column
+  std::vector<int> order(cols);
+  for (int c = 0; c < cols; c++) {
+    order[c] = c;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&row](const int &lhs, const int &rhs) {
+                     return row[lhs] > row[rhs];
+                   });
+
+  const int k = 5;
+  std::vector<float> values(k);
+  std::vector<int32_t> indices(k);
+  ASSERT_EQ(Serving::TopK(row.data(), cols, k, values.data(), indices.data()),
+            k);
+  for (int i = 0; i < k; i++) {
+    EXPECT_EQ(indices[i], order[i]);
+    EXPECT_EQ(values[i], row[order[i]]);
+  }
+}
+
+TEST_F(TestMXNetServable, BindMapped) {
+  std::vector<Serving::MappedArray> arrays;
+  for (auto &parm : parms) {
+    parm.second.WaitToRead();
+    std::vector<mx_uint> shape = parm.second.GetShape();
+    arrays.push_back({parm.first,
+                      std::vector<uint32_t>(shape.begin(), shape.end()),
+                      parm.second.GetData(), parm.second.Size()});
+  }
+  ASSERT_TRUE(Serving::WriteMappedParameters("fc.mparams", arrays));
+  fc.Save("fc-symbol.json");
+
+  Serving::MappedBindArgs mapped_args;
+  mapped_args.symbol_filename = "fc-symbol.json";
+  mapped_args.parameters_filename = "fc.mparams";
+
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
+
+  Serving::ReturnCodes r = servable.Bind(mapped_args);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage msg = ToMessage(input);
+  msg.set_client_id("test");
+
+  r = servable.AddToBatch(msg);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  Serving::TensorMessage output;
+  r = servable.GetResult("test", &output);
+  EXPECT_EQ(r, Serving::ReturnCodes::OK);
+
+  int buflen = msg.buffer().size();
+  for (int i = 0; i < buflen; i++) {
+    EXPECT_EQ(output.buffer(i), 2.f * n_hidden + 1);
+  }
+
+  mapped_args.parameters_filename = "missing.mparams";
+  r = servable.Bind(mapped_args);
+  EXPECT_EQ(r, Serving::ReturnCodes::NO_SUITABLE_BIND_ARGS);
+}
+
+TEST_F(TestMXNetServable, BindMappedCorrupt) {
+  std::vector<float> m(n_hidden, 2.f);
+  std::vector<float> b(n_hidden, 1.f);
+  std::vector<Serving::MappedArray> arrays = {
+      {"arg:b", {static_cast<uint32_t>(n_hidden)}, b.data(), b.size()},
+      {"arg:m",
+       {static_cast<uint32_t>(n_hidden), static_cast<uint32_t>(n_hidden)},
+       m.data(),
+       m.size()}};
+  fc.Save("fc-symbol.json");
+
+  Serving::MappedBindArgs mapped_args;
+  mapped_args.symbol_filename = "fc-symbol.json";
+  mapped_args.parameters_filename = "corrupt.mparams";
+
+  Serving::MXNetServable servable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 0);
+
+  // m's shape holds far more floats than the file has for it
+  ASSERT_TRUE(Serving::WriteMappedParameters("corrupt.mparams", arrays));
+  Serving::ReturnCodes r = servable.Bind(mapped_args);
+  EXPECT_EQ(r, Serving::ReturnCodes::NO_SUITABLE_BIND_ARGS);
+
+  // A file that's fine to begin with, then broken in one place at a time
+  arrays.resize(1);
+  ASSERT_TRUE(Serving::WriteMappedParameters("valid.mparams", arrays));
+  std::ifstream in("valid.mparams", std::ios::binary);
+  const std::string valid((std::istreambuf_iterator<char>(in)),
+                          std::istreambuf_iterator<char>());
+
+  Serving::MappedParameters parameters;
+  EXPECT_TRUE(parameters.Open("valid.mparams"));
+
+  auto open_with = [&](const size_t &offset, const uint64_t &value,
+                       const size_t &bytes) {
+    std::string corrupt = valid;
+    std::memcpy(&corrupt[offset], &value, bytes);
+    std::ofstream("corrupt.mparams", std::ios::binary) << corrupt;
+    return parameters.Open("corrupt.mparams");
+  };
+
+  // magic, version and count, then the name length and "arg:b"
+  const size_t rank_offset = 8 + 4 + 4 + 4 + 5;
+  const size_t data_offset = rank_offset + 4 + 4;
+  const size_t size_offset = data_offset + 8;
+
+  // A rank larger than the file, data past the end of the file, a size that
+  // only fits once 4x wraps around, and a size the shape disagrees with
+  EXPECT_FALSE(open_with(rank_offset, 0xffffffff, 4));
+  EXPECT_FALSE(open_with(data_offset, ~uint64_t(0) - 3, 8));
+  EXPECT_FALSE(open_with(size_offset, uint64_t(1) << 62, 8));
+  EXPECT_FALSE(open_with(size_offset, n_hidden + 1, 8));
+
+  // Cut short in the middle of the data
+  std::ofstream("corrupt.mparams", std::ios::binary)
+      << valid.substr(0, valid.size() - 4);
+  EXPECT_FALSE(parameters.Open("corrupt.mparams"));
+}
 } // namespace
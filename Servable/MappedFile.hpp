@@ -0,0 +1,333 @@
+//
+// Created by Aman LaChapelle on 1/27/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_MAPPEDFILE_HPP
+#define BATCHING_RPC_SERVER_MAPPEDFILE_HPP
+
+// STL
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Serving {
+
+/**
+ * @class MappedFile
+ * @brief A read-only memory mapping of a whole file.
+ *
+ * Pages are read lazily on first access and live in the page cache, so every
+ * process that maps the same file shares one copy of it.
+ */
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &other) = delete;
+  MappedFile &operator=(const MappedFile &other) = delete;
+  ~MappedFile() { Close(); }
+
+  /**
+   * @brief Maps a file, replacing any previous mapping.
+   *
+   * @param filename The file to map.
+   * @return false if the file can't be opened or mapped.
+   */
+  bool Open(const std::string &filename) {
+    Close();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+      close(fd);
+      return false;
+    }
+
+    void *data = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (data == MAP_FAILED) {
+      return false;
+    }
+
+    data_ = static_cast<const char *>(data);
+    size_ = file_stat.st_size;
+    return true;
+  }
+
+  void Close() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+      data_ = nullptr;
+      size_ = 0;
+    }
+  }
+
+  const char *Data() const { return data_; }
+
+  size_t Size() const { return size_; }
+
+private:
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/**
+ * @brief A std::streambuf reading straight out of a MappedFile, for libraries
+ * that deserialize from a std::istream.
+ */
+class MappedStreamBuf : public std::streambuf {
+public:
+  explicit MappedStreamBuf(const MappedFile &file) {
+    char *begin = const_cast<char *>(file.Data());
+    setg(begin, begin, begin + file.Size());
+  }
+};
+
+/**
+ * @brief Creates an anonymous shared memory object.
+ *
+ * Uses memfd where the kernel has it and an unlinked POSIX shared memory
+ * object elsewhere, either way it disappears once the last descriptor to it
+ * is closed. Size it with ftruncate and map it with MAP_SHARED.
+ *
+ * @param name A name for debugging, shows up in /proc/<pid>/fd.
+ * @return The object's file descriptor, or -1 if it couldn't be created.
+ */
+inline int CreateSharedMemory(const std::string &name) {
+  int fd = -1;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+  const unsigned int mfd_allow_sealing = 2U; // from <linux/memfd.h>
+  fd = syscall(SYS_memfd_create, name.c_str(), mfd_allow_sealing);
+  if (fd >= 0) {
+    return fd;
+  }
+#endif
+
+  // Unlinked straight away, it lives for as long as someone has it open
+  std::string shm_name = "/" + name + "." + std::to_string(getpid());
+  fd = shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) {
+    shm_unlink(shm_name.c_str());
+  }
+  return fd;
+}
+
+// Layout constants of the parameter files, see MappedParameters
+const char kMappedMagic[] = "BRPCPARM";
+const uint32_t kMappedVersion = 1;
+const uint64_t kMappedAlignment = 64;
+
+/**
+ * @brief One array of a mapped parameter file.
+ */
+struct MappedArray {
+  std::string name;
+  std::vector<uint32_t> shape;
+  const float *data; //!< points into the mapping
+  uint64_t size;     //!< number of floats
+};
+
+/**
+ * @class MappedParameters
+ * @brief Reads a parameter file that was written by WriteMappedParameters.
+ *
+ * The file starts with the magic "BRPCPARM", a uint32 version and a uint32
+ * array count. Each array follows as a uint32 name length, the name, a uint32
+ * rank, the uint32 dimensions, and the uint64 offset and element count of its
+ * float data. The data of every array is 64 byte aligned so it can be used in
+ * place. Everything is in host byte order.
+ */
+class MappedParameters {
+public:
+  /**
+   * @brief Maps and indexes a parameter file.
+   *
+   * Nothing read from the file is trusted: every size is checked against
+   * what is left of the mapping before it is used, and an array whose shape
+   * doesn't hold exactly its element count is rejected.
+   *
+   * @param filename The file to read.
+   * @return false if the file can't be mapped or isn't a parameter file.
+   */
+  bool Open(const std::string &filename) {
+    arrays_.clear();
+    if (!file_.Open(filename)) {
+      return false;
+    }
+
+    size_t offset = 0;
+    char magic[8];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    if (!Read_(&offset, magic, sizeof(magic)) ||
+        std::memcmp(magic, kMappedMagic, sizeof(magic)) != 0 ||
+        !Read_(&offset, &version, sizeof(version)) ||
+        version != kMappedVersion || !Read_(&offset, &count, sizeof(count))) {
+      file_.Close();
+      return false;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+      MappedArray array;
+      uint32_t name_length = 0;
+      uint32_t rank = 0;
+      uint64_t data_offset = 0;
+
+      if (!Read_(&offset, &name_length, sizeof(name_length)) ||
+          name_length > file_.Size() - offset) {
+        file_.Close();
+        return false;
+      }
+      array.name.assign(file_.Data() + offset, name_length);
+      offset += name_length;
+
+      if (!Read_(&offset, &rank, sizeof(rank)) ||
+          rank > (file_.Size() - offset) / sizeof(uint32_t)) {
+        file_.Close();
+        return false;
+      }
+      array.shape.resize(rank);
+      if (!Read_(&offset, array.shape.data(), rank * sizeof(uint32_t)) ||
+          !Read_(&offset, &data_offset, sizeof(data_offset)) ||
+          !Read_(&offset, &array.size, sizeof(array.size)) ||
+          data_offset > file_.Size() || data_offset % sizeof(float) != 0 ||
+          array.size > (file_.Size() - data_offset) / sizeof(float) ||
+          !HoldsExactly_(array.shape, array.size)) {
+        file_.Close();
+        return false;
+      }
+
+      array.data = reinterpret_cast<const float *>(file_.Data() + data_offset);
+      arrays_.push_back(array);
+    }
+
+    return true;
+  }
+
+  const std::vector<MappedArray> &Arrays() const { return arrays_; }
+
+private:
+  bool Read_(size_t *offset, void *out, const size_t &bytes) {
+    if (bytes > file_.Size() - *offset) {
+      return false;
+    }
+    std::memcpy(out, file_.Data() + *offset, bytes);
+    *offset += bytes;
+    return true;
+  }
+
+  // Whether shape has exactly size elements, stopping before the product
+  // can overflow
+  static bool HoldsExactly_(const std::vector<uint32_t> &shape,
+                            const uint64_t &size) {
+    uint64_t elements = 1;
+    for (const uint32_t &dimension : shape) {
+      if (dimension != 0 && elements > size / dimension) {
+        return false;
+      }
+      elements *= dimension;
+    }
+    return elements == size;
+  }
+
+  MappedFile file_;
+  std::vector<MappedArray> arrays_;
+};
+
+/**
+ * @brief Writes arrays in the format read by MappedParameters.
+ *
+ * @param filename The file to write.
+ * @param arrays The arrays to write, data must point to size floats.
+ * @return false if the file couldn't be written.
+ */
+inline bool WriteMappedParameters(const std::string &filename,
+                                  const std::vector<MappedArray> &arrays) {
+  // Work out where each array's data goes, after the index
+  uint64_t index_size = 8 + 2 * sizeof(uint32_t);
+  for (const auto &array : arrays) {
+    index_size += sizeof(uint32_t) + array.name.size() + sizeof(uint32_t) +
+                  array.shape.size() * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+  }
+
+  const uint64_t alignment = kMappedAlignment;
+  std::vector<uint64_t> offsets;
+  uint64_t end = index_size;
+  for (const auto &array : arrays) {
+    end = (end + alignment - 1) / alignment * alignment;
+    offsets.push_back(end);
+    end += array.size * sizeof(float);
+  }
+
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  const uint32_t version = kMappedVersion;
+  const uint32_t count = arrays.size();
+  out.write(kMappedMagic, 8);
+  out.write(reinterpret_cast<const char *>(&version), sizeof(version));
+  out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+
+  for (size_t i = 0; i < arrays.size(); i++) {
+    const MappedArray &array = arrays[i];
+    const uint32_t name_length = array.name.size();
+    const uint32_t rank = array.shape.size();
+    out.write(reinterpret_cast<const char *>(&name_length),
+              sizeof(name_length));
+    out.write(array.name.data(), name_length);
+    out.write(reinterpret_cast<const char *>(&rank), sizeof(rank));
+    out.write(reinterpret_cast<const char *>(array.shape.data()),
+              rank * sizeof(uint32_t));
+    out.write(reinterpret_cast<const char *>(&offsets[i]), sizeof(uint64_t));
+    out.write(reinterpret_cast<const char *>(&array.size), sizeof(uint64_t));
+  }
+
+  for (size_t i = 0; i < arrays.size(); i++) {
+    // Pad up to the array's offset
+    std::vector<char> padding(offsets[i] - static_cast<uint64_t>(out.tellp()),
+                              0);
+    out.write(padding.data(), padding.size());
+    out.write(reinterpret_cast<const char *>(arrays[i].data),
+              arrays[i].size * sizeof(float));
+  }
+
+  return out.good();
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_MAPPEDFILE_HPP
@@ -0,0 +1,496 @@
+//
+// Created by Aman LaChapelle on 2/9/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_PIPELINESERVABLE_HPP
+#define BATCHING_RPC_SERVER_PIPELINESERVABLE_HPP
+
+// STL
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <vector>
+
+// Project
+#include "Servable.hpp"
+
+// Generated
+#include "BatchingRPC.pb.h"
+
+namespace Serving {
+
+/**
+ * @brief Builds a pipeline stage's request.
+ *
+ * Called as prepare(request, inputs, stage_request) with the request made to
+ * the pipeline and the results of the stage's inputs, in the order the stage
+ * named them. Returns ReturnCodes::OK, or the code the pipeline's request
+ * fails with (ReturnCodes::SHAPE_INCORRECT for an input it can't use).
+ */
+using StagePrepare = std::function<ReturnCodes(
+    const TensorMessage &, const std::vector<const TensorMessage *> &,
+    TensorMessage *)>;
+
+/**
+ * @brief Binds the stages of a PipelineServable, each with its own args.
+ */
+struct PipelineBindArgs : public BindArgs {
+  //! The args for each stage by name, stages that aren't named aren't bound
+  std::map<std::string, BindArgs *> stages;
+};
+
+/**
+ * @class PipelineServable
+ * @brief Runs a DAG of Servables as one model.
+ *
+ * Each stage is a Servable with its own batch queue, fed by the request made
+ * to the pipeline (a root stage) or by the results of earlier stages. Results
+ * pass from one stage to the next in memory, so a detector feeding a
+ * classifier costs one round trip instead of two. Host the pipeline in a
+ * TBServer like any other Servable.
+ *
+ * Stages are added in order and may only take their inputs from stages added
+ * before them, which keeps the graph acyclic. A request runs stage by stage
+ * in that order, stages that don't depend on each other are in their queues
+ * at the same time. Every stage batches the requests of all of the
+ * pipeline's callers, just as it would on its own.
+ *
+ * The root stages are added to from AddToBatch, so a full queue or a bad
+ * shape there is returned straight away. The other stages are added to from
+ * GetResult, which retries a full queue until the request's deadline and
+ * returns any other error. Once a request has failed, what its other stages
+ * were given is discarded rather than waited for.
+ */
+class PipelineServable : public Servable {
+public:
+  /**
+   * @brief Makes an empty pipeline.
+   *
+   * @param retry_timeout How long a full queue past the roots is retried for
+   * a request without a deadline.
+   */
+  explicit PipelineServable(const std::chrono::milliseconds &retry_timeout =
+                                std::chrono::milliseconds(1000));
+
+  /**
+   * @brief Adds a stage to the pipeline.
+   *
+   * Without a prepare function a root stage is sent the pipeline's request
+   * as it is and any other stage the result of its one input.
+   *
+   * @param name The stage's name, unique within the pipeline.
+   * @param servable The stage's Servable, the pipeline takes ownership of it.
+   * @param inputs The stages whose results the stage takes, empty for a root
+   * stage that takes the pipeline's request.
+   * @param prepare Builds the stage's request, see StagePrepare.
+   * @return false if the name is taken, an input isn't an earlier stage or
+   * a stage with several inputs has no prepare function, in which case the
+   * pointer is not taken.
+   */
+  bool AddStage(const std::string &name, Servable *servable,
+                const std::vector<std::string> &inputs =
+                    std::vector<std::string>(),
+                const StagePrepare &prepare = StagePrepare());
+
+  /**
+   * @brief Picks the stage whose result the pipeline returns, the last stage
+   * added by default.
+   *
+   * @return false if there's no such stage.
+   */
+  bool SetOutput(const std::string &name);
+
+  ReturnCodes SetBatchSize(const int &new_size) override;
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override;
+
+  ReturnCodes AddToBatch(const TensorMessage &message,
+                         const RequestInfo &info) override;
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override;
+
+  ReturnCodes Bind(BindArgs &args) override;
+
+  bool IsReady() override;
+
+  void Discard(const std::string &client_id) override;
+
+  void Drain() override;
+
+  BatchingStats GetBatchingStats() override;
+
+  /**
+   * @brief The stages' loads added up, the forward time is then what one
+   * request costs going through all of them.
+   */
+  LoadStats GetLoad() override;
+
+private:
+  struct Stage_ {
+    std::string name;
+    std::unique_ptr<Servable> servable;
+    std::vector<int> inputs; // indices of earlier stages
+    StagePrepare prepare;
+    int level; // 0 for roots, otherwise one more than its deepest input
+  };
+
+  // A request between AddToBatch and GetResult
+  struct Run_ {
+    TensorMessage request;
+    RequestInfo info;
+  };
+
+  int FindStage_(const std::string &name) const;
+
+  ReturnCodes Prepare_(const Stage_ &stage, const TensorMessage &request,
+                       const std::vector<TensorMessage> &results,
+                       TensorMessage *stage_request);
+
+  ReturnCodes Submit_(Stage_ &stage, const TensorMessage &request,
+                      const RequestInfo &info,
+                      const std::vector<TensorMessage> &results,
+                      const bool &retry);
+
+  RequestInfo StageInfo_(const Stage_ &stage, const RequestInfo &info) const;
+
+  std::vector<Stage_> stages_; // in the order added, inputs first
+  int output_ = -1; // the last stage until SetOutput
+  std::chrono::milliseconds retry_timeout_;
+
+  std::mutex mutex_;
+  std::map<std::string, Run_> runs_;
+};
+
+// Implementation
+
+inline PipelineServable::PipelineServable(
+    const std::chrono::milliseconds &retry_timeout)
+    : retry_timeout_(retry_timeout) {}
+
+inline bool PipelineServable::AddStage(const std::string &name,
+                                       Servable *servable,
+                                       const std::vector<std::string> &inputs,
+                                       const StagePrepare &prepare) {
+  if (FindStage_(name) >= 0 || (inputs.size() > 1 && !prepare)) {
+    return false;
+  }
+
+  Stage_ stage;
+  stage.name = name;
+  stage.prepare = prepare;
+  stage.level = 0;
+  for (const std::string &input : inputs) {
+    const int index = FindStage_(input);
+    if (index < 0) {
+      return false;
+    }
+    stage.inputs.push_back(index);
+    stage.level = std::max(stage.level, stages_[index].level + 1);
+  }
+
+  stage.servable.reset(servable);
+  stages_.push_back(std::move(stage));
+  return true;
+}
+
+inline bool PipelineServable::SetOutput(const std::string &name) {
+  const int index = FindStage_(name);
+  if (index < 0) {
+    return false;
+  }
+  output_ = index;
+  return true;
+}
+
+inline ReturnCodes PipelineServable::SetBatchSize(const int &new_size) {
+  ReturnCodes code = ReturnCodes::OK;
+  for (Stage_ &stage : stages_) {
+    const ReturnCodes stage_code = stage.servable->SetBatchSize(new_size);
+    if (stage_code != ReturnCodes::OK) {
+      code = stage_code;
+    }
+  }
+  return code;
+}
+
+inline ReturnCodes PipelineServable::AddToBatch(const TensorMessage &message) {
+  return AddToBatch(message, RequestInfo());
+}
+
+inline ReturnCodes PipelineServable::AddToBatch(const TensorMessage &message,
+                                                const RequestInfo &info) {
+  if (stages_.empty()) {
+    return ReturnCodes::NEED_BIND_CALL;
+  }
+
+  RequestInfo keyed = info;
+  if (keyed.result_key.empty()) {
+    keyed.result_key = message.client_id();
+  }
+
+  const std::vector<TensorMessage> no_results;
+  std::vector<Stage_ *> submitted;
+  for (Stage_ &stage : stages_) {
+    if (stage.level > 0) {
+      continue;
+    }
+
+    const ReturnCodes code = Submit_(stage, message, keyed, no_results, false);
+    if (code != ReturnCodes::OK) {
+      // The other roots may not run for a while, so what they were given is
+      // dropped rather than waited for
+      for (Stage_ *root : submitted) {
+        root->servable->Discard(StageInfo_(*root, keyed).result_key);
+      }
+      return code;
+    }
+    submitted.push_back(&stage);
+  }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  Run_ &run = runs_[keyed.result_key];
+  run.request = message;
+  run.info = keyed;
+
+  return ReturnCodes::OK;
+}
+
+inline ReturnCodes PipelineServable::GetResult(const std::string &client_id,
+                                               TensorMessage *message) {
+  Run_ run;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto found = runs_.find(client_id);
+    if (found == runs_.end()) {
+      return ReturnCodes::SHAPE_INCORRECT; // never added
+    }
+    run = std::move(found->second);
+    runs_.erase(found);
+  }
+  // Stage by stage, each level is submitted as a whole before waiting on
+  // any of it. The roots went in from AddToBatch.
+  std::vector<TensorMessage> results(stages_.size());
+  ReturnCodes failed = ReturnCodes::OK;
+  int levels = 0;
+  for (const Stage_ &stage : stages_) {
+    levels = std::max(levels, stage.level + 1);
+  }
+  for (int level = 0; level < levels && failed == ReturnCodes::OK; level++) {
+    std::vector<Stage_ *> submitted;
+    for (Stage_ &stage : stages_) {
+      if (stage.level != level) {
+        continue;
+      }
+
+      ReturnCodes code = ReturnCodes::OK;
+      if (level > 0) {
+        code = Submit_(stage, run.request, run.info, results, true);
+      }
+      if (code != ReturnCodes::OK) {
+        failed = code;
+        break;
+      }
+      submitted.push_back(&stage);
+    }
+
+    // Once the request has failed nothing will use the rest, so it's
+    // dropped instead of being waited for
+    for (Stage_ *stage : submitted) {
+      const std::string key = StageInfo_(*stage, run.info).result_key;
+      if (failed != ReturnCodes::OK) {
+        stage->servable->Discard(key);
+        continue;
+      }
+      failed = stage->servable->GetResult(key,
+                                          &results[stage - stages_.data()]);
+    }
+  }
+
+  if (failed != ReturnCodes::OK) {
+    return failed;
+  }
+
+  message->Swap(&results[output_ < 0 ? results.size() - 1 : output_]);
+  message->set_client_id(client_id);
+  return ReturnCodes::OK;
+}
+
+inline ReturnCodes PipelineServable::Bind(BindArgs &args) {
+  try {
+    PipelineBindArgs &pipeline_args = dynamic_cast<PipelineBindArgs &>(args);
+    for (auto &stage_args : pipeline_args.stages) {
+      const int index = FindStage_(stage_args.first);
+      if (index < 0) {
+        return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+      }
+
+      const ReturnCodes code =
+          stages_[index].servable->Bind(*stage_args.second);
+      if (code != ReturnCodes::OK) {
+        return code;
+      }
+    }
+  } catch (std::bad_cast &e) {
+    return ReturnCodes::NO_SUITABLE_BIND_ARGS;
+  }
+
+  return ReturnCodes::OK;
+}
+
+inline bool PipelineServable::IsReady() {
+  if (stages_.empty()) {
+    return false;
+  }
+  for (Stage_ &stage : stages_) {
+    if (!stage.servable->IsReady()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void PipelineServable::Discard(const std::string &client_id) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (runs_.erase(client_id) == 0) {
+      return;
+    }
+  }
+  // Only the roots have been given the request before GetResult
+  for (Stage_ &stage : stages_) {
+    if (stage.level == 0) {
+      RequestInfo info;
+      info.result_key = client_id;
+      stage.servable->Discard(StageInfo_(stage, info).result_key);
+    }
+  }
+}
+
+inline void PipelineServable::Drain() {
+  for (Stage_ &stage : stages_) {
+    stage.servable->Drain();
+  }
+}
+
+inline BatchingStats PipelineServable::GetBatchingStats() {
+  if (stages_.empty()) {
+    return BatchingStats();
+  }
+  return stages_[output_ < 0 ? stages_.size() - 1 : output_]
+      .servable->GetBatchingStats();
+}
+
+inline LoadStats PipelineServable::GetLoad() {
+  LoadStats load;
+  for (Stage_ &stage : stages_) {
+    LoadStats stage_load = stage.servable->GetLoad();
+    load.queued_rows += stage_load.queued_rows;
+    load.batches_in_flight += stage_load.batches_in_flight;
+    load.forward_us += stage_load.forward_us;
+  }
+  return load;
+}
+
+inline int PipelineServable::FindStage_(const std::string &name) const {
+  for (size_t i = 0; i < stages_.size(); i++) {
+    if (stages_[i].name == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+inline ReturnCodes
+PipelineServable::Prepare_(const Stage_ &stage, const TensorMessage &request,
+                           const std::vector<TensorMessage> &results,
+                           TensorMessage *stage_request) {
+  std::vector<const TensorMessage *> inputs;
+  for (const int &input : stage.inputs) {
+    inputs.push_back(&results[input]);
+  }
+
+  if (stage.prepare) {
+    *stage_request = request;
+    return stage.prepare(request, inputs, stage_request);
+  }
+
+  if (inputs.empty()) {
+    *stage_request = request;
+    return ReturnCodes::OK;
+  }
+
+  // The input's result becomes the request, minus what only made sense as a
+  // result
+  *stage_request = *inputs[0];
+  stage_request->clear_indices();
+  stage_request->clear_counts();
+  stage_request->clear_named_outputs();
+  stage_request->set_client_id(request.client_id());
+  stage_request->set_priority(request.priority());
+  return ReturnCodes::OK;
+}
+
+inline ReturnCodes PipelineServable::Submit_(
+    Stage_ &stage, const TensorMessage &request, const RequestInfo &info,
+    const std::vector<TensorMessage> &results, const bool &retry) {
+  TensorMessage stage_request;
+  ReturnCodes code = Prepare_(stage, request, results, &stage_request);
+  if (code != ReturnCodes::OK) {
+    return code;
+  }
+
+  const RequestInfo stage_info = StageInfo_(stage, info);
+  code = stage.servable->AddToBatch(stage_request, stage_info);
+
+  // The caller can't retry a request that's already part way through the
+  // pipeline, so a full queue further in is waited out here, for a while if
+  // the request has no deadline
+  std::chrono::system_clock::time_point deadline = info.deadline;
+  if (deadline == std::chrono::system_clock::time_point::max()) {
+    deadline = std::chrono::system_clock::now() + retry_timeout_;
+  }
+  while (retry && code == ReturnCodes::NEXT_BATCH &&
+         std::chrono::system_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+    code = stage.servable->AddToBatch(stage_request, stage_info);
+  }
+  return code;
+}
+
+inline RequestInfo PipelineServable::StageInfo_(const Stage_ &stage,
+                                                const RequestInfo &info) const {
+  // Every stage keeps the request's result apart from other requests' by
+  // the pipeline's key
+  RequestInfo stage_info = info;
+  stage_info.result_key = info.result_key + "/" + stage.name;
+  return stage_info;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_PIPELINESERVABLE_HPP
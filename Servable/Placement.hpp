@@ -0,0 +1,170 @@
+//
+// Created by Aman LaChapelle on 1/21/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_PLACEMENT_HPP
+#define BATCHING_RPC_SERVER_PLACEMENT_HPP
+
+// STL
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+// POSIX
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Serving {
+
+/**
+ * @brief Pins the calling thread to a set of CPU cores.
+ *
+ * Only implemented on Linux, elsewhere the thread is left to the scheduler.
+ *
+ * @param cpus The cores the thread may run on.
+ * @return true if the thread was pinned.
+ */
+inline bool PinThread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  if (cpus.empty()) {
+    return false;
+  }
+
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (const int &cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) ==
+         0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Looks up the NUMA node a CPU core belongs to.
+ *
+ * @param cpu The core to look up.
+ * @return The node, or -1 if it is unknown.
+ */
+inline int NumaNodeOf(const int &cpu) {
+  int node = -1;
+#ifdef __linux__
+  std::string cpu_dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+  DIR *dir = opendir(cpu_dir.c_str());
+  if (dir == nullptr) {
+    return node;
+  }
+
+  // The core's directory has a nodeN link to the node it belongs to
+  while (dirent *entry = readdir(dir)) {
+    if (std::strncmp(entry->d_name, "node", 4) == 0 &&
+        std::isdigit(entry->d_name[4])) {
+      node = std::atoi(entry->d_name + 4);
+      break;
+    }
+  }
+
+  closedir(dir);
+#endif
+  return node;
+}
+
+/**
+ * @brief Moves the pages backing a buffer to a NUMA node.
+ *
+ * Uses mbind directly so there's no dependency on libnuma. Whole pages are
+ * moved, so neighbouring data that shares the first or last page moves too.
+ *
+ * @param data The start of the buffer.
+ * @param bytes The size of the buffer.
+ * @param node The node to move it to.
+ * @return true if the pages were moved.
+ */
+inline bool MoveToNumaNode(const void *data, const size_t &bytes,
+                           const int &node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  // Values from <numaif.h>
+  const int mpol_bind = 2;
+  const unsigned mpol_mf_move = 1 << 1;
+  const int max_nodes = 1024;
+  const int bits = 8 * sizeof(unsigned long);
+
+  if (data == nullptr || bytes == 0 || node < 0 || node >= max_nodes) {
+    return false;
+  }
+
+  const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+  const uintptr_t begin = reinterpret_cast<uintptr_t>(data) & ~(page_size - 1);
+  const uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+
+  unsigned long node_mask[max_nodes / bits] = {0};
+  node_mask[node / bits] |= 1UL << (node % bits);
+
+  return syscall(SYS_mbind, begin, end - begin, mpol_bind, node_mask,
+                 max_nodes + 1, mpol_mf_move) == 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * @brief Describes where a replica runs, for reporting at startup.
+ *
+ * @param name The servable's name.
+ * @param replica The replica's index.
+ * @param cpus The cores the replica is pinned to.
+ * @param node The replica's NUMA node, or -1.
+ * @param pinned Whether pinning succeeded.
+ * @return A one-line description.
+ */
+inline std::string DescribePlacement(const std::string &name,
+                                     const int &replica,
+                                     const std::vector<int> &cpus,
+                                     const int &node, const bool &pinned) {
+  std::ostringstream description;
+  description << name << " replica " << replica << ": cpus ";
+  for (size_t i = 0; i < cpus.size(); i++) {
+    description << (i == 0 ? "" : ",") << cpus[i];
+  }
+  description << ", NUMA node " << node;
+  if (!pinned) {
+    description << " (pinning failed)";
+  }
+  description << "\n";
+
+  return description.str();
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_PLACEMENT_HPP
@@ -0,0 +1,424 @@
+//
+// Created by Aman LaChapelle on 2/8/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_POSTPROCESSING_HPP
+#define BATCHING_RPC_SERVER_POSTPROCESSING_HPP
+
+// STL
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCHING_RPC_SERVER_SSE_KERNELS
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define BATCHING_RPC_SERVER_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+// Project
+#include "Servable.hpp"
+
+// Generated
+#include "BatchingRPC.pb.h"
+
+namespace Serving {
+
+/**
+ * @brief Whether any postprocessing was asked for.
+ */
+inline bool WantsPostprocessing(const Postprocessing &options) {
+  return options.softmax() || options.top_k() > 0 || options.use_threshold();
+}
+
+/**
+ * @brief Checks a request's postprocessing options.
+ *
+ * @return ReturnCodes::SHAPE_INCORRECT for a negative top_k, otherwise
+ * ReturnCodes::OK.
+ */
+inline ReturnCodes CheckPostprocessing(const Postprocessing &options) {
+  return options.top_k() < 0 ? ReturnCodes::SHAPE_INCORRECT : ReturnCodes::OK;
+}
+
+inline void SoftmaxScalar_(const float *in, const int &cols, float *out) {
+  float max = in[0];
+  for (int c = 1; c < cols; c++) {
+    max = std::max(max, in[c]);
+  }
+
+  float sum = 0.f;
+  for (int c = 0; c < cols; c++) {
+    out[c] = std::exp(in[c] - max);
+    sum += out[c];
+  }
+
+  const float scale = 1.f / sum;
+  for (int c = 0; c < cols; c++) {
+    out[c] *= scale;
+  }
+}
+
+// Puts value into the sorted list of the k largest so far if it belongs
+// there, ties go to the earlier column
+inline void InsertTopK_(const float &value, const int &c, const int &k,
+                        float *values, int32_t *indices, int *kept) {
+  if (*kept == k && value <= values[k - 1]) {
+    return;
+  }
+
+  int i = *kept < k ? (*kept)++ : k - 1;
+  for (; i > 0 && values[i - 1] < value; i--) {
+    values[i] = values[i - 1];
+    indices[i] = indices[i - 1];
+  }
+  values[i] = value;
+  indices[i] = c;
+}
+
+#ifdef BATCHING_RPC_SERVER_SSE_KERNELS
+// exp of 4 lanes at once, the Cephes polynomial: x = n ln2 + r, exp(r) from
+// a polynomial and 2^n put straight into the exponent bits. Within a couple
+// of ulp of std::exp for the x <= 0 a softmax feeds it.
+__attribute__((target("sse4.1"))) inline __m128 ExpSSE_(__m128 x) {
+  x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+  x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+  __m128 n = _mm_floor_ps(
+      _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)),
+                 _mm_set1_ps(0.5f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+  __m128 y = _mm_set1_ps(1.9875691500E-4f);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x);
+  y = _mm_add_ps(y, _mm_set1_ps(1.f));
+
+  const __m128i exponent = _mm_slli_epi32(
+      _mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(y, _mm_castsi128_ps(exponent));
+}
+
+// 4 columns at a time, the tails are done a value at a time
+__attribute__((target("sse4.1"))) inline void
+SoftmaxSSE_(const float *in, const int &cols, float *out) {
+  alignas(16) float lanes[4];
+
+  int c = 0;
+  __m128 max4 = _mm_set1_ps(in[0]);
+  for (; c + 4 <= cols; c += 4) {
+    max4 = _mm_max_ps(max4, _mm_loadu_ps(in + c));
+  }
+  _mm_store_ps(lanes, max4);
+  float max = std::max(std::max(lanes[0], lanes[1]),
+                       std::max(lanes[2], lanes[3]));
+  for (; c < cols; c++) {
+    max = std::max(max, in[c]);
+  }
+
+  c = 0;
+  const __m128 row_max = _mm_set1_ps(max);
+  __m128 sum4 = _mm_setzero_ps();
+  for (; c + 4 <= cols; c += 4) {
+    const __m128 e = ExpSSE_(_mm_sub_ps(_mm_loadu_ps(in + c), row_max));
+    _mm_storeu_ps(out + c, e);
+    sum4 = _mm_add_ps(sum4, e);
+  }
+  _mm_store_ps(lanes, sum4);
+  float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; c < cols; c++) {
+    out[c] = std::exp(in[c] - max);
+    sum += out[c];
+  }
+
+  c = 0;
+  const __m128 scale = _mm_set1_ps(1.f / sum);
+  for (; c + 4 <= cols; c += 4) {
+    _mm_storeu_ps(out + c, _mm_mul_ps(_mm_loadu_ps(out + c), scale));
+  }
+  for (; c < cols; c++) {
+    out[c] *= 1.f / sum;
+  }
+}
+
+// Once k values are kept most of the row is under the smallest of them, four
+// columns are ruled out with one comparison. Returns the column it got to.
+__attribute__((target("sse4.1"))) inline int
+TopKSSE_(const float *row, int c, const int &cols, const int &k,
+         float *values, int32_t *indices, int *kept) {
+  for (; c + 4 <= cols; c += 4) {
+    // Not <= rather than >, so a NaN is inserted as it would be one at a time
+    const __m128 over = _mm_cmpnle_ps(_mm_loadu_ps(row + c),
+                                      _mm_set1_ps(values[k - 1]));
+    if (_mm_movemask_ps(over) == 0) {
+      continue;
+    }
+    for (int lane = 0; lane < 4; lane++) {
+      InsertTopK_(row[c + lane], c + lane, k, values, indices, kept);
+    }
+  }
+  return c;
+}
+#endif
+
+#ifdef BATCHING_RPC_SERVER_NEON_KERNELS
+// As ExpSSE_, ARMv7 has no vector floor so it's a truncation corrected for
+// negative values
+inline float32x4_t ExpNEON_(float32x4_t x) {
+  x = vminq_f32(x, vdupq_n_f32(88.3762626647949f));
+  x = vmaxq_f32(x, vdupq_n_f32(-88.3762626647949f));
+
+  const float32x4_t scaled =
+      vmlaq_f32(vdupq_n_f32(0.5f), x, vdupq_n_f32(1.44269504088896341f));
+  float32x4_t n = vcvtq_f32_s32(vcvtq_s32_f32(scaled));
+  const uint32x4_t rounded_up = vcgtq_f32(n, scaled);
+  n = vsubq_f32(n, vreinterpretq_f32_u32(vandq_u32(
+                       rounded_up, vreinterpretq_u32_f32(vdupq_n_f32(1.f)))));
+  x = vmlsq_f32(x, n, vdupq_n_f32(0.693359375f));
+  x = vmlsq_f32(x, n, vdupq_n_f32(-2.12194440e-4f));
+
+  float32x4_t y = vdupq_n_f32(1.9875691500E-4f);
+  y = vmlaq_f32(vdupq_n_f32(1.3981999507E-3f), y, x);
+  y = vmlaq_f32(vdupq_n_f32(8.3334519073E-3f), y, x);
+  y = vmlaq_f32(vdupq_n_f32(4.1665795894E-2f), y, x);
+  y = vmlaq_f32(vdupq_n_f32(1.6666665459E-1f), y, x);
+  y = vmlaq_f32(vdupq_n_f32(5.0000001201E-1f), y, x);
+  y = vmlaq_f32(x, y, vmulq_f32(x, x));
+  y = vaddq_f32(y, vdupq_n_f32(1.f));
+
+  const int32x4_t exponent =
+      vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+  return vmulq_f32(y, vreinterpretq_f32_s32(exponent));
+}
+
+inline void SoftmaxNEON_(const float *in, const int &cols, float *out) {
+  float lanes[4];
+
+  int c = 0;
+  float32x4_t max4 = vdupq_n_f32(in[0]);
+  for (; c + 4 <= cols; c += 4) {
+    max4 = vmaxq_f32(max4, vld1q_f32(in + c));
+  }
+  vst1q_f32(lanes, max4);
+  float max = std::max(std::max(lanes[0], lanes[1]),
+                       std::max(lanes[2], lanes[3]));
+  for (; c < cols; c++) {
+    max = std::max(max, in[c]);
+  }
+
+  c = 0;
+  const float32x4_t row_max = vdupq_n_f32(max);
+  float32x4_t sum4 = vdupq_n_f32(0.f);
+  for (; c + 4 <= cols; c += 4) {
+    const float32x4_t e = ExpNEON_(vsubq_f32(vld1q_f32(in + c), row_max));
+    vst1q_f32(out + c, e);
+    sum4 = vaddq_f32(sum4, e);
+  }
+  vst1q_f32(lanes, sum4);
+  float sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; c < cols; c++) {
+    out[c] = std::exp(in[c] - max);
+    sum += out[c];
+  }
+
+  c = 0;
+  const float32x4_t scale = vdupq_n_f32(1.f / sum);
+  for (; c + 4 <= cols; c += 4) {
+    vst1q_f32(out + c, vmulq_f32(vld1q_f32(out + c), scale));
+  }
+  for (; c < cols; c++) {
+    out[c] *= 1.f / sum;
+  }
+}
+
+inline int TopKNEON_(const float *row, int c, const int &cols, const int &k,
+                     float *values, int32_t *indices, int *kept) {
+  for (; c + 4 <= cols; c += 4) {
+    const uint32x4_t under =
+        vcleq_f32(vld1q_f32(row + c), vdupq_n_f32(values[k - 1]));
+    const uint32x2_t halves =
+        vand_u32(vget_low_u32(under), vget_high_u32(under));
+    if ((vget_lane_u32(halves, 0) & vget_lane_u32(halves, 1)) != 0) {
+      continue;
+    }
+    for (int lane = 0; lane < 4; lane++) {
+      InsertTopK_(row[c + lane], c + lane, k, values, indices, kept);
+    }
+  }
+  return c;
+}
+#endif
+
+/**
+ * @brief Softmax of one row, in and out may be the same.
+ *
+ * Takes a SIMD path where the CPU has one (SSE4.1 or NEON), with its own
+ * vector exp, otherwise it's done a value at a time.
+ */
+inline void Softmax(const float *in, const int &cols, float *out) {
+#if defined(BATCHING_RPC_SERVER_SSE_KERNELS)
+  static const bool sse = __builtin_cpu_supports("sse4.1");
+  if (sse) {
+    SoftmaxSSE_(in, cols, out);
+    return;
+  }
+#elif defined(BATCHING_RPC_SERVER_NEON_KERNELS)
+  SoftmaxNEON_(in, cols, out);
+  return;
+#endif
+
+  SoftmaxScalar_(in, cols, out);
+}
+
+/**
+ * @brief The k largest values of one row, largest first.
+ *
+ * Values are inserted into the sorted list of the k largest so far, which
+ * for the small k callers ask for is one comparison per value. Once k are
+ * kept, a SIMD path (SSE4.1 or NEON) rules out four values per comparison.
+ * Ties go to the earlier column.
+ *
+ * @return How many were written, k unless the row is shorter.
+ */
+inline int TopK(const float *row, const int &cols, const int &k, float *values,
+                int32_t *indices) {
+  int kept = 0;
+  if (k <= 0) {
+    return kept;
+  }
+
+  int c = 0;
+  for (; c < cols && kept < k; c++) {
+    InsertTopK_(row[c], c, k, values, indices, &kept);
+  }
+
+#if defined(BATCHING_RPC_SERVER_SSE_KERNELS)
+  static const bool sse = __builtin_cpu_supports("sse4.1");
+  if (sse) {
+    c = TopKSSE_(row, c, cols, k, values, indices, &kept);
+  }
+#elif defined(BATCHING_RPC_SERVER_NEON_KERNELS)
+  c = TopKNEON_(row, c, cols, k, values, indices, &kept);
+#endif
+
+  for (; c < cols; c++) {
+    InsertTopK_(row[c], c, k, values, indices, &kept);
+  }
+  return kept;
+}
+
+/**
+ * @brief Postprocesses rows of a model's output into a response.
+ *
+ * Without top_k or a threshold the response is the rows as they are (after
+ * the softmax, if asked for), n by k. Otherwise each row keeps only the
+ * values selected, with their columns in indices and how many each row kept
+ * in counts, and k is the most any row can keep.
+ *
+ * @param options What to do, see Postprocessing.
+ * @param output The rows, one after the other.
+ * @param rows The number of rows.
+ * @param cols The length of each row.
+ * @param message Where the buffer, indices, counts and shape are written.
+ */
+inline void Postprocess(const Postprocessing &options, const float *output,
+                        const int &rows, const int &cols,
+                        TensorMessage *message) {
+  const bool select = options.top_k() > 0 || options.use_threshold();
+  const int k = options.top_k() > 0 ? std::min(options.top_k(), cols) : cols;
+
+  message->set_n(rows);
+  message->set_k(k);
+  message->set_nr(1);
+  message->set_nc(1);
+  message->clear_indices();
+  message->clear_counts();
+
+  if (!select) {
+    message->mutable_buffer()->Resize(rows * cols, 0.f);
+    float *buffer = message->mutable_buffer()->mutable_data();
+    for (int r = 0; r < rows; r++) {
+      if (options.softmax()) {
+        Softmax(output + r * cols, cols, buffer + r * cols);
+      } else {
+        std::copy(output + r * cols, output + (r + 1) * cols,
+                  buffer + r * cols);
+      }
+    }
+    return;
+  }
+
+  // Room for every row to keep k, trimmed once we know what they kept
+  message->mutable_buffer()->Resize(rows * k, 0.f);
+  message->mutable_indices()->Resize(rows * k, 0);
+  message->mutable_counts()->Resize(rows, 0);
+  float *values = message->mutable_buffer()->mutable_data();
+  int32_t *indices = message->mutable_indices()->mutable_data();
+  int32_t *counts = message->mutable_counts()->mutable_data();
+
+  std::vector<float> probabilities(options.softmax() ? cols : 0);
+  int total = 0;
+  for (int r = 0; r < rows; r++) {
+    const float *row = output + r * cols;
+    if (options.softmax()) {
+      Softmax(row, cols, probabilities.data());
+      row = probabilities.data();
+    }
+
+    int kept = 0;
+    if (options.top_k() > 0) {
+      kept = TopK(row, cols, k, values + total, indices + total);
+      if (options.use_threshold()) {
+        // Sorted, so everything under the threshold is at the end
+        while (kept > 0 && values[total + kept - 1] < options.threshold()) {
+          kept--;
+        }
+      }
+    } else {
+      for (int c = 0; c < cols; c++) {
+        if (row[c] >= options.threshold()) {
+          values[total + kept] = row[c];
+          indices[total + kept] = c;
+          kept++;
+        }
+      }
+    }
+
+    counts[r] = kept;
+    total += kept;
+  }
+
+  message->mutable_buffer()->Truncate(total);
+  message->mutable_indices()->Truncate(total);
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_POSTPROCESSING_HPP
@@ -0,0 +1,549 @@
+//
+// Created by Aman LaChapelle on 2/6/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_PREPROCESSINGSERVABLE_HPP
+#define BATCHING_RPC_SERVER_PREPROCESSINGSERVABLE_HPP
+
+// STL
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BATCHING_RPC_SERVER_SSE_KERNELS
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define BATCHING_RPC_SERVER_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+// Project
+#include "Servable.hpp"
+
+// Generated
+#include "BatchingRPC.pb.h"
+
+namespace Serving {
+
+inline void NormalizePlanes_(const uint8_t *pixels, const int &from,
+                             const int &to, const int &channels,
+                             const int &plane, const float *mean,
+                             const float *scale, float *out) {
+  for (int c = 0; c < channels; c++) {
+    float *out_plane = out + c * plane;
+    for (int i = from; i < to; i++) {
+      out_plane[i] = (pixels[i * channels + c] - mean[c]) * scale[c];
+    }
+  }
+}
+
+#ifdef BATCHING_RPC_SERVER_SSE_KERNELS
+// 16 pixels at a time: three shuffles per channel pull its bytes out of the
+// 48 interleaved ones, which then widen to 4 lanes of floats at a time
+__attribute__((target("ssse3,sse4.1"))) inline int
+NormalizeRGBSSE_(const uint8_t *pixels, const int &plane, const float *mean,
+                 const float *scale, float *out) {
+  struct Masks {
+    alignas(16) int8_t bytes[3][3][16]; // [channel][source register][lane]
+    Masks() {
+      for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < 3; r++) {
+          for (int lane = 0; lane < 16; lane++) {
+            const int source = 3 * lane + c;
+            bytes[c][r][lane] =
+                source / 16 == r ? static_cast<int8_t>(source % 16) : -128;
+          }
+        }
+      }
+    }
+  };
+  static const Masks masks;
+
+  int i = 0;
+  for (; i + 16 <= plane; i += 16) {
+    const uint8_t *in = pixels + 3 * i;
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+    const __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 16));
+    const __m128i d =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 32));
+
+    for (int c = 0; c < 3; c++) {
+      const __m128i *mask =
+          reinterpret_cast<const __m128i *>(masks.bytes[c][0]);
+      __m128i channel = _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(a, _mm_load_si128(mask)),
+                       _mm_shuffle_epi8(b, _mm_load_si128(mask + 1))),
+          _mm_shuffle_epi8(d, _mm_load_si128(mask + 2)));
+
+      const __m128 channel_mean = _mm_set1_ps(mean[c]);
+      const __m128 channel_scale = _mm_set1_ps(scale[c]);
+      float *out_plane = out + c * plane + i;
+      for (int quarter = 0; quarter < 4; quarter++) {
+        __m128 values = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(channel));
+        values = _mm_mul_ps(_mm_sub_ps(values, channel_mean), channel_scale);
+        _mm_storeu_ps(out_plane + 4 * quarter, values);
+        channel = _mm_srli_si128(channel, 4);
+      }
+    }
+  }
+  return i;
+}
+#endif
+
+#ifdef BATCHING_RPC_SERVER_NEON_KERNELS
+// 16 pixels at a time, vld3 does the deinterleaving for us
+inline int NormalizeRGBNEON_(const uint8_t *pixels, const int &plane,
+                             const float *mean, const float *scale,
+                             float *out) {
+  int i = 0;
+  for (; i + 16 <= plane; i += 16) {
+    const uint8x16x3_t rgb = vld3q_u8(pixels + 3 * i);
+    for (int c = 0; c < 3; c++) {
+      const float32x4_t channel_mean = vdupq_n_f32(mean[c]);
+      const float32x4_t channel_scale = vdupq_n_f32(scale[c]);
+      const uint16x8_t low = vmovl_u8(vget_low_u8(rgb.val[c]));
+      const uint16x8_t high = vmovl_u8(vget_high_u8(rgb.val[c]));
+      const uint32x4_t quarters[4] = {
+          vmovl_u16(vget_low_u16(low)), vmovl_u16(vget_high_u16(low)),
+          vmovl_u16(vget_low_u16(high)), vmovl_u16(vget_high_u16(high))};
+
+      float *out_plane = out + c * plane + i;
+      for (int quarter = 0; quarter < 4; quarter++) {
+        float32x4_t values = vcvtq_f32_u32(quarters[quarter]);
+        values = vmulq_f32(vsubq_f32(values, channel_mean), channel_scale);
+        vst1q_f32(out_plane + 4 * quarter, values);
+      }
+    }
+  }
+  return i;
+}
+#endif
+
+/**
+ * @brief Turns interleaved uint8 images into normalized planar floats.
+ *
+ * Each output value is (pixel - mean[c]) * scale[c], written in CHW order.
+ * Three channel images take a SIMD path where the CPU has one (SSE4.1 or
+ * NEON), everything else is done a value at a time.
+ *
+ * @param pixels n images of plane pixels with channels bytes each (HWC).
+ * @param n The number of images.
+ * @param channels The number of interleaved channels.
+ * @param plane The number of pixels in each image, rows times columns.
+ * @param mean The value subtracted from each channel.
+ * @param scale What each channel is multiplied by afterwards, 1 / std.
+ * @param out Room for n * channels * plane floats.
+ */
+inline void NormalizeImages(const uint8_t *pixels, const int &n,
+                            const int &channels, const int &plane,
+                            const float *mean, const float *scale, float *out) {
+  const int image_size = channels * plane;
+
+  for (int image = 0; image < n; image++) {
+    const uint8_t *in = pixels + image * image_size;
+    float *image_out = out + image * image_size;
+
+    int done = 0;
+    if (channels == 3) {
+#if defined(BATCHING_RPC_SERVER_SSE_KERNELS)
+      static const bool sse = __builtin_cpu_supports("sse4.1");
+      if (sse) {
+        done = NormalizeRGBSSE_(in, plane, mean, scale, image_out);
+      }
+#elif defined(BATCHING_RPC_SERVER_NEON_KERNELS)
+      done = NormalizeRGBNEON_(in, plane, mean, scale, image_out);
+#endif
+    }
+
+    NormalizePlanes_(in, done, plane, channels, plane, mean, scale, image_out);
+  }
+}
+
+/**
+ * @brief Decodes an encoded image and resizes it.
+ *
+ * Called as decoder(encoded, rows, cols, channels, pixels), it writes rows *
+ * cols * channels bytes in HWC order to pixels and returns false if the
+ * image couldn't be decoded. See DlibDecodeImage.
+ */
+using ImageDecoder = std::function<bool(const std::string &, const int &,
+                                        const int &, const int &, uint8_t *)>;
+
+/**
+ * @brief Options for the preprocessing a PreprocessingServable does.
+ */
+struct PreprocessingOptions {
+  //! Subtracted from each channel, one value per channel or one for all.
+  //! Empty subtracts nothing.
+  std::vector<float> mean;
+  //! Each channel is divided by this after the mean is subtracted, one value
+  //! per channel or one for all. Empty divides by 1.
+  std::vector<float> stddev;
+  //! The number of threads preprocessing requests.
+  int threads = 2;
+  //! Decodes the images of requests that carry encoded images, requests
+  //! with images are refused without one.
+  ImageDecoder decoder;
+  //! The most floats a request may preprocess to, n * k * nr * nc. The
+  //! shape of an encoded request is only the client's word, this keeps it
+  //! from making the server allocate more than a batch could ever need.
+  //! Larger requests are refused with BATCH_TOO_LARGE, so a TBClient splits
+  //! them, or SHAPE_INCORRECT if a single image is already too large.
+  int max_floats = 1 << 26;
+};
+
+/**
+ * @class PreprocessingServable
+ * @brief Accepts uint8 images for a Servable that takes normalized floats.
+ *
+ * Requests that carry pixels instead of a buffer are handed to a pool of
+ * preprocessing threads, which cast them to float, normalize them and
+ * transpose them from HWC to CHW before adding them to the wrapped Servable's
+ * batch. While they do, the wrapped Servable runs the batches already
+ * formed. Requests that carry a float buffer go straight through.
+ *
+ * Requests can also carry encoded images, given a decoder. Each image is then
+ * its own job for the pool: it's decoded, resized to the request's nr x nc
+ * and normalized straight into its place in the request's buffer, so the
+ * images of one request are decoded in parallel.
+ *
+ * Because preprocessing finishes after AddToBatch has returned, errors from
+ * the wrapped Servable's AddToBatch (a shape the model doesn't take, a full
+ * queue) are returned from GetResult instead.
+ */
+class PreprocessingServable : public Servable {
+public:
+  /**
+   * @brief Wraps a Servable.
+   *
+   * @param servable The Servable to preprocess for, the
+   * PreprocessingServable takes ownership of it.
+   * @param options The normalization to apply and the size of the pool.
+   */
+  PreprocessingServable(Servable *servable,
+                        const PreprocessingOptions &options);
+
+  ~PreprocessingServable() override;
+
+  ReturnCodes SetBatchSize(const int &new_size) override;
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override;
+
+  ReturnCodes AddToBatch(const TensorMessage &message,
+                         const RequestInfo &info) override;
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override;
+
+  ReturnCodes Bind(BindArgs &args) override;
+
+  bool IsReady() override;
+
+  void Discard(const std::string &client_id) override;
+
+  void Drain() override;
+
+  BatchingStats GetBatchingStats() override;
+
+  LoadStats GetLoad() override;
+
+private:
+  // A request in the pool, shared by the jobs working on its images
+  struct Request_ {
+    TensorMessage message; // the buffer is sized before the jobs start
+    RequestInfo info;
+    std::string key;
+    std::vector<float> mean;  // per channel
+    std::vector<float> scale; // per channel
+    std::atomic<int> remaining; // jobs still to finish
+    std::atomic<bool> failed;
+  };
+
+  struct Job_ {
+    std::shared_ptr<Request_> request;
+    int image; // -1 for the pixels of every image
+  };
+
+  void Worker_();
+
+  bool Preprocess_(Request_ &request, const int &image);
+
+  std::unique_ptr<Servable> servable_;
+  std::vector<float> mean_;  // per channel, or one for all
+  std::vector<float> scale_; // likewise
+  ImageDecoder decoder_;
+  int64_t max_floats_;
+
+  std::mutex mutex_;
+  std::condition_variable job_cv_;
+  std::condition_variable done_cv_;
+  std::deque<Job_> jobs_;
+  std::map<std::string, ReturnCodes> added_; // absent while still working
+  std::map<std::string, int> working_;       // requests per key in the pool
+  std::set<std::string> discarded_; // discarded once out of the pool
+  bool stop_;
+
+  std::vector<std::thread> workers_;
+};
+
+// Implementation
+
+inline PreprocessingServable::PreprocessingServable(
+    Servable *servable, const PreprocessingOptions &options)
+    : servable_(servable), mean_(options.mean), decoder_(options.decoder),
+      max_floats_(std::max(0, options.max_floats)), stop_(false) {
+  for (const float &stddev : options.stddev) {
+    scale_.push_back(1.f / stddev);
+  }
+
+  for (int i = 0; i < std::max(1, options.threads); i++) {
+    workers_.emplace_back(&PreprocessingServable::Worker_, this);
+  }
+}
+
+inline PreprocessingServable::~PreprocessingServable() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  job_cv_.notify_all();
+
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+inline ReturnCodes PreprocessingServable::SetBatchSize(const int &new_size) {
+  return servable_->SetBatchSize(new_size);
+}
+
+inline ReturnCodes
+PreprocessingServable::AddToBatch(const TensorMessage &message) {
+  return AddToBatch(message, RequestInfo());
+}
+
+inline ReturnCodes
+PreprocessingServable::AddToBatch(const TensorMessage &message,
+                                  const RequestInfo &info) {
+  const bool encoded = message.images_size() > 0;
+  if (message.pixels().empty() && !encoded) {
+    return servable_->AddToBatch(message, info);
+  }
+
+  // The shape decides how much is allocated, so it's checked before
+  // anything is multiplied out. Each factor is positive and the product is
+  // kept within max_floats_, which fits in an int.
+  const int channels = message.k();
+  if (message.n() <= 0 || channels <= 0 || message.nr() <= 0 ||
+      message.nc() <= 0 || message.nr() > max_floats_ / channels ||
+      message.nc() > max_floats_ / (int64_t(channels) * message.nr())) {
+    return ReturnCodes::SHAPE_INCORRECT;
+  }
+  const int64_t image_size = int64_t(channels) * message.nr() * message.nc();
+  if (message.n() > max_floats_ / image_size) {
+    return ReturnCodes::BATCH_TOO_LARGE;
+  }
+
+  if ((encoded ? !decoder_ || message.images_size() != message.n()
+               : message.pixels().size() !=
+                     static_cast<size_t>(message.n() * image_size)) ||
+      (mean_.size() > 1 && static_cast<int>(mean_.size()) != channels) ||
+      (scale_.size() > 1 && static_cast<int>(scale_.size()) != channels)) {
+    return ReturnCodes::SHAPE_INCORRECT;
+  }
+
+  std::shared_ptr<Request_> request = std::make_shared<Request_>();
+  request->message = message;
+  request->message.mutable_buffer()->Resize(
+      static_cast<int>(message.n() * image_size), 0.f);
+  request->info = info;
+  request->key =
+      info.result_key.empty() ? message.client_id() : info.result_key;
+  request->remaining = encoded ? message.n() : 1;
+  request->failed = false;
+
+  // Single values apply to every channel
+  request->mean.assign(channels, 0.f);
+  request->scale.assign(channels, 1.f);
+  for (int c = 0; c < channels; c++) {
+    if (!mean_.empty()) {
+      request->mean[c] = mean_.size() == 1 ? mean_[0] : mean_[c];
+    }
+    if (!scale_.empty()) {
+      request->scale[c] = scale_.size() == 1 ? scale_[0] : scale_[c];
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    added_.erase(request->key);
+    working_[request->key]++;
+    if (encoded) {
+      for (int image = 0; image < message.n(); image++) {
+        jobs_.push_back({request, image});
+      }
+    } else {
+      jobs_.push_back({request, -1});
+    }
+  }
+  job_cv_.notify_all();
+
+  return ReturnCodes::OK;
+}
+
+inline ReturnCodes
+PreprocessingServable::GetResult(const std::string &client_id,
+                                 TensorMessage *message) {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    done_cv_.wait(lk, [&, this]() {
+      return working_.find(client_id) == working_.end();
+    });
+
+    auto added = added_.find(client_id);
+    if (added != added_.end()) {
+      const ReturnCodes code = added->second;
+      added_.erase(added);
+      if (code != ReturnCodes::OK) {
+        return code;
+      }
+    }
+  }
+
+  return servable_->GetResult(client_id, message);
+}
+
+inline ReturnCodes PreprocessingServable::Bind(BindArgs &args) {
+  return servable_->Bind(args);
+}
+
+inline bool PreprocessingServable::IsReady() { return servable_->IsReady(); }
+
+inline void PreprocessingServable::Discard(const std::string &client_id) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (working_.find(client_id) != working_.end()) {
+      discarded_.insert(client_id); // by the worker that adds it
+      return;
+    }
+    added_.erase(client_id);
+  }
+  servable_->Discard(client_id);
+}
+
+inline void PreprocessingServable::Drain() { servable_->Drain(); }
+
+inline BatchingStats PreprocessingServable::GetBatchingStats() {
+  return servable_->GetBatchingStats();
+}
+
+inline LoadStats PreprocessingServable::GetLoad() {
+  return servable_->GetLoad();
+}
+
+inline void PreprocessingServable::Worker_() {
+  while (true) {
+    Job_ job;
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      job_cv_.wait(lk, [this]() { return stop_ || !jobs_.empty(); });
+      if (stop_) {
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+
+    Request_ &request = *job.request;
+    if (!Preprocess_(request, job.image)) {
+      request.failed = true;
+    }
+    if (--request.remaining > 0) {
+      continue; // the request's last job adds it to the batch
+    }
+
+    ReturnCodes code = ReturnCodes::SHAPE_INCORRECT;
+    if (!request.failed) {
+      request.message.clear_pixels();
+      request.message.clear_images();
+      code = servable_->AddToBatch(request.message, request.info);
+    }
+
+    bool discarded = false;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (--working_[request.key] == 0) {
+        working_.erase(request.key);
+        discarded = discarded_.erase(request.key) > 0;
+      }
+      if (discarded) {
+        added_.erase(request.key);
+      } else {
+        added_[request.key] = code;
+      }
+    }
+    done_cv_.notify_all();
+    if (discarded && code == ReturnCodes::OK) {
+      servable_->Discard(request.key);
+    }
+  }
+}
+
+inline bool PreprocessingServable::Preprocess_(Request_ &request,
+                                               const int &image) {
+  TensorMessage &message = request.message;
+  const int channels = message.k();
+  const int plane = message.nr() * message.nc();
+  float *buffer = message.mutable_buffer()->mutable_data();
+
+  if (image < 0) {
+    NormalizeImages(reinterpret_cast<const uint8_t *>(message.pixels().data()),
+                    message.n(), channels, plane, request.mean.data(),
+                    request.scale.data(), buffer);
+    return true;
+  }
+
+  std::vector<uint8_t> pixels(channels * plane);
+  if (!decoder_(message.images(image), message.nr(), message.nc(), channels,
+                pixels.data())) {
+    return false;
+  }
+  NormalizeImages(pixels.data(), 1, channels, plane, request.mean.data(),
+                  request.scale.data(), buffer + image * channels * plane);
+  return true;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_PREPROCESSINGSERVABLE_HPP
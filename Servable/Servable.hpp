@@ -23,6 +23,12 @@
 #ifndef BATCHING_RPC_SERVER_SERVABLE_HPP
 #define BATCHING_RPC_SERVER_SERVABLE_HPP
 
+// STL
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
 // Generated
 #include "BatchingRPC.pb.h"
 
@@ -57,7 +63,7 @@ enum ReturnCodes {
   //! or increase the batch size.
   BATCH_TOO_LARGE = 5,
   //! Bind has failed because the Servable was unable to cast the BindArgs
-  //! instance to a usable type.
+  //! instance to a usable type, or the files it names couldn't be read.
   NO_SUITABLE_BIND_ARGS = 6,
 };
 
@@ -73,6 +79,123 @@ struct BindArgs {
   virtual ~BindArgs() = default;
 };
 
+/**
+ * @brief The order in which a Servable forms batches from pending requests.
+ */
+enum SchedulingPolicy {
+  //! Requests are batched strictly in arrival order.
+  FIFO = 1,
+  //! Requests are batched by priority class (higher first), then by
+  //! earliest deadline, then by arrival order.
+  EDF = 2,
+  //! Batches are shared between the clients with pending requests by deficit
+  //! round-robin, each client receiving rows in proportion to its weight in
+  //! BatchingOptions::client_weights. A client's own requests stay in arrival
+  //! order.
+  FAIR = 3,
+};
+
+/**
+ * @brief Options controlling how a Servable forms its batches.
+ *
+ * Every Servable implementation accepts these at construction. The defaults
+ * reproduce the original behaviour: requests are batched in arrival order and
+ * at most one batch worth of rows may be pending at any time.
+ */
+struct BatchingOptions {
+  //! The order in which pending requests are placed into batches.
+  SchedulingPolicy policy = FIFO;
+  //! How many batches worth of rows may be pending before AddToBatch starts
+  //! returning ReturnCodes::NEXT_BATCH. Deadline ordering only has an effect
+  //! when this is larger than 1, since otherwise everything pending fits in
+  //! the next batch anyway.
+  int max_pending_batches = 1;
+  //! The number of model replicas, each with its own executor and batching
+  //! thread, that take batches from the shared queue. Replicas share the
+  //! read-only model weights where the framework allows it.
+  int replicas = 1;
+  //! The number of threads each replica's forward pass may use, 0 leaves the
+  //! framework default. MXNet reads this once when its engine starts so it
+  //! only takes effect if the servable is the first thing to use MXNet.
+  int replica_threads = 0;
+  //! CPU cores to pin each replica's batching thread to, replica i runs on
+  //! replica_cpus[i % replica_cpus.size()]. Empty leaves placement to the OS.
+  std::vector<std::vector<int>> replica_cpus;
+  //! Move each replica's buffers to the NUMA node of its first core. Replicas
+  //! on different nodes then get their own copy of the model weights, replicas
+  //! on the same node still share one. Needs replica_cpus.
+  bool numa_local = false;
+  //! Smaller batch sizes to bind alongside the full one. A partial batch runs
+  //! on the smallest of these it fits in instead of being padded out to the
+  //! full batch size. Servables that handle any batch size only warm them up.
+  //! A partial batch's forward pass is timed as its bucket's, which is what
+  //! it cost, so the BatchController only has timings at bound sizes.
+  std::vector<int> batch_buckets;
+  //! How many synthetic batches to run at every bound batch size before a
+  //! newly bound model takes traffic, 0 disables warmup.
+  int warmup_iterations = 1;
+  //! Relative shares of each batch under SchedulingPolicy::FAIR, keyed by the
+  //! client_id requests carry. Clients not listed have weight 1. Like deadline
+  //! ordering, fair sharing needs max_pending_batches larger than 1.
+  std::map<std::string, double> client_weights;
+  //! The p99 latency, from a request being queued to its result being ready,
+  //! that a BatchController keeps the Servable under by adjusting the batch
+  //! size and flush timeout. 0 batches at the bound size without a timeout.
+  std::chrono::microseconds target_p99 = std::chrono::microseconds(0);
+  //! How many requests the BatchController measures between adjustments.
+  int autotune_window = 256;
+};
+
+/**
+ * @brief What a Servable's BatchController has measured and decided.
+ */
+struct BatchingStats {
+  //! The rows the Servable currently batches.
+  int batch_size = 0;
+  //! The longest the oldest request waits for a batch to fill. Without a
+  //! target_p99 requests wait for a full batch and this is 0.
+  int flush_timeout_us = 0;
+  //! Rows arriving per second over the last window.
+  double arrival_rate = 0.0;
+  //! The smoothed forward pass time at batch_size.
+  double forward_us = 0.0;
+  //! The p99 request latency over the last window.
+  double p99_us = 0.0;
+  //! How many times the batch size has changed.
+  int adjustments = 0;
+};
+
+/**
+ * @brief How busy a Servable is right now, for health checks and load
+ * balancing.
+ */
+struct LoadStats {
+  //! Rows accepted and waiting to be batched.
+  int queued_rows = 0;
+  //! Batches in a forward pass, at most one per replica.
+  int batches_in_flight = 0;
+  //! The recent forward pass time, smoothed over the last few batches
+  //! whatever their size. 0 until the first batch.
+  double forward_us = 0.0;
+};
+
+/**
+ * @brief Per-request scheduling information filled in by the transport layer.
+ *
+ * The TBServer fills this in from the gRPC context of each call, a Servable
+ * uses it to decide which batch a request goes into.
+ */
+struct RequestInfo {
+  //! The time by which the caller needs its result, taken from the gRPC
+  //! deadline. Requests without a deadline sort after all others.
+  std::chrono::system_clock::time_point deadline =
+      std::chrono::system_clock::time_point::max();
+  //! The key the result is stored under for GetResult, the message's
+  //! client_id when empty. Lets the transport route results per call instead
+  //! of per client.
+  std::string result_key;
+};
+
 /**
  * @class Servable
  * @brief Delimits the public API for a Servable object.
@@ -113,6 +236,30 @@ public:
    */
   virtual ReturnCodes AddToBatch(const TensorMessage &message) = 0;
 
+  /**
+   * @brief Adds the TensorMessage to the batch along with its scheduling
+   * information.
+   *
+   * Servables that schedule by deadline override this, and should store the
+   * result under info.result_key when it's set. The default ignores the
+   * deadline and calls AddToBatch(const TensorMessage&), with a copy of the
+   * message carrying the result key as its client_id if there is one.
+   *
+   * @param message The TensorMessage we are requesting to process.
+   * @param info The deadline and result key of the request.
+   * @return The same codes as AddToBatch(const TensorMessage&).
+   */
+  virtual ReturnCodes AddToBatch(const TensorMessage &message,
+                                 const RequestInfo &info) {
+    if (info.result_key.empty()) {
+      return AddToBatch(message);
+    }
+
+    TensorMessage keyed = message;
+    keyed.set_client_id(info.result_key);
+    return AddToBatch(keyed);
+  }
+
   /**
    * @brief Gets the client's result. Blocks until the result is available.
    *
@@ -138,12 +285,69 @@ public:
    * implementation specific details that means the BindArgs implementations
    * will vary wildly. MXNetServable::Bind(BindArgs&) has an example.
    *
+   * Implementations should allow Bind to be called again while serving so a
+   * new model can be rolled out without a restart. The MXNet and dlib
+   * Servables build the new model next to the old one and swap it in between
+   * batches, a request is always processed entirely by one model.
+   *
    * @param args The algorithm, whether it's in a variable or stored in a
    * file.
    * @return Returns either ReturnCodes::OK if successful or
    * ReturnCodes::NO_SUITABLE_BIND_ARGS if the cast is unsuccessful.
    */
   virtual ReturnCodes Bind(BindArgs &args) = 0;
+
+  /**
+   * @brief Whether the Servable is ready to take requests.
+   *
+   * Implementations that warm up at Bind time only report ready once a model
+   * is bound and warm.
+   *
+   * @return true if requests will be served.
+   */
+  virtual bool IsReady() { return true; }
+
+  /**
+   * @brief Gives up on a result that won't be collected. Doesn't block.
+   *
+   * For a request that was added with AddToBatch but whose GetResult won't
+   * be called, for example because another part of a larger request failed.
+   * Rows already queued are still run, their result is dropped once it's
+   * ready instead of being kept for GetResult. Servables that don't keep
+   * results have nothing to do.
+   *
+   * @param client_id The key the result would have been stored under.
+   */
+  virtual void Discard(const std::string &client_id) {
+    static_cast<void>(client_id);
+  }
+
+  /**
+   * @brief Stops waiting for batches to fill.
+   *
+   * Called when the server shuts down and no more requests are coming to
+   * fill the partial batches. From then on whatever is pending is processed
+   * as soon as there's a replica free to take it, including requests that
+   * were already on their way in. Servables that don't hold requests back
+   * have nothing to do.
+   */
+  virtual void Drain() {}
+
+  /**
+   * @brief Reports how the Servable is batching.
+   *
+   * Servables with a BatchController return its measurements and decisions,
+   * the default has nothing to report.
+   */
+  virtual BatchingStats GetBatchingStats() { return BatchingStats(); }
+
+  /**
+   * @brief Reports how busy the Servable is.
+   *
+   * Called on every health check, so implementations read counters rather
+   * than take the locks the batching holds. The default has nothing queued.
+   */
+  virtual LoadStats GetLoad() { return LoadStats(); }
 };
 } // namespace Serving
 
@@ -0,0 +1,196 @@
+//
+// Created by Aman LaChapelle on 1/30/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_LOCALTRANSPORT_HPP
+#define BATCHING_RPC_SERVER_LOCALTRANSPORT_HPP
+
+// STL
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Generated
+#include <BatchingRPC.pb.h>
+
+namespace Serving {
+
+/**
+ * @class LocalChannel
+ * @brief The client end of the shared memory transport, for clients on the
+ * same host as the server.
+ *
+ * Opening the channel hands the client a shared memory region with one slot
+ * for requests and one for replies, plus a doorbell for each direction
+ * (eventfds on Linux, the handshake socket elsewhere). A request is written
+ * into its slot and the server rung, the reply comes back in the other slot.
+ * Requests skip HTTP/2, TLS and the loopback network stack, and a client that
+ * writes its tensor straight into InputBuffer doesn't serialize or copy it at
+ * all.
+ *
+ * A LocalChannel carries one request at a time, like the client_id it's
+ * opened with. It isn't thread-safe, open one per thread.
+ */
+class LocalChannel {
+public:
+  LocalChannel() = default;
+  LocalChannel(const LocalChannel &other) = delete;
+  LocalChannel &operator=(const LocalChannel &other) = delete;
+  ~LocalChannel();
+
+  /**
+   * @brief Opens the channel.
+   *
+   * @param address The local_address from the server's ConnectionReply.
+   * @param client_id The client_id from the same ConnectionReply.
+   * @return false if the server couldn't be reached or refused the client.
+   */
+  bool Open(const std::string &address, const std::string &client_id);
+
+  /**
+   * @brief Closes the channel, the server forgets it straight away.
+   */
+  void Close();
+
+  /**
+   * @brief Space for the next request's tensor in shared memory.
+   *
+   * @param floats The number of floats in the tensor.
+   * @return Where to write them, or nullptr if they don't fit.
+   */
+  float *InputBuffer(const size_t &floats);
+
+  /**
+   * @brief Sends a request whose tensor is already in InputBuffer.
+   *
+   * @param request Everything but the tensor, leave request.buffer empty.
+   * @param floats The number of floats written into InputBuffer.
+   * @param reply Filled with the server's reply.
+   * @param deadline Passed on to the servable like a gRPC deadline.
+   * @return The same status the Process RPC would have returned.
+   */
+  grpc::Status ProcessInPlace(
+      const TensorMessage &request, const size_t &floats, TensorMessage *reply,
+      const std::chrono::system_clock::time_point &deadline =
+          std::chrono::system_clock::time_point::max());
+
+  /**
+   * @brief Serializes a request into shared memory and sends it.
+   *
+   * Still skips HTTP/2, TLS and the network stack, use InputBuffer and
+   * ProcessInPlace to skip serializing the tensor as well.
+   *
+   * @param request The request, as it would be sent to the Process RPC.
+   * @param reply Filled with the server's reply.
+   * @param deadline Passed on to the servable like a gRPC deadline.
+   * @return The same status the Process RPC would have returned.
+   */
+  grpc::Status Process(const TensorMessage &request, TensorMessage *reply,
+                       const std::chrono::system_clock::time_point &deadline =
+                           std::chrono::system_clock::time_point::max());
+
+private:
+  int socket_ = -1;
+  int request_doorbell_ = -1;
+  int reply_doorbell_ = -1;
+  char *region_ = nullptr;
+  size_t slot_bytes_ = 0;
+};
+
+/**
+ * @class LocalListener
+ * @brief The server end of the shared memory transport.
+ *
+ * Listens on a Unix socket for LocalChannels to open. Each accepted channel
+ * gets its own shared memory region and a thread that waits on its doorbell,
+ * hands requests to the handler and writes the replies back.
+ */
+class LocalListener {
+public:
+  /**
+   * @brief Runs a request and fills in its reply.
+   */
+  using Handler = std::function<grpc::Status(
+      const TensorMessage &request,
+      const std::chrono::system_clock::time_point &deadline,
+      TensorMessage *reply)>;
+
+  /**
+   * @brief Decides whether a client_id may open a channel.
+   */
+  using Authorizer = std::function<bool(const std::string &client_id)>;
+
+  /**
+   * @brief Constructs a listener, it does nothing until started.
+   *
+   * @param handler Called for every request from every channel.
+   * @param authorizer Called with the client_id of every channel that opens.
+   */
+  LocalListener(Handler handler, Authorizer authorizer);
+  LocalListener(const LocalListener &other) = delete;
+  LocalListener &operator=(const LocalListener &other) = delete;
+  ~LocalListener();
+
+  /**
+   * @brief Starts listening.
+   *
+   * @param path The Unix socket to listen on, any stale socket there is
+   * replaced.
+   * @param max_message_bytes The largest request or reply a channel can
+   * carry, tensor included.
+   * @return false if the socket couldn't be created.
+   */
+  bool Start(const std::string &path, const size_t &max_message_bytes);
+
+  /**
+   * @brief Stops listening and closes every open channel.
+   */
+  void Stop();
+
+private:
+  void AcceptLoop_();
+  void ServeChannel_(const int &socket);
+
+  Handler handler_;
+  Authorizer authorizer_;
+
+  std::string path_;
+  size_t slot_bytes_ = 0;
+  int listen_socket_ = -1;
+  std::thread accept_thread_;
+
+  // Channel threads are detached, Stop waits for them to drain
+  std::mutex channels_mutex_;
+  std::condition_variable channels_done_;
+  bool stopping_ = false;
+  std::set<int> channel_sockets_;
+};
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_LOCALTRANSPORT_HPP
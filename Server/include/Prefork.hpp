@@ -0,0 +1,73 @@
+//
+// Created by Aman LaChapelle on 1/28/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_PREFORK_HPP
+#define BATCHING_RPC_SERVER_PREFORK_HPP
+
+// STL
+#include <functional>
+#include <string>
+
+namespace Serving {
+
+/**
+ * @brief Copies a file into anonymous shared memory that forked workers
+ * inherit.
+ *
+ * Load the model file once in the parent, then have each worker bind from the
+ * returned path (with MappedBindArgs for example). Every worker then maps the
+ * same physical pages read-only, no matter how many there are. Uses memfd
+ * where the kernel has it and an unlinked POSIX shared memory object
+ * elsewhere.
+ *
+ * @param filename The file to copy.
+ * @return A path the workers can open to map the copy, or an empty string if
+ * the copy failed.
+ */
+std::string ShareFile(const std::string &filename);
+
+/**
+ * @brief Runs a server in several worker processes that share its listening
+ * address.
+ *
+ * Forks workers child processes and calls worker_main in each, the parent
+ * stays behind as a supervisor. TBServer listens with SO_REUSEPORT, so each
+ * worker can start its own TBServer on the same address and the kernel
+ * balances incoming connections across them. A worker that crashes is
+ * replaced, SIGINT and SIGTERM are passed on to every worker.
+ *
+ * This must be called before gRPC or MXNet start any threads, neither
+ * survives a fork. State set up beforehand that's only read afterwards (a
+ * ShareFile copy, or a dlib network that each worker moves into its
+ * DlibServable) is shared copy-on-write by the workers.
+ *
+ * @param workers The number of worker processes.
+ * @param worker_main Runs a worker, it's passed the worker's index and its
+ * return value becomes the worker's exit status.
+ * @return 0 if every worker exited normally with status 0, 1 otherwise.
+ */
+int Prefork(const int &workers,
+            const std::function<int(const int &worker)> &worker_main);
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_PREFORK_HPP
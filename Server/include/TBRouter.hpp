@@ -0,0 +1,178 @@
+//
+// Created by Aman LaChapelle on 2/10/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_TBROUTER_HPP
+#define BATCHING_RPC_SERVER_TBROUTER_HPP
+
+// STL
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Generated
+#include <BatchingRPC.grpc.pb.h>
+#include <BatchingRPC.pb.h>
+
+namespace Serving {
+
+/**
+ * @brief How a TBRouter picks the backend for each request.
+ */
+enum RoutingPolicy {
+  //! The backend this router has the fewest rows outstanding at.
+  LEAST_OUTSTANDING_ROWS = 1,
+  //! The backend with the shortest queue, by the load it reported on its
+  //! last reply (see kLoadMetadataKey) or the rows this router has
+  //! outstanding there, whichever is more. Takes the traffic of other
+  //! routers and clients into account.
+  SHORTEST_QUEUE = 2,
+};
+
+/**
+ * @brief Options for a TBRouter.
+ */
+struct TBRouterOptions {
+  //! How requests are spread over the backends.
+  RoutingPolicy policy = LEAST_OUTSTANDING_ROWS;
+  //! Whether Process needs a client_id from the router's Connect. The
+  //! backends are called without one either way, so they have to be started
+  //! with TBServerOptions::require_connect off.
+  bool require_connect = true;
+  //! The largest request and reply, for the router's server and its channels
+  //! to the backends, 0 for gRPC's default and -1 for no limit.
+  int max_message_bytes = 0;
+  //! Ping the backends this often when there's nothing else on a channel, so
+  //! a backend that's gone is noticed before a request is sent to it.
+  int keepalive_time_ms = 0;
+};
+
+/**
+ * @brief What a TBRouter knows about one of its backends.
+ */
+struct BackendLoad {
+  std::string address;
+  int outstanding_rows = 0; //!< rows this router has sent and not had back
+  int reported_rows = 0;    //!< the backend's load on its last reply
+};
+
+/**
+ * @class TBRouter
+ * @brief Serves the BatchingServer API by forwarding every call to one of
+ * several TBServers.
+ *
+ * A generic proxy spreads connections without knowing how full each
+ * server's batches are. The router instead picks a backend for every
+ * request, by the rows it has outstanding there or by the load the backends
+ * report, see RoutingPolicy. Ties go to the first backend listed, which
+ * keeps light traffic together where it batches best.
+ *
+ * Each backend has one channel, opened when the router is made and kept for
+ * its lifetime, so requests reuse the backend's HTTP/2 connection. A request
+ * a backend turns away with UNAVAILABLE (a full queue, a server shutting
+ * down or one that can't be reached) is tried on the next best backend, and
+ * only fails once every backend has turned it away. SetBatchSize and Health
+ * go to every backend.
+ */
+class TBRouter final : public BatchingServer::Service {
+public:
+  /**
+   * @brief Opens a channel to every backend, start serving with
+   * TBRouter::StartInsecure.
+   *
+   * @param backends The backends' addresses, TCP or Unix domain sockets.
+   * @param options How to route, see TBRouterOptions.
+   */
+  explicit TBRouter(const std::vector<std::string> &backends,
+                    const TBRouterOptions &options = TBRouterOptions());
+
+  ~TBRouter() override;
+
+  grpc::Status SetBatchSize(grpc::ServerContext *ctx, const AdminRequest *req,
+                            AdminReply *rep) override;
+
+  grpc::Status Connect(grpc::ServerContext *ctx, const ConnectionRequest *req,
+                       ConnectionReply *rep) override;
+
+  grpc::Status Process(grpc::ServerContext *ctx, const TensorMessage *req,
+                       TensorMessage *rep) override;
+
+  /**
+   * @brief Asks every backend for its health and adds them up.
+   *
+   * The router is ready when any backend is, its queue and batches are the
+   * backends' added up, and its forward time is the slowest backend's. The
+   * backends' in-flight rows also refresh what SHORTEST_QUEUE routes by.
+   */
+  grpc::Status Health(grpc::ServerContext *ctx, const HealthRequest *req,
+                      HealthReply *rep) override;
+
+  /**
+   * @brief Starts routing on the specified address.
+   *
+   * @param server_address As for TBServer::StartInsecure.
+   */
+  void StartInsecure(const std::string &server_address);
+
+  /**
+   * @brief Stops routing, calls still being forwarded are cancelled.
+   */
+  void Stop();
+
+  /**
+   * @brief The router's view of each backend, in the order they were given.
+   */
+  std::vector<BackendLoad> Loads();
+
+private:
+  struct Backend_ {
+    std::string address;
+    std::unique_ptr<BatchingServer::Stub> stub;
+    std::atomic<int> outstanding_rows{0};
+    std::atomic<int> reported_rows{0};
+  };
+
+  int Pick_(const std::vector<bool> &tried);
+
+  void RecordLoad_(Backend_ &backend, const grpc::ClientContext &call);
+
+  bool KnownClient_(const std::string &client_id);
+
+  TBRouterOptions options_;
+  std::vector<std::unique_ptr<Backend_>> backends_;
+
+  std::mutex users_mutex_;
+  std::set<std::string> users_;
+
+  std::thread serve_thread_;
+  std::unique_ptr<grpc::Server> server_;
+};
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_TBROUTER_HPP
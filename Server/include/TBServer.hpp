@@ -24,8 +24,15 @@
 #define BATCHING_RPC_SERVER_TENSORBATCHINGSERVER_HPP
 
 // STL
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 // UUID
 #include <uuid/uuid.h>
@@ -35,6 +42,7 @@
 #include <grpc/support/log.h>
 
 // Project
+#include "LocalTransport.hpp"
 #include "Servable.hpp"
 
 // Generated
@@ -50,6 +58,70 @@
  * lives under this namespace. No subdivisions exist as of 26/12/2017.
  */
 namespace Serving {
+/**
+ * @brief The trailing metadata key every Process reply carries the server's
+ * load under: the rows of the Process calls it still has in flight once the
+ * call is done. A TBRouter balances its backends by it.
+ */
+const char kLoadMetadataKey[] = "batching-load-rows";
+
+/**
+ * @brief Tunes the gRPC server a TBServer starts.
+ *
+ * Every field left at 0 keeps gRPC's own default. Large tensors mostly need
+ * the message size limits raised (gRPC refuses messages over 4 MB by
+ * default, a batch of 224x224x3 float images passes that at 6 images) and
+ * larger flow-control windows so a single stream isn't throttled.
+ */
+struct TBServerOptions {
+  //! Whether Process needs a client_id from Connect. Without it the server
+  //! keeps no per-client state, every Process call is routed on its own and
+  //! any client_id (or none) is accepted, which saves short-lived clients
+  //! the Connect round trip.
+  bool require_connect = true;
+  //! Completion queues the sync server polls, gRPC uses one per core
+  int num_cqs = 0;
+  //! The fewest and most threads polling each completion queue for new
+  //! calls, more pollers pick up bursts of calls sooner
+  int min_pollers = 0;
+  int max_pollers = 0;
+  //! The largest request and reply the server accepts and sends, -1 for no
+  //! limit
+  int max_receive_message_bytes = 0;
+  int max_send_message_bytes = 0;
+  //! The most calls a single connection may have open
+  int max_concurrent_streams = 0;
+  //! The HTTP/2 flow-control window of each stream, how much may be in
+  //! flight before the sender waits for the receiver to catch up
+  int stream_window_bytes = 0;
+  //! Let gRPC grow the windows by probing the connection's bandwidth-delay
+  //! product
+  bool bdp_probe = true;
+  //! How much the transport buffers before writing to the socket
+  int write_buffer_bytes = 0;
+  //! Ping idle connections this often and drop them if the ping isn't
+  //! answered within keepalive_timeout_ms, catches clients that vanished
+  int keepalive_time_ms = 0;
+  int keepalive_timeout_ms = 0;
+  //! Also ping connections that have no calls open
+  bool keepalive_permit_without_calls = false;
+  //! Accept keepalive pings from clients this often without treating them
+  //! as abuse, must be at most the clients' keepalive time
+  int min_client_ping_interval_ms = 0;
+};
+
+/**
+ * @brief What happened to the requests in flight while the server drained.
+ */
+struct DrainStats {
+  int in_flight = 0; //!< Requests being served when the drain started
+  int completed = 0; //!< Requests that finished successfully during the drain
+  int failed = 0;    //!< Requests that finished with an error during the drain
+  int rejected = 0;  //!< New requests turned away while draining
+  int abandoned = 0; //!< Requests still running when the drain timed out
+  std::chrono::milliseconds duration{0}; //!< How long the drain took
+};
+
 /**
  * @class TBServer
  * @brief Implements the BatchingServer::Service, providing the transport/RPC
@@ -62,23 +134,60 @@ namespace Serving {
  * system as a whole must follow the API in BatchingRPC.proto and internal
  * requests from TBServer to an implementation of a Servable must follow the
  * API in Servable.hpp.
+ *
+ * A single TBServer can host several models. Each is a Servable registered
+ * under a name and version, keeps its own batch queue, and shares the gRPC
+ * transport and threads with every other model. Requests pick their model
+ * with the model_name and model_version fields of the TensorMessage. Models
+ * that chain into each other can be registered as one PipelineServable, so
+ * the results of one go to the next without leaving the server.
  */
 class TBServer final : public BatchingServer::Service {
 public:
+  /**
+   * @brief Constructs a new TBServer object with no models, register them
+   * with TBServer::AddServable.
+   *
+   * @param options Tuning for the gRPC server, applied when it's started.
+   */
+  explicit TBServer(const TBServerOptions &options = TBServerOptions());
+
   /**
    * @brief Constructs a new TBServer object around an already-created
    * Servable.
    *
+   * The Servable becomes version 1 of the default model, which serves the
+   * requests that don't set a model_name.
+   *
    * @param servable A pointer to an initialized Servable object. Takes
    * ownership of the pointer upon construction.
+   * @param options Tuning for the gRPC server, applied when it's started.
    */
-  explicit TBServer(Servable *servable);
+  explicit TBServer(Servable *servable,
+                    const TBServerOptions &options = TBServerOptions());
 
   /**
    * @brief Destroys a TBServer object and cleans up all resources.
    */
   ~TBServer() override;
 
+  /**
+   * @brief Registers a Servable as a version of a named model.
+   *
+   * Models may be added before or after the server is started. Requests that
+   * set model_version to 0 are routed to the highest registered version.
+   *
+   * @param name The model name requests use to route to this Servable. The
+   * empty string is the default model.
+   * @param version The version of the model, must be greater than 0.
+   * @param servable A pointer to an initialized Servable object. Takes
+   * ownership of the pointer.
+   * @return false if the version is invalid or is already registered, in
+   * which case the pointer is not taken.
+   */
+  bool AddServable(const std::string &name, const int &version,
+                   Servable *servable);
+
   /**
    * @brief Defines the gRPC backend for setting the batch size of the
    * Servable object. The client API for this function can be found in
@@ -90,7 +199,8 @@ public:
    * returned, indicating that the request should be retried. If the request
    * is successful, Serving::ReturnCodes::OK will be returned and the call can
    * proceed as normal. This call blocks on input aggregation and processing
-   * of the current batch.
+   * of the current batch. The model_name and model_version of the request
+   * select which Servable is resized.
    *
    * @param ctx
    * @param req
@@ -109,7 +219,9 @@ public:
    * collisions in the servable's processing space. The client should call
    * this function once, receive their unique ID, and tag all future requests
    * to Process with this unique ID. This function can be called as often as
-   * desired.
+   * desired. When the server was started with TBServer::StartLocal the reply
+   * also names the Unix socket that same-host clients can open a
+   * LocalChannel on.
    *
    * @param ctx
    * @param req
@@ -132,6 +244,10 @@ public:
    * function in a somewhat asynchronous manner can be found in
    * TestIntegration.cpp
    *
+   * The deadline set on the client's context (and the priority field of the
+   * TensorMessage) is passed on to the Servable, which uses it to order
+   * pending work if it was constructed with SchedulingPolicy::EDF.
+   *
    * @param ctx
    * @param req
    * @param rep
@@ -140,6 +256,25 @@ public:
   grpc::Status Process(grpc::ServerContext *ctx, const TensorMessage *req,
                        TensorMessage *rep) override;
 
+  /**
+   * @brief Defines the gRPC backend for checking how ready and how busy the
+   * server is. The client API for this function can be found in
+   * BatchingRPC.proto
+   *
+   * Reports whether the Servable picked by the request's model_name and
+   * model_version is bound and warm (Serving::Servable::IsReady) and its
+   * load (Serving::Servable::GetLoad), along with the rows of every Process
+   * call in flight. Nothing here takes a lock the batching holds, so load
+   * balancers can poll it as often as they like. Doesn't need a Connect.
+   *
+   * @param ctx
+   * @param req
+   * @param rep
+   * @return gRPC status to the client, NOT_FOUND for an unknown model.
+   */
+  grpc::Status Health(grpc::ServerContext *ctx, const HealthRequest *req,
+                      HealthReply *rep) override;
+
   /**
    * @brief Starts the server at the specified address.
    *
@@ -148,9 +283,29 @@ public:
    * function name.
    *
    * @param server_address Specifies the server's address - for example: @code
-   * "127.0.0.1:8080" @endcode
+   * "127.0.0.1:8080" @endcode or a Unix domain socket, @code
+   * "unix:/run/tbserver.sock" @endcode
+   * @return false if the address couldn't be listened on, the server isn't
+   * started then.
    */
-  void StartInsecure(const std::string &server_address);
+  bool StartInsecure(const std::string &server_address);
+
+  /**
+   * @brief Starts the server listening on several addresses at once.
+   *
+   * Mix TCP and Unix domain socket addresses to serve remote callers over
+   * TCP and sidecars on the same host over the socket, which skips the TCP/IP
+   * stack. A socket file left behind by a server that's no longer running is
+   * replaced, one that's still being served fails the bind. Unix sockets
+   * aren't shared by preforked workers, give each worker its own path.
+   * TBServer::Stop only removes the socket files this server bound.
+   *
+   * @param server_addresses The addresses, each as for the single address
+   * overload.
+   * @return false if any address couldn't be listened on, the server isn't
+   * started on the others either.
+   */
+  bool StartInsecure(const std::vector<std::string> &server_addresses);
 
   /**
    * @brief Starts the server at the specified address, with the specified
@@ -166,21 +321,103 @@ public:
    * @param cert Either a filename or the actual certificate in a string. The
    * function checks for the first five dashes
    *             in the key to determine if it's a filename or not.
+   * @return false if the address couldn't be listened on.
    */
-  void StartSSL(const std::string &server_address, const std::string &key,
+  bool StartSSL(const std::string &server_address, const std::string &key,
                 const std::string &cert);
 
   /**
-   * @brief Shuts down the server and cleans up used resources.
+   * @brief Starts the server listening on several addresses at once, with
+   * the specified credentials on all of them.
+   *
+   * @param server_addresses The addresses, TCP or Unix domain sockets as for
+   * the insecure overload.
+   * @param key Either a filename or the actual key in a string.
+   * @param cert Either a filename or the actual certificate in a string.
+   * @return false if any address couldn't be listened on.
+   */
+  bool StartSSL(const std::vector<std::string> &server_addresses,
+                const std::string &key, const std::string &cert);
+
+  /**
+   * @brief Also serves clients on this host over shared memory.
+   *
+   * Clients still call Connect over gRPC, then open a LocalChannel on the
+   * local_address in the reply and send their requests through it. Requests
+   * are handled exactly like the Process RPC. Call this before or after
+   * starting the gRPC server, TBServer::Stop stops both.
+   *
+   * @param socket_path The Unix socket LocalChannels connect to.
+   * @param max_message_bytes The largest request or reply a LocalChannel can
+   * carry, tensor included. Shared memory is only committed as it's used.
+   * @return false if the socket couldn't be created.
+   */
+  bool StartLocal(const std::string &socket_path,
+                  const size_t &max_message_bytes = 64 << 20);
+
+  /**
+   * @brief Drains and shuts down the server and cleans up used resources.
+   *
+   * New requests are turned away with UNAVAILABLE so clients retry against
+   * another server, and every Servable is drained so the requests sitting in
+   * partial batches run right away instead of waiting for a batch that will
+   * never fill. Once the requests in flight have finished, or drain_timeout
+   * has passed, the transports are shut down. Requests still running then are
+   * cancelled, Stop returns once their handlers have.
+   *
+   * Draining is permanent for the Servables, they're meant to be destroyed
+   * along with the server.
+   *
+   * @param drain_timeout The longest to wait for requests in flight.
+   * @return What happened to the requests in flight, also logged to
+   * std::clog.
    */
-  void Stop();
+  DrainStats Stop(const std::chrono::milliseconds &drain_timeout =
+                      std::chrono::seconds(10));
 
 private:
+  Servable *FindServable_(const std::string &name, const int &version);
+
+  grpc::Status Process_(const TensorMessage &req, const RequestInfo &info,
+                        TensorMessage *rep);
+
+  grpc::Status Dispatch_(const TensorMessage &req, const RequestInfo &info,
+                         TensorMessage *rep);
+
+  bool KnownClient_(const std::string &client_id);
+
+  bool Start_(const std::vector<std::string> &server_addresses,
+              const std::shared_ptr<grpc::ServerCredentials> &credentials);
+
+  // A socket file this server bound, told apart from one that replaced it
+  struct UnixSocket_ {
+    std::string path;
+    uint64_t device;
+    uint64_t inode;
+  };
+  std::vector<UnixSocket_> unix_sockets_;
+
+  TBServerOptions options_;
+
+  std::unique_ptr<LocalListener> local_listener_;
+  std::string local_address_;
+
+  // Requests being served, so Stop can wait for them
+  std::mutex drain_mutex_;
+  std::condition_variable drain_cv_;
+  bool draining_ = false;
+  int in_flight_ = 0;
+  DrainStats drain_stats_;
+  std::atomic<int> in_flight_rows_{0}; // reported as the server's load
+
+  std::mutex users_mutex_;
   std::set<std::string> users_;
+  std::atomic<uint64_t> next_call_{0}; // result keys without Connect
   std::thread serve_thread_;
   std::unique_ptr<grpc::Server> server_;
 
-  std::unique_ptr<Servable> servable_;
+  std::mutex servables_mutex_;
+  std::map<std::string, std::map<int, std::unique_ptr<Servable>>> servables_;
 };
 } // namespace Serving
 
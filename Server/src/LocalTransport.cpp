@@ -0,0 +1,631 @@
+//
+// Created by Aman LaChapelle on 1/30/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "LocalTransport.hpp"
+
+// STL
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// POSIX
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// Project
+#include "MappedFile.hpp"
+
+namespace {
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+// A slot holds a header, then the tensor at a fixed offset so clients can
+// write it in place, then the rest of the TensorMessage serialized. A reply
+// with an error status carries the error message instead.
+const size_t kHeaderBytes = 64;
+
+struct SlotHeader_ {
+  uint64_t floats;
+  uint64_t message_bytes;
+  int64_t deadline_ns; // since the epoch, 0 for none
+  int32_t status_code;
+};
+static_assert(sizeof(SlotHeader_) <= kHeaderBytes, "Slot header too large");
+
+// A channel hands over its region and, on Linux, its two doorbells
+const int kMaxChannelFds = 3;
+
+// Whether a tensor and a message fit in a slot. The sizes may come from the
+// other end of the channel, so nothing here is allowed to overflow.
+bool SlotFits_(const size_t &slot_bytes, const uint64_t &floats,
+               const uint64_t &message_bytes) {
+  if (slot_bytes < kHeaderBytes ||
+      floats > (slot_bytes - kHeaderBytes) / sizeof(float)) {
+    return false;
+  }
+  return message_bytes <= slot_bytes - kHeaderBytes - floats * sizeof(float);
+}
+
+float *SlotTensor_(char *slot) {
+  return reinterpret_cast<float *>(slot + kHeaderBytes);
+}
+
+bool WriteSlot_(char *slot, const size_t &slot_bytes, const size_t &floats,
+                const std::string &message, const int64_t &deadline_ns,
+                const int &status_code) {
+  if (!SlotFits_(slot_bytes, floats, message.size())) {
+    return false;
+  }
+
+  SlotHeader_ header;
+  std::memset(&header, 0, sizeof(header));
+  header.floats = floats;
+  header.message_bytes = message.size();
+  header.deadline_ns = deadline_ns;
+  header.status_code = status_code;
+
+  std::memcpy(slot, &header, sizeof(header));
+  std::memcpy(slot + kHeaderBytes + floats * sizeof(float), message.data(),
+              message.size());
+  return true;
+}
+
+bool ReadSlot_(char *slot, const size_t &slot_bytes, SlotHeader_ *header,
+               Serving::TensorMessage *message, std::string *error) {
+  std::memcpy(header, slot, sizeof(*header));
+  const uint64_t max_int = std::numeric_limits<int>::max();
+  if (!SlotFits_(slot_bytes, header->floats, header->message_bytes) ||
+      header->floats > max_int || header->message_bytes > max_int) {
+    return false;
+  }
+
+  const char *message_data =
+      slot + kHeaderBytes + header->floats * sizeof(float);
+  if (header->status_code != grpc::OK) {
+    error->assign(message_data, header->message_bytes);
+    return true;
+  }
+
+  if (!message->ParseFromArray(message_data, header->message_bytes)) {
+    return false;
+  }
+
+  if (header->floats > 0) {
+    message->mutable_buffer()->Resize(header->floats, 0.f);
+    std::memcpy(message->mutable_buffer()->mutable_data(), SlotTensor_(slot),
+                header->floats * sizeof(float));
+  }
+  return true;
+}
+
+bool SendAll_(const int &socket, const void *data, const size_t &bytes) {
+  const char *begin = static_cast<const char *>(data);
+  size_t sent = 0;
+  while (sent < bytes) {
+    ssize_t result = send(socket, begin + sent, bytes - sent, kSendFlags);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    sent += result;
+  }
+  return true;
+}
+
+bool ReceiveAll_(const int &socket, void *data, const size_t &bytes) {
+  char *begin = static_cast<char *>(data);
+  size_t received = 0;
+  while (received < bytes) {
+    ssize_t result = recv(socket, begin + received, bytes - received, 0);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    received += result;
+  }
+  return true;
+}
+
+bool SendFds_(const int &socket, const uint64_t &slot_bytes, const int *fds,
+              const int &count) {
+  char control[CMSG_SPACE(kMaxChannelFds * sizeof(int))];
+  std::memset(control, 0, sizeof(control));
+
+  iovec data;
+  data.iov_base = const_cast<uint64_t *>(&slot_bytes);
+  data.iov_len = sizeof(slot_bytes);
+
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  if (count > 0) {
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+    cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(count * sizeof(int));
+    std::memcpy(CMSG_DATA(rights), fds, count * sizeof(int));
+  }
+
+  return sendmsg(socket, &message, kSendFlags) ==
+         static_cast<ssize_t>(sizeof(slot_bytes));
+}
+
+int ReceiveFds_(const int &socket, uint64_t *slot_bytes, int *fds) {
+  char control[CMSG_SPACE(kMaxChannelFds * sizeof(int))];
+  std::memset(control, 0, sizeof(control));
+
+  iovec data;
+  data.iov_base = slot_bytes;
+  data.iov_len = sizeof(*slot_bytes);
+
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+
+  ssize_t received = -1;
+  do {
+    received = recvmsg(socket, &message, 0);
+  } while (received < 0 && errno == EINTR);
+
+  int count = 0;
+  for (cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != nullptr;
+       rights = CMSG_NXTHDR(&message, rights)) {
+    if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS) {
+      count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      std::memcpy(fds, CMSG_DATA(rights), count * sizeof(int));
+    }
+  }
+
+  if (received != static_cast<ssize_t>(sizeof(*slot_bytes))) {
+    for (int i = 0; i < count; i++) {
+      close(fds[i]);
+    }
+    return -1;
+  }
+  return count;
+}
+
+// Doorbells are eventfds, or the channel's socket itself where there are
+// none. Either way ringing writes 8 bytes and answering reads them.
+bool Ring_(const int &doorbell, const int &socket) {
+  uint64_t one = 1;
+  if (doorbell == socket) {
+    return SendAll_(socket, &one, sizeof(one));
+  }
+  return write(doorbell, &one, sizeof(one)) == sizeof(one);
+}
+
+// Waits for the doorbell, returns false if the other end goes away first
+bool Answer_(const int &doorbell, const int &socket) {
+  uint64_t value = 0;
+  if (doorbell == socket) {
+    return ReceiveAll_(socket, &value, sizeof(value));
+  }
+
+  pollfd fds[2];
+  fds[0].fd = doorbell;
+  fds[0].events = POLLIN;
+  fds[1].fd = socket;
+  fds[1].events = POLLIN;
+
+  while (true) {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    // Nothing is sent on the socket after the handshake, so any activity on
+    // it means the other end closed it
+    if (fds[1].revents != 0) {
+      return false;
+    }
+    if (fds[0].revents & POLLIN) {
+      return read(doorbell, &value, sizeof(value)) == sizeof(value);
+    }
+    if (fds[0].revents != 0) {
+      return false;
+    }
+  }
+}
+
+int64_t ToNanoseconds_(const std::chrono::system_clock::time_point &time) {
+  if (time == std::chrono::system_clock::time_point::max()) {
+    return 0;
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+std::chrono::system_clock::time_point FromNanoseconds_(const int64_t &ns) {
+  if (ns == 0) {
+    return std::chrono::system_clock::time_point::max();
+  }
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(ns)));
+}
+} // namespace
+
+namespace Serving {
+
+LocalChannel::~LocalChannel() { Close(); }
+
+bool LocalChannel::Open(const std::string &address,
+                        const std::string &client_id) {
+  Close();
+
+  sockaddr_un socket_address;
+  std::memset(&socket_address, 0, sizeof(socket_address));
+  socket_address.sun_family = AF_UNIX;
+  if (address.empty() || address.size() >= sizeof(socket_address.sun_path)) {
+    return false;
+  }
+  std::memcpy(socket_address.sun_path, address.data(), address.size());
+
+  socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socket_ < 0) {
+    return false;
+  }
+
+  if (connect(socket_, reinterpret_cast<sockaddr *>(&socket_address),
+              sizeof(socket_address)) != 0) {
+    Close();
+    return false;
+  }
+
+  const uint32_t id_length = client_id.size();
+  if (!SendAll_(socket_, &id_length, sizeof(id_length)) ||
+      !SendAll_(socket_, client_id.data(), id_length)) {
+    Close();
+    return false;
+  }
+
+  // A refused client gets a slot size of 0 and no descriptors
+  uint64_t slot_bytes = 0;
+  int fds[kMaxChannelFds];
+  int count = ReceiveFds_(socket_, &slot_bytes, fds);
+  if (count <= 0 || slot_bytes == 0) {
+    for (int i = 0; i < count; i++) {
+      close(fds[i]);
+    }
+    Close();
+    return false;
+  }
+
+  void *region = mmap(nullptr, 2 * slot_bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fds[0], 0);
+  close(fds[0]); // the mapping keeps the region alive
+  if (region == MAP_FAILED) {
+    for (int i = 1; i < count; i++) {
+      close(fds[i]);
+    }
+    Close();
+    return false;
+  }
+
+  region_ = static_cast<char *>(region);
+  slot_bytes_ = slot_bytes;
+  if (count == kMaxChannelFds) {
+    request_doorbell_ = fds[1];
+    reply_doorbell_ = fds[2];
+  } else {
+    request_doorbell_ = socket_;
+    reply_doorbell_ = socket_;
+  }
+
+  return true;
+}
+
+void LocalChannel::Close() {
+  if (region_ != nullptr) {
+    munmap(region_, 2 * slot_bytes_);
+    region_ = nullptr;
+    slot_bytes_ = 0;
+  }
+
+  if (request_doorbell_ >= 0 && request_doorbell_ != socket_) {
+    close(request_doorbell_);
+  }
+  if (reply_doorbell_ >= 0 && reply_doorbell_ != socket_) {
+    close(reply_doorbell_);
+  }
+  request_doorbell_ = -1;
+  reply_doorbell_ = -1;
+
+  if (socket_ >= 0) {
+    close(socket_);
+    socket_ = -1;
+  }
+}
+
+float *LocalChannel::InputBuffer(const size_t &floats) {
+  if (region_ == nullptr || !SlotFits_(slot_bytes_, floats, 0)) {
+    return nullptr;
+  }
+
+  return SlotTensor_(region_);
+}
+
+grpc::Status LocalChannel::ProcessInPlace(
+    const TensorMessage &request, const size_t &floats, TensorMessage *reply,
+    const std::chrono::system_clock::time_point &deadline) {
+  if (region_ == nullptr) {
+    grpc::Status early_exit_status(grpc::FAILED_PRECONDITION,
+                                   "Local channel not open");
+    return early_exit_status;
+  }
+
+  std::string message;
+  request.SerializeToString(&message);
+  if (!WriteSlot_(region_, slot_bytes_, floats, message,
+                  ToNanoseconds_(deadline), grpc::OK)) {
+    grpc::Status early_exit_status(
+        grpc::RESOURCE_EXHAUSTED,
+        "Request is larger than the local channel's slot");
+    return early_exit_status;
+  }
+
+  if (!Ring_(request_doorbell_, socket_) ||
+      !Answer_(reply_doorbell_, socket_)) {
+    Close();
+    grpc::Status early_exit_status(grpc::UNAVAILABLE,
+                                   "Local channel closed by the server");
+    return early_exit_status;
+  }
+
+  char *reply_slot = region_ + slot_bytes_;
+  SlotHeader_ header;
+  std::string error;
+  reply->Clear();
+  if (!ReadSlot_(reply_slot, slot_bytes_, &header, reply, &error)) {
+    grpc::Status early_exit_status(grpc::INTERNAL,
+                                   "Malformed reply on the local channel");
+    return early_exit_status;
+  }
+
+  return grpc::Status(static_cast<grpc::StatusCode>(header.status_code),
+                      error);
+}
+
+grpc::Status
+LocalChannel::Process(const TensorMessage &request, TensorMessage *reply,
+                      const std::chrono::system_clock::time_point &deadline) {
+  return ProcessInPlace(request, 0, reply, deadline);
+}
+
+LocalListener::LocalListener(Handler handler, Authorizer authorizer)
+    : handler_(std::move(handler)), authorizer_(std::move(authorizer)) {}
+
+LocalListener::~LocalListener() { Stop(); }
+
+bool LocalListener::Start(const std::string &path,
+                          const size_t &max_message_bytes) {
+  sockaddr_un socket_address;
+  std::memset(&socket_address, 0, sizeof(socket_address));
+  socket_address.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(socket_address.sun_path) ||
+      listen_socket_ >= 0) {
+    return false;
+  }
+  std::memcpy(socket_address.sun_path, path.data(), path.size());
+
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  slot_bytes_ = (kHeaderBytes + max_message_bytes + page_size - 1) /
+                page_size * page_size;
+
+  listen_socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_socket_ < 0) {
+    return false;
+  }
+
+  unlink(path.c_str());
+  if (bind(listen_socket_, reinterpret_cast<sockaddr *>(&socket_address),
+           sizeof(socket_address)) != 0 ||
+      listen(listen_socket_, SOMAXCONN) != 0) {
+    close(listen_socket_);
+    listen_socket_ = -1;
+    return false;
+  }
+
+  path_ = path;
+  {
+    std::lock_guard<std::mutex> guard(channels_mutex_);
+    stopping_ = false;
+  }
+  accept_thread_ = std::thread(&LocalListener::AcceptLoop_, this);
+  return true;
+}
+
+void LocalListener::Stop() {
+  if (listen_socket_ < 0) {
+    return;
+  }
+
+  // Wakes the accept loop
+  shutdown(listen_socket_, SHUT_RDWR);
+  close(listen_socket_);
+  listen_socket_ = -1;
+  accept_thread_.join();
+  unlink(path_.c_str());
+
+  std::unique_lock<std::mutex> lock(channels_mutex_);
+  stopping_ = true;
+  for (const int &socket : channel_sockets_) {
+    shutdown(socket, SHUT_RDWR);
+  }
+  channels_done_.wait(lock, [this]() { return channel_sockets_.empty(); });
+}
+
+void LocalListener::AcceptLoop_() {
+  while (true) {
+    int socket = accept(listen_socket_, nullptr, nullptr);
+    if (socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> guard(channels_mutex_);
+    if (stopping_) {
+      close(socket);
+      continue;
+    }
+    channel_sockets_.insert(socket);
+    std::thread(&LocalListener::ServeChannel_, this, socket).detach();
+  }
+}
+
+void LocalListener::ServeChannel_(const int &socket) {
+  int fds[kMaxChannelFds] = {-1, -1, -1};
+  int count = 0;
+  char *region = nullptr;
+
+  // The handshake, the client sends its id and gets its region and doorbells
+  uint32_t id_length = 0;
+  std::string client_id;
+  bool open = ReceiveAll_(socket, &id_length, sizeof(id_length)) &&
+              id_length <= 64;
+  if (open) {
+    client_id.resize(id_length);
+    open = ReceiveAll_(socket, &client_id[0], id_length) &&
+           authorizer_(client_id);
+  }
+
+  if (open) {
+    fds[0] = CreateSharedMemory("BatchingRPCLocal");
+    open = fds[0] >= 0 && ftruncate(fds[0], 2 * slot_bytes_) == 0;
+    count = 1;
+  }
+
+  if (open) {
+    void *mapped = mmap(nullptr, 2 * slot_bytes_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fds[0], 0);
+    open = mapped != MAP_FAILED;
+    region = open ? static_cast<char *>(mapped) : nullptr;
+  }
+
+#ifdef __linux__
+  if (open) {
+    fds[1] = eventfd(0, EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_CLOEXEC);
+    if (fds[1] >= 0 && fds[2] >= 0) {
+      count = kMaxChannelFds;
+    }
+  }
+#endif
+
+  open = SendFds_(socket, open ? slot_bytes_ : 0, fds, open ? count : 0) &&
+         open;
+  if (fds[0] >= 0) {
+    close(fds[0]); // the mapping keeps the region alive
+  }
+
+  const int request_doorbell = count == kMaxChannelFds ? fds[1] : socket;
+  const int reply_doorbell = count == kMaxChannelFds ? fds[2] : socket;
+  char *request_slot = region;
+  char *reply_slot = region + slot_bytes_;
+
+  while (open && Answer_(request_doorbell, socket)) {
+    SlotHeader_ header;
+    TensorMessage request;
+    TensorMessage reply;
+    std::string error;
+
+    grpc::Status status;
+    if (ReadSlot_(request_slot, slot_bytes_, &header, &request, &error)) {
+      status = handler_(request, FromNanoseconds_(header.deadline_ns), &reply);
+    } else {
+      status = grpc::Status(grpc::INVALID_ARGUMENT,
+                            "Malformed request on the local channel");
+    }
+
+    // The tensor goes straight into the slot, the rest is serialized after it
+    const size_t floats = reply.buffer_size();
+    if (status.ok() && SlotFits_(slot_bytes_, floats, 0)) {
+      std::memcpy(SlotTensor_(reply_slot), reply.buffer().data(),
+                  floats * sizeof(float));
+      reply.clear_buffer();
+
+      std::string message;
+      reply.SerializeToString(&message);
+      if (!WriteSlot_(reply_slot, slot_bytes_, floats, message, 0,
+                      grpc::OK)) {
+        status = grpc::Status(grpc::RESOURCE_EXHAUSTED,
+                              "Reply is larger than the local channel's slot");
+      }
+    } else if (status.ok()) {
+      status = grpc::Status(grpc::RESOURCE_EXHAUSTED,
+                            "Reply is larger than the local channel's slot");
+    }
+
+    if (!status.ok()) {
+      WriteSlot_(reply_slot, slot_bytes_, 0, status.error_message(), 0,
+                 status.error_code());
+    }
+
+    open = Ring_(reply_doorbell, socket);
+  }
+
+  if (region != nullptr) {
+    munmap(region, 2 * slot_bytes_);
+  }
+  for (int i = 1; i < kMaxChannelFds; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+
+  // Last thing touching the listener, Stop may return once it's done
+  std::lock_guard<std::mutex> guard(channels_mutex_);
+  close(socket);
+  channel_sockets_.erase(socket);
+  channels_done_.notify_all();
+}
+
+} // namespace Serving
@@ -0,0 +1,186 @@
+//
+// Created by Aman LaChapelle on 1/28/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "Prefork.hpp"
+
+// STL
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+
+// POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Project
+#include "MappedFile.hpp"
+
+namespace {
+volatile sig_atomic_t stop_signal_ = 0;
+
+void RecordSignal_(int signal) { stop_signal_ = signal; }
+
+pid_t StartWorker_(const int &worker,
+                   const std::function<int(const int &)> &worker_main) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+
+    int status = worker_main(worker);
+
+    // Skip the parent's exit handlers, they belong to the parent
+    std::cout.flush();
+    std::cerr.flush();
+    std::fflush(nullptr);
+    _exit(status);
+  }
+
+  return pid;
+}
+} // namespace
+
+namespace Serving {
+
+std::string ShareFile(const std::string &filename) {
+  MappedFile file;
+  if (!file.Open(filename)) {
+    return "";
+  }
+
+  int fd = CreateSharedMemory("BatchingRPC");
+  if (fd < 0) {
+    return "";
+  }
+
+  if (ftruncate(fd, file.Size()) != 0) {
+    close(fd);
+    return "";
+  }
+
+  void *shared =
+      mmap(nullptr, file.Size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shared == MAP_FAILED) {
+    close(fd);
+    return "";
+  }
+  std::memcpy(shared, file.Data(), file.Size());
+  munmap(shared, file.Size());
+
+#ifdef F_ADD_SEALS
+  // Nobody gets to change the weights from here on
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+#endif
+
+  // Deliberately left open, forked workers inherit it
+  return "/dev/fd/" + std::to_string(fd);
+}
+
+int Prefork(const int &workers,
+            const std::function<int(const int &worker)> &worker_main) {
+  // Workers that die sooner than this after starting aren't replaced, they'd
+  // only crash again
+  const std::chrono::seconds min_uptime(1);
+
+  // No SA_RESTART, a signal has to wake us out of waitpid
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = RecordSignal_;
+  sigemptyset(&action.sa_mask);
+
+  struct sigaction old_int_action;
+  struct sigaction old_term_action;
+  stop_signal_ = 0;
+  sigaction(SIGINT, &action, &old_int_action);
+  sigaction(SIGTERM, &action, &old_term_action);
+
+  int result = 0;
+
+  struct Worker_ {
+    int index;
+    std::chrono::steady_clock::time_point started;
+  };
+  std::map<pid_t, Worker_> worker_by_pid;
+
+  for (int i = 0; i < workers; i++) {
+    pid_t pid = StartWorker_(i, worker_main);
+    if (pid < 0) {
+      result = 1;
+      continue;
+    }
+    worker_by_pid[pid] = {i, std::chrono::steady_clock::now()};
+  }
+
+  bool forwarded = false;
+  while (!worker_by_pid.empty()) {
+    if (stop_signal_ != 0 && !forwarded) {
+      for (auto &worker : worker_by_pid) {
+        kill(worker.first, stop_signal_);
+      }
+      forwarded = true;
+    }
+
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    auto worker = worker_by_pid.find(pid);
+    if (worker == worker_by_pid.end()) {
+      continue;
+    }
+    Worker_ exited = worker->second;
+    worker_by_pid.erase(worker);
+
+    // Replace a worker that crashed while serving
+    if (WIFSIGNALED(status) && stop_signal_ == 0 &&
+        std::chrono::steady_clock::now() - exited.started >= min_uptime) {
+      pid_t replacement = StartWorker_(exited.index, worker_main);
+      if (replacement > 0) {
+        worker_by_pid[replacement] = {exited.index,
+                                      std::chrono::steady_clock::now()};
+        continue;
+      }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      result = 1;
+    }
+  }
+
+  sigaction(SIGINT, &old_int_action, nullptr);
+  sigaction(SIGTERM, &old_term_action, nullptr);
+
+  return result;
+}
+
+} // namespace Serving
@@ -0,0 +1,248 @@
+//
+// Created by Aman LaChapelle on 2/10/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#include "TBRouter.hpp"
+
+// STL
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+// POSIX
+#include <uuid/uuid.h>
+
+// Project
+#include "TBServer.hpp"
+
+using grpc::ClientContext;
+using grpc::ServerBuilder;
+using grpc::ServerContext;
+using grpc::Status;
+
+namespace {
+// Requests for dlib models may leave n at 0, they still count for one
+int RowsOf_(const Serving::TensorMessage &req) { return std::max(1, req.n()); }
+}
+
+namespace Serving {
+
+TBRouter::TBRouter(const std::vector<std::string> &backends,
+                   const TBRouterOptions &options)
+    : options_(options) {
+  grpc::ChannelArguments args;
+  if (options_.max_message_bytes != 0) {
+    args.SetMaxReceiveMessageSize(options_.max_message_bytes);
+    args.SetMaxSendMessageSize(options_.max_message_bytes);
+  }
+  if (options_.keepalive_time_ms > 0) {
+    args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, options_.keepalive_time_ms);
+    args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  }
+
+  for (const std::string &address : backends) {
+    std::unique_ptr<Backend_> backend(new Backend_);
+    backend->address = address;
+    backend->stub = BatchingServer::NewStub(grpc::CreateCustomChannel(
+        address, grpc::InsecureChannelCredentials(), args));
+    backends_.push_back(std::move(backend));
+  }
+}
+
+TBRouter::~TBRouter() { Stop(); }
+
+grpc::Status TBRouter::SetBatchSize(grpc::ServerContext *ctx,
+                                    const AdminRequest *req, AdminReply *rep) {
+  // Every backend serves the same models, so they all get the new size
+  for (std::unique_ptr<Backend_> &backend : backends_) {
+    std::unique_ptr<ClientContext> call =
+        ClientContext::FromServerContext(*ctx);
+    grpc::Status status = backend->stub->SetBatchSize(call.get(), *req, rep);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  return Status::OK;
+}
+
+Status TBRouter::Connect(ServerContext *ctx, const ConnectionRequest *req,
+                         ConnectionReply *rep) {
+
+  uuid_t uuid;
+  uuid_generate(uuid);
+  char uuid_str[37];
+  uuid_unparse_lower(uuid, uuid_str);
+  {
+    std::lock_guard<std::mutex> guard(users_mutex_);
+    users_.emplace(uuid_str);
+  }
+
+  rep->set_client_id(uuid_str);
+
+  return Status::OK;
+}
+
+grpc::Status TBRouter::Process(ServerContext *ctx, const TensorMessage *req,
+                               TensorMessage *rep) {
+  if (options_.require_connect && !KnownClient_(req->client_id())) {
+    grpc::Status early_exit_status(grpc::FAILED_PRECONDITION,
+                                   "Connect not called, client id unknown");
+    return early_exit_status;
+  }
+
+  const int rows = RowsOf_(*req);
+  std::vector<bool> tried(backends_.size(), false);
+  grpc::Status status(grpc::UNAVAILABLE, "No backends to route to");
+
+  for (int i = Pick_(tried); i >= 0; i = Pick_(tried)) {
+    tried[i] = true;
+    Backend_ &backend = *backends_[i];
+
+    // Carries the client's deadline, and cancels the call with the client's
+    std::unique_ptr<ClientContext> call =
+        ClientContext::FromServerContext(*ctx);
+
+    backend.outstanding_rows += rows;
+    status = backend.stub->Process(call.get(), *req, rep);
+    backend.outstanding_rows -= rows;
+
+    RecordLoad_(backend, *call);
+
+    // Anything else would fail the same way wherever it went
+    if (status.error_code() != grpc::UNAVAILABLE) {
+      break;
+    }
+  }
+
+  return status;
+}
+
+grpc::Status TBRouter::Health(ServerContext *ctx, const HealthRequest *req,
+                              HealthReply *rep) {
+  grpc::Status status(grpc::UNAVAILABLE, "No backends to route to");
+
+  for (std::unique_ptr<Backend_> &backend : backends_) {
+    std::unique_ptr<ClientContext> call =
+        ClientContext::FromServerContext(*ctx);
+    HealthReply backend_health;
+    grpc::Status backend_status =
+        backend->stub->Health(call.get(), *req, &backend_health);
+    if (!backend_status.ok()) {
+      if (!status.ok()) {
+        status = backend_status; // the reason, if nobody answers
+      }
+      continue;
+    }
+
+    status = Status::OK;
+    backend->reported_rows = backend_health.in_flight_rows();
+
+    rep->set_ready(rep->ready() || backend_health.ready());
+    rep->set_queued_rows(rep->queued_rows() + backend_health.queued_rows());
+    rep->set_batches_in_flight(rep->batches_in_flight() +
+                               backend_health.batches_in_flight());
+    rep->set_forward_us(
+        std::max(rep->forward_us(), backend_health.forward_us()));
+    rep->set_in_flight_rows(rep->in_flight_rows() +
+                            backend_health.in_flight_rows());
+  }
+
+  return status;
+}
+
+void TBRouter::StartInsecure(const std::string &server_address) {
+  ServerBuilder builder;
+  if (options_.max_message_bytes != 0) {
+    builder.SetMaxReceiveMessageSize(options_.max_message_bytes);
+    builder.SetMaxSendMessageSize(options_.max_message_bytes);
+  }
+  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  builder.RegisterService(this);
+  server_ = builder.BuildAndStart();
+
+  serve_thread_ = std::thread([&]() { server_->Wait(); });
+}
+
+void TBRouter::Stop() {
+  if (server_) {
+    server_->Shutdown(std::chrono::system_clock::now());
+    serve_thread_.join();
+    server_.reset();
+  }
+}
+
+std::vector<BackendLoad> TBRouter::Loads() {
+  std::vector<BackendLoad> loads;
+  for (std::unique_ptr<Backend_> &backend : backends_) {
+    BackendLoad load;
+    load.address = backend->address;
+    load.outstanding_rows = backend->outstanding_rows.load();
+    load.reported_rows = backend->reported_rows.load();
+    loads.push_back(load);
+  }
+  return loads;
+}
+
+int TBRouter::Pick_(const std::vector<bool> &tried) {
+  int best = -1;
+  int best_score = std::numeric_limits<int>::max();
+
+  for (int i = 0; i < static_cast<int>(backends_.size()); i++) {
+    if (tried[i]) {
+      continue;
+    }
+
+    int score = backends_[i]->outstanding_rows.load();
+    if (options_.policy == SHORTEST_QUEUE) {
+      // What it reported is stale by however long ago it replied, what we
+      // sent since is a floor on its queue
+      score = std::max(score, backends_[i]->reported_rows.load());
+    }
+
+    if (score < best_score) { // strictly less, ties go to the first
+      best = i;
+      best_score = score;
+    }
+  }
+
+  return best;
+}
+
+void TBRouter::RecordLoad_(Backend_ &backend, const ClientContext &call) {
+  const std::multimap<grpc::string_ref, grpc::string_ref> &trailers =
+      call.GetServerTrailingMetadata();
+
+  auto load = trailers.find(kLoadMetadataKey);
+  if (load == trailers.end()) {
+    return; // unreachable, or not a TBServer
+  }
+
+  backend.reported_rows =
+      std::atoi(std::string(load->second.data(), load->second.size()).c_str());
+}
+
+bool TBRouter::KnownClient_(const std::string &client_id) {
+  std::lock_guard<std::mutex> guard(users_mutex_);
+  return users_.find(client_id) != users_.end();
+}
+
+} // namespace Serving
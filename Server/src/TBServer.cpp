@@ -22,6 +22,18 @@
 
 #include "TBServer.hpp"
 
+// STL
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+// POSIX
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 using grpc::Server;
 using grpc::ServerAsyncResponseWriter;
 using grpc::ServerBuilder;
@@ -44,17 +56,88 @@ std::string ReadFile_(const std::string &filename) {
 
   return out;
 }
+
+// gRPC takes both unix:path and unix:///absolute/path
+std::string UnixSocketPath_(const std::string &address) {
+  std::string path = address.substr(5);
+  if (path.compare(0, 2, "//") == 0) {
+    path = path.substr(2);
+  }
+  return path;
+}
+
+// Removes a socket file if nobody is listening on it anymore. Returns false
+// if someone still is: gRPC would unlink their socket to bind its own.
+bool RemoveStaleSocket_(const std::string &path) {
+  struct stat path_stat;
+  if (stat(path.c_str(), &path_stat) != 0 || !S_ISSOCK(path_stat.st_mode)) {
+    return true;
+  }
+
+  sockaddr_un socket_address;
+  std::memset(&socket_address, 0, sizeof(socket_address));
+  socket_address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(socket_address.sun_path)) {
+    return true; // gRPC can't bind it either
+  }
+  std::memcpy(socket_address.sun_path, path.data(), path.size());
+
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0) {
+    return false;
+  }
+  bool stale = false;
+  if (connect(probe, reinterpret_cast<sockaddr *>(&socket_address),
+              sizeof(socket_address)) != 0 &&
+      errno == ECONNREFUSED) {
+    unlink(path.c_str());
+    stale = true;
+  }
+  close(probe);
+  return stale;
+}
+
+// Requests for dlib models may leave n at 0, they still count for one
+int RowsOf_(const Serving::TensorMessage &req) { return std::max(1, req.n()); }
 }
 
 namespace Serving {
 
-TBServer::TBServer(Servable *servable) : servable_(servable) { ; }
+TBServer::TBServer(const TBServerOptions &options) : options_(options) { ; }
+
+TBServer::TBServer(Servable *servable, const TBServerOptions &options)
+    : options_(options) {
+  AddServable("", 1, servable);
+}
 
 TBServer::~TBServer() { ; }
 
+bool TBServer::AddServable(const std::string &name, const int &version,
+                           Servable *servable) {
+  if (version <= 0) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> guard(servables_mutex_);
+
+  std::unique_ptr<Servable> &slot = servables_[name][version];
+  if (slot) {
+    return false;
+  }
+
+  slot.reset(servable);
+  return true;
+}
+
 grpc::Status TBServer::SetBatchSize(grpc::ServerContext *ctx,
                                     const AdminRequest *req, AdminReply *rep) {
-  ReturnCodes code = servable_->SetBatchSize(req->new_batch_size());
+  Servable *servable = FindServable_(req->model_name(), req->model_version());
+  if (servable == nullptr) {
+    grpc::Status early_exit_status(grpc::NOT_FOUND, "No such model/version");
+    return early_exit_status;
+  }
+
+  ReturnCodes code = servable->SetBatchSize(req->new_batch_size());
 
   switch (code) {
   case OK:
@@ -82,25 +165,134 @@ Status TBServer::Connect(ServerContext *ctx, const ConnectionRequest *req,
   uuid_generate(uuid);
   char uuid_str[37];
   uuid_unparse_lower(uuid, uuid_str);
-  users_.emplace(uuid_str);
+  {
+    std::lock_guard<std::mutex> guard(users_mutex_);
+    users_.emplace(uuid_str);
+  }
 
   rep->set_client_id(uuid_str);
+  rep->set_local_address(local_address_);
 
   return Status::OK;
 }
 
 grpc::Status TBServer::Process(ServerContext *ctx, const TensorMessage *req,
                                TensorMessage *rep) {
+  // The servable schedules by the deadline the client gave us
+  RequestInfo info;
+  info.deadline = ctx->deadline();
 
-  auto user = users_.find(req->client_id());
-  if (user == users_.end()) {
-    grpc::Status early_exit_status(grpc::FAILED_PRECONDITION,
-                                   "Connect not called, client id unknown");
+  grpc::Status status = Process_(*req, info, rep);
+
+  // Lets a TBRouter in front of us balance on how busy we are
+  ctx->AddTrailingMetadata(kLoadMetadataKey,
+                           std::to_string(in_flight_rows_.load()));
+
+  return status;
+}
+
+grpc::Status TBServer::Health(ServerContext *ctx, const HealthRequest *req,
+                              HealthReply *rep) {
+  Servable *servable = FindServable_(req->model_name(), req->model_version());
+  if (servable == nullptr) {
+    grpc::Status early_exit_status(grpc::NOT_FOUND, "No such model/version");
     return early_exit_status;
   }
 
-  // TODO: make sure that this is all going to the same instance
-  ReturnCodes code = servable_->AddToBatch(*req); // Add to batch and move on
+  LoadStats load = servable->GetLoad();
+  rep->set_ready(servable->IsReady());
+  rep->set_queued_rows(load.queued_rows);
+  rep->set_batches_in_flight(load.batches_in_flight);
+  rep->set_forward_us(static_cast<float>(load.forward_us));
+  rep->set_in_flight_rows(in_flight_rows_.load());
+
+  return Status::OK;
+}
+
+bool TBServer::StartLocal(const std::string &socket_path,
+                          const size_t &max_message_bytes) {
+  if (local_listener_) {
+    return false;
+  }
+
+  local_listener_.reset(new LocalListener(
+      [this](const TensorMessage &req,
+             const std::chrono::system_clock::time_point &deadline,
+             TensorMessage *rep) {
+        RequestInfo info;
+        info.deadline = deadline;
+        return Process_(req, info, rep);
+      },
+      [this](const std::string &client_id) {
+        return !options_.require_connect || KnownClient_(client_id);
+      }));
+
+  if (!local_listener_->Start(socket_path, max_message_bytes)) {
+    local_listener_.reset();
+    return false;
+  }
+
+  local_address_ = socket_path;
+  return true;
+}
+
+grpc::Status TBServer::Process_(const TensorMessage &req,
+                                const RequestInfo &info, TensorMessage *rep) {
+  {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    if (draining_) {
+      drain_stats_.rejected++;
+      grpc::Status early_exit_status(
+          grpc::UNAVAILABLE, "Server is shutting down, retry elsewhere");
+      return early_exit_status;
+    }
+    in_flight_++;
+  }
+
+  in_flight_rows_ += RowsOf_(req);
+  grpc::Status status = Dispatch_(req, info, rep);
+  in_flight_rows_ -= RowsOf_(req);
+
+  {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    in_flight_--;
+    if (draining_) {
+      (status.ok() ? drain_stats_.completed : drain_stats_.failed)++;
+      drain_cv_.notify_all();
+    }
+  }
+
+  return status;
+}
+
+bool TBServer::KnownClient_(const std::string &client_id) {
+  std::lock_guard<std::mutex> guard(users_mutex_);
+  return users_.find(client_id) != users_.end();
+}
+
+grpc::Status TBServer::Dispatch_(const TensorMessage &req,
+                                 const RequestInfo &info, TensorMessage *rep) {
+  RequestInfo call_info = info;
+
+  if (options_.require_connect) {
+    if (!KnownClient_(req.client_id())) {
+      grpc::Status early_exit_status(grpc::FAILED_PRECONDITION,
+                                     "Connect not called, client id unknown");
+      return early_exit_status;
+    }
+  } else {
+    // Every call gets its own result, however many share a client_id
+    call_info.result_key = "call-" + std::to_string(next_call_++);
+  }
+
+  Servable *servable = FindServable_(req.model_name(), req.model_version());
+  if (servable == nullptr) {
+    grpc::Status early_exit_status(grpc::NOT_FOUND, "No such model/version");
+    return early_exit_status;
+  }
+
+  ReturnCodes code =
+      servable->AddToBatch(req, call_info); // Add to batch and move on
 
   switch (code) {
   case OK:
@@ -130,7 +322,9 @@ grpc::Status TBServer::Process(ServerContext *ctx, const TensorMessage *req,
     break; // this one won't be thrown by the function
   }
 
-  code = servable_->GetResult(req->client_id(), rep);
+  code = servable->GetResult(
+      call_info.result_key.empty() ? req.client_id() : call_info.result_key,
+      rep);
 
   switch (code) {
   case OK:
@@ -140,6 +334,22 @@ grpc::Status TBServer::Process(ServerContext *ctx, const TensorMessage *req,
         grpc::UNAVAILABLE, "Try again later, processing hasn't yet started!");
     return early_exit_status;
   }
+  case SHAPE_INCORRECT: { // found by a servable that adds in the background
+    grpc::Status early_exit_status(grpc::INVALID_ARGUMENT,
+                                   "Input tensor shape incorrect");
+    return early_exit_status;
+  }
+  case BATCH_TOO_LARGE: { // as above, and a TBClient splits it the same way
+    grpc::Status early_exit_status(
+        grpc::INVALID_ARGUMENT,
+        "Batch request was too large, split into smaller pieces and retry");
+    return early_exit_status;
+  }
+  case NEED_BIND_CALL: {
+    grpc::Status early_exit_status(grpc::FAILED_PRECONDITION,
+                                   "Bind not called on servable");
+    return early_exit_status;
+  }
   default: {
     grpc::Status early_exit_status(grpc::CANCELLED,
                                    "An error ocurred, try again later");
@@ -147,26 +357,114 @@ grpc::Status TBServer::Process(ServerContext *ctx, const TensorMessage *req,
   }
   }
 
+  rep->set_client_id(req.client_id());
+
   return grpc::Status::OK;
 }
 
-void TBServer::StartInsecure(const std::string &server_address) {
-  ServerBuilder builder;
-  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(this);
-  server_ = builder.BuildAndStart();
+Servable *TBServer::FindServable_(const std::string &name,
+                                  const int &version) {
+  std::lock_guard<std::mutex> guard(servables_mutex_);
 
-  serve_thread_ = std::thread([&]() { server_->Wait(); });
+  auto model = servables_.find(name);
+  if (model == servables_.end() || model->second.empty()) {
+    return nullptr;
+  }
+
+  if (version == 0) { // latest
+    return model->second.rbegin()->second.get();
+  }
+
+  auto servable = model->second.find(version);
+  if (servable == model->second.end()) {
+    return nullptr;
+  }
+
+  return servable->second.get();
+}
+
+bool TBServer::StartInsecure(const std::string &server_address) {
+  return StartInsecure(std::vector<std::string>{server_address});
+}
+
+bool TBServer::StartInsecure(
+    const std::vector<std::string> &server_addresses) {
+  return Start_(server_addresses, grpc::InsecureServerCredentials());
+}
+
+DrainStats TBServer::Stop(const std::chrono::milliseconds &drain_timeout) {
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> guard(drain_mutex_);
+    draining_ = true;
+    drain_stats_ = DrainStats();
+    drain_stats_.in_flight = in_flight_;
+  }
+
+  // Nothing is coming to fill the partial batches anymore
+  {
+    std::lock_guard<std::mutex> guard(servables_mutex_);
+    for (auto &model : servables_) {
+      for (auto &version : model.second) {
+        version.second->Drain();
+      }
+    }
+  }
+
+  DrainStats stats;
+  {
+    std::unique_lock<std::mutex> lock(drain_mutex_);
+    drain_cv_.wait_for(lock, drain_timeout,
+                       [this]() { return in_flight_ == 0; });
+    drain_stats_.abandoned = in_flight_;
+    drain_stats_.duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+    stats = drain_stats_;
+  }
+
+  if (server_) {
+    // Anything left is cancelled straight away
+    server_->Shutdown(std::chrono::system_clock::now());
+    serve_thread_.join();
+    server_.reset();
+  }
+
+  // Only the files this server bound, and only once nobody listens on them
+  for (const UnixSocket_ &unix_socket : unix_sockets_) {
+    struct stat path_stat;
+    if (stat(unix_socket.path.c_str(), &path_stat) == 0 &&
+        path_stat.st_dev == unix_socket.device &&
+        path_stat.st_ino == unix_socket.inode) {
+      RemoveStaleSocket_(unix_socket.path);
+    }
+  }
+  unix_sockets_.clear();
+
+  if (local_listener_) {
+    local_listener_->Stop();
+    local_listener_.reset();
+    local_address_.clear();
+  }
+
+  std::clog << "TBServer drained " << stats.completed + stats.failed << " of "
+            << stats.in_flight << " requests in flight ("
+            << stats.failed << " failed, " << stats.rejected
+            << " turned away, " << stats.abandoned << " abandoned) in "
+            << stats.duration.count() << " ms" << std::endl;
+
+  return stats;
 }
 
-void TBServer::Stop() {
-  server_->Shutdown();
-  serve_thread_.join();
+bool TBServer::StartSSL(const std::string &server_address,
+                        const std::string &key, const std::string &cert) {
+  return StartSSL(std::vector<std::string>{server_address}, key, cert);
 }
 
-void TBServer::StartSSL(const std::string &server_address,
+bool TBServer::StartSSL(const std::vector<std::string> &server_addresses,
                         const std::string &key, const std::string &cert) {
-  ServerBuilder builder;
 
   bool key_dashes = true;
   bool cert_dashes = true;
@@ -191,11 +489,108 @@ void TBServer::StartSSL(const std::string &server_address,
 
   std::shared_ptr<grpc::ServerCredentials> channel_creds =
       grpc::SslServerCredentials(ssl_opts);
-  builder.AddListeningPort(server_address, channel_creds);
+  return Start_(server_addresses, channel_creds);
+}
+
+bool TBServer::Start_(
+    const std::vector<std::string> &server_addresses,
+    const std::shared_ptr<grpc::ServerCredentials> &credentials) {
+  ServerBuilder builder;
+  // Lets preforked workers listen on the same address
+  builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 1);
+
+  // Zeros leave gRPC's defaults alone
+  if (options_.num_cqs > 0) {
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS,
+                                options_.num_cqs);
+  }
+  if (options_.min_pollers > 0) {
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MIN_POLLERS,
+                                options_.min_pollers);
+  }
+  if (options_.max_pollers > 0) {
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MAX_POLLERS,
+                                options_.max_pollers);
+  }
+  if (options_.max_receive_message_bytes != 0) {
+    builder.SetMaxReceiveMessageSize(options_.max_receive_message_bytes);
+  }
+  if (options_.max_send_message_bytes != 0) {
+    builder.SetMaxSendMessageSize(options_.max_send_message_bytes);
+  }
+  if (options_.max_concurrent_streams > 0) {
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS,
+                               options_.max_concurrent_streams);
+  }
+  if (options_.stream_window_bytes > 0) {
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                               options_.stream_window_bytes);
+  }
+  if (!options_.bdp_probe) {
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 0);
+  }
+  if (options_.write_buffer_bytes > 0) {
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_WRITE_BUFFER_SIZE,
+                               options_.write_buffer_bytes);
+  }
+  if (options_.keepalive_time_ms > 0) {
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS,
+                               options_.keepalive_time_ms);
+  }
+  if (options_.keepalive_timeout_ms > 0) {
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                               options_.keepalive_timeout_ms);
+  }
+  if (options_.keepalive_permit_without_calls) {
+    builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+  }
+  if (options_.min_client_ping_interval_ms > 0) {
+    builder.AddChannelArgument(
+        GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+        options_.min_client_ping_interval_ms);
+  }
+
+  // gRPC sets each port once the server is built, 0 if it couldn't bind
+  std::vector<int> ports(server_addresses.size(), 0);
+  for (size_t i = 0; i < server_addresses.size(); i++) {
+    if (server_addresses[i].compare(0, 5, "unix:") == 0 &&
+        !RemoveStaleSocket_(UnixSocketPath_(server_addresses[i]))) {
+      std::clog << "TBServer not started, " << server_addresses[i]
+                << " is still being served" << std::endl;
+      return false;
+    }
+    builder.AddListeningPort(server_addresses[i], credentials, &ports[i]);
+  }
   builder.RegisterService(this);
   server_ = builder.BuildAndStart();
 
+  bool listening = server_ != nullptr;
+  for (size_t i = 0; i < server_addresses.size() && listening; i++) {
+    listening = ports[i] != 0;
+  }
+  if (!listening) {
+    if (server_) {
+      server_->Shutdown(std::chrono::system_clock::now());
+      server_.reset();
+    }
+    std::clog << "TBServer couldn't listen on every address, not started"
+              << std::endl;
+    return false;
+  }
+
+  // Now that they're ours, Stop may remove them
+  for (const std::string &address : server_addresses) {
+    struct stat path_stat;
+    if (address.compare(0, 5, "unix:") == 0 &&
+        stat(UnixSocketPath_(address).c_str(), &path_stat) == 0) {
+      unix_sockets_.push_back({UnixSocketPath_(address),
+                               static_cast<uint64_t>(path_stat.st_dev),
+                               static_cast<uint64_t>(path_stat.st_ino)});
+    }
+  }
+
   serve_thread_ = std::thread([&]() { server_->Wait(); });
+  return true;
 }
 
 } // namespace Serving
@@ -20,12 +20,27 @@
     limitations under the License.
  */
 
+#include "LocalTransport.hpp"
+#include "MappedFile.hpp"
+#include "Prefork.hpp"
 #include "Servable.hpp"
+#include "TBRouter.hpp"
 #include "TBServer.hpp"
 
 #include <grpc++/grpc++.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "gtest/gtest.h"
 
@@ -56,6 +71,136 @@ private:
   TensorMessage msg;
 };
 
+class NamedServable : public EchoServable {
+public:
+  explicit NamedServable(const std::string &name) : name_(name) {}
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    EchoServable::GetResult(client_id, message);
+    message->set_model_name(name_);
+    return OK;
+  }
+
+private:
+  std::string name_;
+};
+
+// Holds every request back until it's drained, like a partial batch would be
+class HoldingServable : public EchoServable {
+public:
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    EchoServable::AddToBatch(message);
+    received_++;
+    cv_.notify_all();
+    return OK;
+  }
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return drained_; });
+    return EchoServable::GetResult(client_id, message);
+  }
+
+  void Drain() override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    drained_ = true;
+    cv_.notify_all();
+  }
+
+  void WaitForRequests(const int &count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [&, this]() { return received_ >= count; });
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int received_ = 0;
+  bool drained_ = false;
+};
+
+// Takes every request, and fails it with code once it's asked for the result,
+// like a servable that adds to its batch in the background
+class DeferredErrorServable : public EchoServable {
+public:
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    return code;
+  }
+
+  std::atomic<ReturnCodes> code{OK};
+};
+
+// Opens a local channel by hand and sends a request whose header claims
+// floats and message_bytes, whatever the slot holds. Returns the status code
+// of the reply, or -1 if the channel couldn't be opened.
+int SendLocalHeader(const std::string &address, const std::string &client_id,
+                    const uint64_t &floats, const uint64_t &message_bytes) {
+  sockaddr_un socket_address;
+  std::memset(&socket_address, 0, sizeof(socket_address));
+  socket_address.sun_family = AF_UNIX;
+  std::strncpy(socket_address.sun_path, address.c_str(),
+               sizeof(socket_address.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (connect(sock, reinterpret_cast<sockaddr *>(&socket_address),
+              sizeof(socket_address)) != 0) {
+    close(sock);
+    return -1;
+  }
+
+  const uint32_t id_length = client_id.size();
+  send(sock, &id_length, sizeof(id_length), 0);
+  send(sock, client_id.data(), id_length, 0);
+
+  uint64_t slot_bytes = 0;
+  iovec data{&slot_bytes, sizeof(slot_bytes)};
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &data;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &message, 0) != sizeof(slot_bytes) || slot_bytes == 0) {
+    close(sock);
+    return -1;
+  }
+
+  int fds[3] = {-1, -1, -1};
+  cmsghdr *rights = CMSG_FIRSTHDR(&message);
+  const int count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  std::memcpy(fds, CMSG_DATA(rights), count * sizeof(int));
+  const int request_doorbell = count == 3 ? fds[1] : sock;
+  const int reply_doorbell = count == 3 ? fds[2] : sock;
+
+  char *region = static_cast<char *>(mmap(nullptr, 2 * slot_bytes,
+                                          PROT_READ | PROT_WRITE, MAP_SHARED,
+                                          fds[0], 0));
+
+  // The slot header: floats, message bytes, deadline and status code
+  std::memset(region, 0, 64);
+  std::memcpy(region, &floats, sizeof(floats));
+  std::memcpy(region + 8, &message_bytes, sizeof(message_bytes));
+
+  uint64_t one = 1;
+  int32_t status_code = -1;
+  if (write(request_doorbell, &one, sizeof(one)) == sizeof(one) &&
+      read(reply_doorbell, &one, sizeof(one)) == sizeof(one)) {
+    std::memcpy(&status_code, region + slot_bytes + 24, sizeof(status_code));
+  }
+
+  munmap(region, 2 * slot_bytes);
+  for (int i = 0; i < count; i++) {
+    close(fds[i]);
+  }
+  close(sock);
+  return status_code;
+}
+
 class TestTBServer : public ::testing::Test {
 protected:
   void SetUp() override {
@@ -245,5 +390,507 @@ TEST_F(TestTBServer, MultipleProcess) {
     EXPECT_EQ(tensor_reply.buffer(i), (float)i);
   }
 }
+
+TEST_F(TestTBServer, MultiModel) {
+  EXPECT_TRUE(srv->AddServable("model", 1, new NamedServable("model-v1")));
+  EXPECT_TRUE(srv->AddServable("model", 2, new NamedServable("model-v2")));
+
+  NamedServable duplicate("duplicate");
+  EXPECT_FALSE(srv->AddServable("model", 2, &duplicate));
+
+  std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
+      "localhost:50051", grpc::SslCredentials(client_creds));
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(channel);
+
+  ConnectionReply rep;
+  grpc::Status status;
+
+  {
+    grpc::ClientContext context;
+    status = stub->Connect(&context, ConnectionRequest(), &rep);
+    EXPECT_TRUE(status.ok());
+  }
+
+  msg.set_client_id(rep.client_id());
+  msg.set_model_name("model");
+
+  TensorMessage tensor_reply;
+
+  {
+    grpc::ClientContext context;
+    msg.set_model_version(1);
+    status = stub->Process(&context, msg, &tensor_reply);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(tensor_reply.model_name(), "model-v1");
+  }
+
+  {
+    grpc::ClientContext context;
+    msg.set_model_version(0); // latest
+    status = stub->Process(&context, msg, &tensor_reply);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(tensor_reply.model_name(), "model-v2");
+  }
+
+  {
+    grpc::ClientContext context;
+    msg.set_model_name("missing");
+    status = stub->Process(&context, msg, &tensor_reply);
+    EXPECT_FALSE(status.ok());
+    EXPECT_TRUE(status.error_code() == grpc::NOT_FOUND);
+  }
+
+  {
+    grpc::ClientContext context;
+    AdminRequest req;
+    req.set_new_batch_size(5);
+    req.set_model_name("model");
+    req.set_model_version(3);
+    AdminReply admin_rep;
+    status = stub->SetBatchSize(&context, req, &admin_rep);
+    EXPECT_TRUE(status.error_code() == grpc::NOT_FOUND);
+  }
+}
+
+TEST_F(TestTBServer, Local) {
+  ASSERT_TRUE(srv->StartLocal("tbserver-local.sock"));
+
+  std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
+      "localhost:50051", grpc::SslCredentials(client_creds));
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(channel);
+
+  ConnectionReply rep;
+  {
+    grpc::ClientContext context;
+    grpc::Status status = stub->Connect(&context, ConnectionRequest(), &rep);
+    EXPECT_TRUE(status.ok());
+    EXPECT_EQ(rep.local_address(), "tbserver-local.sock");
+  }
+
+  LocalChannel refused;
+  EXPECT_FALSE(refused.Open(rep.local_address(), "not-a-client"));
+
+  LocalChannel local;
+  ASSERT_TRUE(local.Open(rep.local_address(), rep.client_id()));
+
+  msg.set_client_id(rep.client_id());
+  TensorMessage tensor_reply;
+  grpc::Status status = local.Process(msg, &tensor_reply);
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(tensor_reply.n(), lim);
+  ASSERT_EQ(tensor_reply.buffer_size(), lim);
+  for (int i = 0; i < lim; i++) {
+    EXPECT_EQ(tensor_reply.buffer(i), (float)i);
+  }
+
+  // Write the tensor straight into shared memory
+  TensorMessage header;
+  header.set_client_id(rep.client_id());
+  header.set_n(lim);
+  float *input = local.InputBuffer(lim);
+  ASSERT_NE(input, nullptr);
+  for (int i = 0; i < lim; i++) {
+    input[i] = 2.f * i;
+  }
+  status = local.ProcessInPlace(header, lim, &tensor_reply);
+  EXPECT_TRUE(status.ok());
+  ASSERT_EQ(tensor_reply.buffer_size(), lim);
+  EXPECT_EQ(tensor_reply.buffer(lim - 1), 2.f * (lim - 1));
+
+  // Errors come back as the same status the RPC would return
+  header.set_model_name("missing");
+  status = local.ProcessInPlace(header, lim, &tensor_reply);
+  EXPECT_TRUE(status.error_code() == grpc::NOT_FOUND);
+
+  EXPECT_EQ(local.InputBuffer(size_t(1) << 40), nullptr);
+  EXPECT_EQ(local.InputBuffer(size_t(1) << 62), nullptr); // 4x wraps to 0
+
+  // Sizes that only fit the slot once their sum wraps around are turned
+  // away, and the server carries on
+  EXPECT_EQ(SendLocalHeader(rep.local_address(), rep.client_id(),
+                            uint64_t(1) << 62, 0),
+            grpc::INVALID_ARGUMENT);
+  EXPECT_EQ(SendLocalHeader(rep.local_address(), rep.client_id(), 0,
+                            ~uint64_t(0) - 63),
+            grpc::INVALID_ARGUMENT);
+  EXPECT_EQ(SendLocalHeader(rep.local_address(), rep.client_id(), 1,
+                            ~uint64_t(0) - 3),
+            grpc::INVALID_ARGUMENT);
+
+  header.set_model_name("");
+  status = local.ProcessInPlace(header, lim, &tensor_reply);
+  EXPECT_TRUE(status.ok());
+}
+
+TEST_F(TestTBServer, Health) {
+  std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
+      "localhost:50051", grpc::SslCredentials(client_creds));
+  std::unique_ptr<BatchingServer::Stub> stub =
+      BatchingServer::NewStub(channel);
+
+  // No Connect needed
+  {
+    HealthReply rep;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Health(&context, HealthRequest(), &rep).ok());
+    EXPECT_TRUE(rep.ready());
+    EXPECT_EQ(rep.queued_rows(), 0);
+    EXPECT_EQ(rep.batches_in_flight(), 0);
+    EXPECT_EQ(rep.in_flight_rows(), 0);
+  }
+
+  HealthRequest req;
+  req.set_model_name("missing");
+  HealthReply rep;
+  grpc::ClientContext context;
+  EXPECT_EQ(stub->Health(&context, req, &rep).error_code(), grpc::NOT_FOUND);
+}
+
+TEST(UnixSocket, AlongsideTCP) {
+  // Left behind by a server that's gone, it's replaced
+  {
+    int stale = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, "tbserver-test.sock");
+    bind(stale, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    close(stale);
+  }
+
+  TBServer srv(new EchoServable());
+  const std::vector<std::string> addresses{"localhost:50052",
+                                           "unix:tbserver-test.sock"};
+  ASSERT_TRUE(srv.StartInsecure(addresses));
+
+  // Another server can't take the socket over, and stopping it leaves the
+  // socket to the server that's still listening on it
+  {
+    TBServer other(new EchoServable());
+    EXPECT_FALSE(other.StartInsecure("unix:tbserver-test.sock"));
+    other.Stop();
+    EXPECT_EQ(access("tbserver-test.sock", F_OK), 0);
+  }
+
+  for (const std::string &address : addresses) {
+    std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+        grpc::CreateChannel(address, grpc::InsecureChannelCredentials()));
+
+    ConnectionReply rep;
+    {
+      grpc::ClientContext context;
+      EXPECT_TRUE(stub->Connect(&context, ConnectionRequest(), &rep).ok());
+    }
+
+    TensorMessage msg;
+    msg.add_buffer(1.f);
+    msg.set_n(1);
+    msg.set_client_id(rep.client_id());
+
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Process(&context, msg, &tensor_reply).ok()) << address;
+    EXPECT_EQ(tensor_reply.n(), 1);
+  }
+
+  srv.Stop();
+  EXPECT_NE(access("tbserver-test.sock", F_OK), 0);
+}
+
+TEST(Options, MessageSize) {
+  TBServerOptions options;
+  options.max_receive_message_bytes = 1024;
+  options.keepalive_time_ms = 10000;
+  options.stream_window_bytes = 1 << 20;
+  TBServer srv(new EchoServable(), options);
+  srv.StartInsecure("localhost:50054");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50054",
+                          grpc::InsecureChannelCredentials()));
+
+  ConnectionReply rep;
+  {
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Connect(&context, ConnectionRequest(), &rep).ok());
+  }
+
+  TensorMessage msg;
+  msg.set_client_id(rep.client_id());
+  msg.mutable_buffer()->Resize(16, 1.f);
+  msg.set_n(1);
+
+  TensorMessage tensor_reply;
+  {
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Process(&context, msg, &tensor_reply).ok());
+  }
+
+  // Over the server's limit
+  msg.mutable_buffer()->Resize(1024, 1.f);
+  {
+    grpc::ClientContext context;
+    grpc::Status status = stub->Process(&context, msg, &tensor_reply);
+    EXPECT_TRUE(status.error_code() == grpc::RESOURCE_EXHAUSTED);
+  }
+
+  srv.Stop();
+}
+
+TEST(Options, Connectionless) {
+  TBServerOptions options;
+  options.require_connect = false;
+  TBServer srv(new NamedServable("stateless"), options);
+  srv.StartInsecure("localhost:50055");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50055",
+                          grpc::InsecureChannelCredentials()));
+
+  // No Connect, and two calls may share a client_id
+  for (const char *client_id : {"", "anyone", "anyone"}) {
+    TensorMessage msg;
+    msg.add_buffer(1.f);
+    msg.set_n(1);
+    msg.set_client_id(client_id);
+
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Process(&context, msg, &tensor_reply).ok());
+    EXPECT_EQ(tensor_reply.model_name(), "stateless");
+    EXPECT_EQ(tensor_reply.client_id(), client_id);
+  }
+
+  srv.Stop();
+}
+
+TEST(Options, DeferredErrors) {
+  TBServerOptions options;
+  options.require_connect = false;
+  DeferredErrorServable *servable = new DeferredErrorServable();
+  TBServer srv(servable, options);
+  srv.StartInsecure("localhost:50062");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50062",
+                          grpc::InsecureChannelCredentials()));
+
+  TensorMessage msg;
+  msg.add_buffer(1.f);
+  msg.set_n(1);
+
+  // The same status as if AddToBatch had returned the code
+  const std::vector<std::pair<ReturnCodes, grpc::StatusCode>> codes{
+      {SHAPE_INCORRECT, grpc::INVALID_ARGUMENT},
+      {BATCH_TOO_LARGE, grpc::INVALID_ARGUMENT},
+      {NEED_BIND_CALL, grpc::FAILED_PRECONDITION},
+  };
+  for (const auto &code : codes) {
+    servable->code = code.first;
+
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    grpc::Status status = stub->Process(&context, msg, &tensor_reply);
+    EXPECT_EQ(status.error_code(), code.second);
+    if (code.first == BATCH_TOO_LARGE) {
+      EXPECT_EQ(status.error_message().find("Batch request was too large"),
+                0u);
+    }
+  }
+
+  srv.Stop();
+}
+
+TEST(Drain, Stop) {
+  HoldingServable *servable = new HoldingServable();
+  TBServer srv(servable);
+  srv.StartInsecure("localhost:50053");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50053",
+                          grpc::InsecureChannelCredentials()));
+
+  ConnectionReply rep;
+  {
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Connect(&context, ConnectionRequest(), &rep).ok());
+  }
+
+  grpc::Status status;
+  TensorMessage tensor_reply;
+  std::thread client([&]() {
+    TensorMessage msg;
+    msg.add_buffer(1.f);
+    msg.set_n(1);
+    msg.set_client_id(rep.client_id());
+
+    grpc::ClientContext context;
+    status = stub->Process(&context, msg, &tensor_reply);
+  });
+
+  // The request is stuck in the servable until Stop drains it
+  servable->WaitForRequests(1);
+  DrainStats stats = srv.Stop(std::chrono::seconds(5));
+  client.join();
+
+  EXPECT_TRUE(status.ok());
+  EXPECT_EQ(tensor_reply.n(), 1);
+  EXPECT_EQ(stats.in_flight, 1);
+  EXPECT_EQ(stats.completed, 1);
+  EXPECT_EQ(stats.failed, 0);
+  EXPECT_EQ(stats.abandoned, 0);
+}
+
+TEST(Router, LeastOutstandingRows) {
+  TBServerOptions backend_options;
+  backend_options.require_connect = false;
+
+  HoldingServable *held = new HoldingServable();
+  TBServer busy(held, backend_options);
+  busy.StartInsecure("localhost:50056");
+  TBServer idle(new NamedServable("idle"), backend_options);
+  idle.StartInsecure("localhost:50057");
+
+  TBRouterOptions options;
+  options.require_connect = false;
+  TBRouter router({"localhost:50056", "localhost:50057"}, options);
+  router.StartInsecure("localhost:50058");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50058",
+                          grpc::InsecureChannelCredentials()));
+
+  TensorMessage msg;
+  msg.mutable_buffer()->Resize(4, 1.f);
+  msg.set_n(4);
+
+  // Nothing outstanding anywhere, so the first backend gets it and holds it
+  grpc::Status held_status;
+  std::thread client([&]() {
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    held_status = stub->Process(&context, msg, &tensor_reply);
+  });
+  held->WaitForRequests(1);
+
+  std::vector<BackendLoad> loads = router.Loads();
+  ASSERT_EQ(loads.size(), 2u);
+  EXPECT_EQ(loads[0].outstanding_rows, 4);
+  EXPECT_EQ(loads[1].outstanding_rows, 0);
+
+  // So the next one goes where nothing is waiting
+  {
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Process(&context, msg, &tensor_reply).ok());
+    EXPECT_EQ(tensor_reply.model_name(), "idle");
+  }
+
+  busy.Stop(std::chrono::seconds(5));
+  client.join();
+  EXPECT_TRUE(held_status.ok());
+  EXPECT_EQ(router.Loads()[0].outstanding_rows, 0);
+
+  router.Stop();
+  idle.Stop();
+}
+
+TEST(Router, Failover) {
+  TBServerOptions backend_options;
+  backend_options.require_connect = false;
+  TBServer up(new NamedServable("up"), backend_options);
+  up.StartInsecure("localhost:50060");
+
+  // Nothing listens on the first, it's tried first and turns out unavailable
+  TBRouterOptions options;
+  options.policy = SHORTEST_QUEUE;
+  TBRouter router({"localhost:50059", "localhost:50060"}, options);
+  router.StartInsecure("localhost:50061");
+
+  std::unique_ptr<BatchingServer::Stub> stub = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50061",
+                          grpc::InsecureChannelCredentials()));
+
+  ConnectionReply rep;
+  {
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Connect(&context, ConnectionRequest(), &rep).ok());
+  }
+
+  TensorMessage msg;
+  msg.add_buffer(1.f);
+  msg.set_n(1);
+
+  // The router keeps its own clients
+  {
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_EQ(stub->Process(&context, msg, &tensor_reply).error_code(),
+              grpc::FAILED_PRECONDITION);
+  }
+
+  msg.set_client_id(rep.client_id());
+  {
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Process(&context, msg, &tensor_reply).ok());
+    EXPECT_EQ(tensor_reply.model_name(), "up");
+    EXPECT_EQ(tensor_reply.client_id(), rep.client_id());
+  }
+
+  // The backends report their load on every reply
+  std::unique_ptr<BatchingServer::Stub> backend = BatchingServer::NewStub(
+      grpc::CreateChannel("localhost:50060",
+                          grpc::InsecureChannelCredentials()));
+  {
+    TensorMessage tensor_reply;
+    grpc::ClientContext context;
+    EXPECT_TRUE(backend->Process(&context, msg, &tensor_reply).ok());
+    auto load = context.GetServerTrailingMetadata().find(kLoadMetadataKey);
+    ASSERT_TRUE(load != context.GetServerTrailingMetadata().end());
+    EXPECT_EQ(std::string(load->second.data(), load->second.size()), "0");
+  }
+
+  // Healthy as long as one backend is
+  {
+    HealthReply health;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub->Health(&context, HealthRequest(), &health).ok());
+    EXPECT_TRUE(health.ready());
+  }
+
+  router.Stop();
+  up.Stop();
+}
+
+TEST(Prefork, Workers) {
+  int result = Prefork(3, [](const int &worker) { return 0; });
+  EXPECT_EQ(result, 0);
+
+  // One worker failing fails the whole group
+  result = Prefork(3, [](const int &worker) { return worker == 1 ? 1 : 0; });
+  EXPECT_EQ(result, 1);
+}
+
+TEST(Prefork, ShareFile) {
+  {
+    std::ofstream weights("shared-weights.dat", std::ios::binary);
+    weights << "weights";
+  }
+
+  std::string shared = ShareFile("shared-weights.dat");
+  ASSERT_FALSE(shared.empty());
+  EXPECT_TRUE(ShareFile("missing-weights.dat").empty());
+
+  // Every worker sees the parent's copy
+  int result = Prefork(2, [&shared](const int &worker) {
+    MappedFile file;
+    if (!file.Open(shared)) {
+      return 1;
+    }
+    return std::string(file.Data(), file.Size()) == "weights" ? 0 : 2;
+  });
+  EXPECT_EQ(result, 0);
+}
 }
-} // namespace Serving::
\ No newline at end of file
+} // namespace Serving::
@@ -100,8 +100,8 @@ protected:
     input = mx::NDArray(mx::Shape(1, 1, 1, n_hidden), *ctx);
     input = 1.f;
 
-    MXNetServable *servable = new MXNetServable(
-        mx::Shape(1, 1, 1, n_hidden), mx::Shape(1, n_hidden), mx::kCPU, 1);
+    MXNetServable *servable =
+        new MXNetServable(mx::Shape(1, 1, 1, n_hidden), mx::kCPU, 1);
     servable->Bind(raw_args);
     srv = new TBServer(servable); // takes control of the servable
     srv->StartInsecure("localhost:50051");
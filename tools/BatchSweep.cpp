@@ -0,0 +1,186 @@
+//
+// Created by Aman LaChapelle on 2/5/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Measures how an MXNet model scales with batch size and thread count, to
+// choose the batch size to serve it at. The model is bound in an
+// MXNetServable, which is sent full batches at every batch size for every
+// thread count. The results are written to stdout as CSV or JSON, along with
+// the point with the best throughput (within the latency limit, if given).
+//
+// Usage: BatchSweep <symbol.json> <model.params> <k> <nr> <nc>
+//          [--batches 1,2,4,8,16,32] [--threads 1,2,4] [--iterations 20]
+//          [--max-latency-ms 0] [--format csv|json]
+//
+// The input shape is (batch, k, nr, nc), as for the MXNetServable, outputs
+// take whatever shape the model gives them. DlibServable models are compiled in, so they can't
+// be loaded from the command line, but BatchSweep.hpp works with any
+// Servable and a DlibServable sweep needs only a small main of its own.
+
+// STL
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Project
+#include "BatchSweep.hpp"
+#include "MXNetServable.hpp"
+
+namespace {
+std::vector<int> ParseList_(const std::string &list) {
+  std::vector<int> values;
+  std::istringstream stream(list);
+  std::string value;
+  while (std::getline(stream, value, ',')) {
+    if (std::atoi(value.c_str()) > 0) {
+      values.push_back(std::atoi(value.c_str()));
+    }
+  }
+  return values;
+}
+
+int Usage_(const char *name) {
+  std::cerr << "Usage: " << name
+            << " <symbol.json> <model.params> <k> <nr> <nc>\n"
+               "         [--batches 1,2,4,8,16,32] [--threads 1,2,4]"
+               " [--iterations 20]\n"
+               "         [--max-latency-ms 0] [--format csv|json]"
+            << std::endl;
+  return 1;
+}
+
+std::vector<Serving::SweepPoint>
+Sweep_(Serving::FileBindArgs args, const std::vector<int> &shape,
+       const std::vector<int> &batches, const int &threads,
+       const int &iterations) {
+  namespace mx = mxnet::cpp;
+
+  // The servable leaves a thread count that's already in the environment
+  // alone, the sweep's has to win
+  setenv("OMP_NUM_THREADS", std::to_string(threads).c_str(), 1);
+
+  Serving::BatchingOptions options;
+  options.replica_threads = threads;
+  options.autotune_window = 1;
+
+  Serving::MXNetServable servable(
+      mx::Shape(batches.front(), shape[0], shape[1], shape[2]), mx::kCPU, 0,
+      options);
+  if (servable.Bind(args) != Serving::OK) {
+    std::cerr << "Unable to bind " << args.symbol_filename << std::endl;
+    return {};
+  }
+
+  std::vector<Serving::SweepPoint> points;
+  for (const int &batch_size : batches) {
+    if (servable.SetBatchSize(batch_size) != Serving::OK) {
+      continue;
+    }
+
+    Serving::TensorMessage request;
+    request.mutable_buffer()->Resize(batch_size * shape[0] * shape[1] *
+                                         shape[2],
+                                     0.5f);
+    request.set_n(batch_size);
+    request.set_k(shape[0]);
+    request.set_nr(shape[1]);
+    request.set_nc(shape[2]);
+    request.set_client_id("sweep");
+
+    points.push_back(
+        Serving::MeasureBatch(servable, request, batch_size, iterations));
+    std::cerr << "threads " << threads << ", batch " << batch_size << ": "
+              << points.back().batch_ms << " ms" << std::endl;
+  }
+  return points;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc < 6) {
+    return Usage_(argv[0]);
+  }
+
+  Serving::FileBindArgs args;
+  args.symbol_filename = argv[1];
+  args.parameters_filename = argv[2];
+  std::vector<int> shape;
+  for (int i = 3; i < 6; i++) {
+    shape.push_back(std::atoi(argv[i]));
+    if (shape.back() <= 0) {
+      return Usage_(argv[0]);
+    }
+  }
+
+  std::vector<int> batches = {1, 2, 4, 8, 16, 32};
+  std::vector<int> threads = {1, 2, 4};
+  int iterations = 20;
+  double max_latency_ms = 0.0;
+  std::string format = "csv";
+  for (int i = 6; i + 1 < argc; i += 2) {
+    const std::string flag = argv[i];
+    if (flag == "--batches") {
+      batches = ParseList_(argv[i + 1]);
+    } else if (flag == "--threads") {
+      threads = ParseList_(argv[i + 1]);
+    } else if (flag == "--iterations") {
+      iterations = std::atoi(argv[i + 1]);
+    } else if (flag == "--max-latency-ms") {
+      max_latency_ms = std::atof(argv[i + 1]);
+    } else if (flag == "--format") {
+      format = argv[i + 1];
+    } else {
+      return Usage_(argv[0]);
+    }
+  }
+  if ((argc - 6) % 2 != 0 || batches.empty() || threads.empty() ||
+      iterations <= 0 || (format != "csv" && format != "json")) {
+    return Usage_(argv[0]);
+  }
+
+  std::vector<Serving::SweepPoint> points =
+      Serving::SweepThreads(threads, [&](const int &count) {
+        return Sweep_(args, shape, batches, count, iterations);
+      });
+  if (points.empty()) {
+    std::cerr << "Nothing was measured" << std::endl;
+    return 1;
+  }
+
+  const int recommended = Serving::RecommendPoint(points, max_latency_ms);
+  if (format == "json") {
+    Serving::WriteSweepJson(std::cout, points, recommended);
+  } else {
+    Serving::WriteSweepCsv(std::cout, points, recommended);
+  }
+
+  if (recommended < 0) {
+    std::cerr << "No configuration met " << max_latency_ms << " ms"
+              << std::endl;
+  } else {
+    std::cerr << "Recommended: batch size "
+              << points[recommended].batch_size << " with "
+              << points[recommended].threads << " threads" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,270 @@
+//
+// Created by Aman LaChapelle on 2/5/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_BATCHSWEEP_HPP
+#define BATCHING_RPC_SERVER_BATCHSWEEP_HPP
+
+// STL
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// POSIX
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Project
+#include "Servable.hpp"
+
+namespace Serving {
+
+/**
+ * @brief How a model performed at one batch size and thread count.
+ */
+struct SweepPoint {
+  int threads = 0;
+  int batch_size = 0;
+  double forward_ms = 0.0;  //!< the forward pass alone, as the servable saw it
+  double batch_ms = 0.0;    //!< median from AddToBatch to GetResult
+  double p99_ms = 0.0;      //!< p99 from AddToBatch to GetResult
+  double rows_per_s = 0.0;  //!< batch_size over batch_ms
+  double us_per_row = 0.0;  //!< batch_ms shared between the rows
+  double resident_mb = 0.0; //!< the process' resident memory afterwards
+};
+
+/**
+ * @brief The process' resident memory in megabytes, the peak if the current
+ * size isn't available.
+ */
+inline double ResidentMegabytes() {
+  long pages = 0;
+  if (FILE *statm = std::fopen("/proc/self/statm", "r")) {
+    long size = 0;
+    const int read = std::fscanf(statm, "%ld %ld", &size, &pages);
+    std::fclose(statm);
+    if (read == 2) {
+      return pages * static_cast<double>(sysconf(_SC_PAGESIZE)) / (1 << 20);
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / static_cast<double>(1 << 20); // bytes
+#else
+  return usage.ru_maxrss / 1024.0; // kilobytes
+#endif
+}
+
+/**
+ * @brief Times full batches through a bound servable.
+ *
+ * Each iteration sends one request of batch_size rows, so every batch is
+ * full and goes straight to the model. One extra batch runs first and isn't
+ * counted. The servable should be built with BatchingOptions::autotune_window
+ * set to 1 so that its reported forward time is current.
+ *
+ * @param servable A bound servable whose batch size is batch_size.
+ * @param request A request of batch_size rows.
+ * @param iterations How many batches to time.
+ * @return The point, without threads filled in.
+ */
+inline SweepPoint MeasureBatch(Servable &servable, const TensorMessage &request,
+                               const int &batch_size, const int &iterations) {
+  std::vector<double> times_ms;
+  TensorMessage output;
+
+  for (int i = 0; i <= iterations; i++) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (servable.AddToBatch(request) != OK ||
+        servable.GetResult(request.client_id(), &output) != OK) {
+      return SweepPoint();
+    }
+    if (i > 0) {
+      times_ms.push_back(std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count());
+    }
+  }
+  std::sort(times_ms.begin(), times_ms.end());
+
+  SweepPoint point;
+  point.batch_size = batch_size;
+  point.forward_ms = servable.GetBatchingStats().forward_us / 1000.0;
+  point.batch_ms = times_ms[times_ms.size() / 2];
+  point.p99_ms = times_ms[std::min(times_ms.size() - 1,
+                                   static_cast<size_t>(0.99 * times_ms.size()))];
+  point.rows_per_s = batch_size * 1000.0 / point.batch_ms;
+  point.us_per_row = point.batch_ms * 1000.0 / batch_size;
+  point.resident_mb = ResidentMegabytes();
+  return point;
+}
+
+/**
+ * @brief Runs a sweep once for each thread count, each in its own process.
+ *
+ * Frameworks read their thread settings once, when they start, so every
+ * thread count needs a fresh process. The caller mustn't have started the
+ * framework before calling this.
+ *
+ * @param threads The thread counts to sweep.
+ * @param sweep Called in the child process as sweep(threads), it sets the
+ * framework up with that many threads and returns its points.
+ * @return Every child's points, a child that failed contributes none.
+ */
+template <typename Sweep>
+std::vector<SweepPoint> SweepThreads(const std::vector<int> &threads,
+                                     Sweep sweep) {
+  std::vector<SweepPoint> points;
+
+  for (const int &count : threads) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      continue;
+    }
+
+    pid_t child = fork();
+    if (child < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      continue;
+    }
+
+    if (child == 0) {
+      close(fds[0]);
+      for (SweepPoint point : sweep(count)) {
+        point.threads = count;
+        if (write(fds[1], &point, sizeof(point)) !=
+            static_cast<ssize_t>(sizeof(point))) {
+          _exit(1);
+        }
+      }
+      close(fds[1]);
+      _exit(0);
+    }
+
+    close(fds[1]);
+    SweepPoint point;
+    while (read(fds[0], &point, sizeof(point)) ==
+           static_cast<ssize_t>(sizeof(point))) {
+      points.push_back(point);
+    }
+    close(fds[0]);
+    waitpid(child, nullptr, 0);
+  }
+
+  return points;
+}
+
+/**
+ * @brief Picks the operating point to run at.
+ *
+ * Of the points whose p99 is within max_latency_ms (all of them if it's 0),
+ * those within 5% of the best throughput are as good as each other, and the
+ * one among them with the lowest median latency is chosen.
+ *
+ * @return The index into points, or -1 if no point meets the latency.
+ */
+inline int RecommendPoint(const std::vector<SweepPoint> &points,
+                          const double &max_latency_ms) {
+  double best = 0.0;
+  for (const SweepPoint &point : points) {
+    if (max_latency_ms <= 0.0 || point.p99_ms <= max_latency_ms) {
+      best = std::max(best, point.rows_per_s);
+    }
+  }
+
+  int chosen = -1;
+  for (size_t i = 0; i < points.size(); i++) {
+    const SweepPoint &point = points[i];
+    if ((max_latency_ms > 0.0 && point.p99_ms > max_latency_ms) ||
+        point.rows_per_s <= 0.0 || point.rows_per_s < 0.95 * best) {
+      continue;
+    }
+    if (chosen < 0 || point.batch_ms < points[chosen].batch_ms) {
+      chosen = static_cast<int>(i);
+    }
+  }
+  return chosen;
+}
+
+/**
+ * @brief Writes the points as CSV, with a column marking the recommendation.
+ */
+inline void WriteSweepCsv(std::ostream &out,
+                          const std::vector<SweepPoint> &points,
+                          const int &recommended) {
+  out << "threads,batch_size,forward_ms,batch_ms,p99_ms,rows_per_s,"
+         "us_per_row,resident_mb,recommended\n";
+  out << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < points.size(); i++) {
+    const SweepPoint &point = points[i];
+    out << point.threads << "," << point.batch_size << "," << point.forward_ms
+        << "," << point.batch_ms << "," << point.p99_ms << ","
+        << point.rows_per_s << "," << point.us_per_row << ","
+        << point.resident_mb << ","
+        << (static_cast<int>(i) == recommended ? 1 : 0) << "\n";
+  }
+}
+
+inline void WriteSweepPointJson_(std::ostream &out, const SweepPoint &point) {
+  out << "{\"threads\": " << point.threads
+      << ", \"batch_size\": " << point.batch_size
+      << ", \"forward_ms\": " << point.forward_ms
+      << ", \"batch_ms\": " << point.batch_ms
+      << ", \"p99_ms\": " << point.p99_ms
+      << ", \"rows_per_s\": " << point.rows_per_s
+      << ", \"us_per_row\": " << point.us_per_row
+      << ", \"resident_mb\": " << point.resident_mb << "}";
+}
+
+/**
+ * @brief Writes the points as JSON, the recommendation is null if nothing
+ * met the latency.
+ */
+inline void WriteSweepJson(std::ostream &out,
+                           const std::vector<SweepPoint> &points,
+                           const int &recommended) {
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"points\": [";
+  for (size_t i = 0; i < points.size(); i++) {
+    out << (i == 0 ? "\n    " : ",\n    ");
+    WriteSweepPointJson_(out, points[i]);
+  }
+  out << "\n  ],\n  \"recommended\": ";
+  if (recommended < 0) {
+    out << "null";
+  } else {
+    WriteSweepPointJson_(out, points[recommended]);
+  }
+  out << "\n}\n";
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_BATCHSWEEP_HPP
@@ -0,0 +1,178 @@
+//
+// Created by Aman LaChapelle on 2/11/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Measures what TBClient costs and buys over calling the generated stub by
+// hand. An echo servable is served over loopback TCP and driven by the same
+// closed loop load: straight through a stub per client thread, through one
+// TBClient shared by every thread with one channel and with several, and
+// through ProcessAsync with as many calls in flight as there are clients.
+//
+// Usage: ClientBenchmark [clients] [requests per client] [floats]
+// The defaults are 8 clients, 2000 requests each and 1000 floats.
+
+// STL
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Project
+#include "LoadGenerator.hpp"
+#include "TBClient.hpp"
+#include "TBServer.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+Serving::TensorMessage MakeRequest_(const int &floats) {
+  Serving::TensorMessage request;
+  request.mutable_buffer()->Resize(floats, 0.5f);
+  request.set_n(1);
+  request.set_k(floats);
+  request.set_nr(1);
+  request.set_nc(1);
+  return request;
+}
+
+void Record_(const Clock::time_point &sent, const grpc::Status &status,
+             Serving::LoadResult *result) {
+  result->latencies_us.push_back(
+      std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+  (status.ok() ? result->completed : result->failed)++;
+}
+
+Serving::LoadResult RunStub_(const std::string &address, const int &clients,
+                             const int &requests, const int &floats) {
+  return Serving::DriveLoad(
+      clients, requests, [&](const int &count, Serving::LoadResult *result) {
+        std::unique_ptr<Serving::BatchingServer::Stub> stub =
+            Serving::BatchingServer::NewStub(grpc::CreateChannel(
+                address, grpc::InsecureChannelCredentials()));
+
+        Serving::ConnectionReply connection;
+        {
+          grpc::ClientContext context;
+          stub->Connect(&context, Serving::ConnectionRequest(), &connection);
+        }
+
+        Serving::TensorMessage request = MakeRequest_(floats);
+        request.set_client_id(connection.client_id());
+        Serving::TensorMessage reply;
+
+        for (int i = 0; i < count; i++) {
+          grpc::ClientContext context;
+          Clock::time_point sent = Clock::now();
+          grpc::Status status = stub->Process(&context, request, &reply);
+          Record_(sent, status, result);
+        }
+      });
+}
+
+Serving::LoadResult RunClient_(const std::string &address, const int &channels,
+                               const int &clients, const int &requests,
+                               const int &floats) {
+  Serving::TBClientOptions options;
+  options.channels = channels;
+  Serving::TBClient client(address, options);
+
+  return Serving::DriveLoad(
+      clients, requests, [&](const int &count, Serving::LoadResult *result) {
+        Serving::TensorMessage request = MakeRequest_(floats);
+        Serving::TensorMessage reply;
+
+        for (int i = 0; i < count; i++) {
+          Clock::time_point sent = Clock::now();
+          grpc::Status status = client.Process(request, &reply);
+          Record_(sent, status, result);
+        }
+      });
+}
+
+Serving::LoadResult RunAsync_(const std::string &address, const int &clients,
+                              const int &requests, const int &floats) {
+  Serving::TBClientOptions options;
+  options.async_threads = clients;
+  Serving::TBClient client(address, options);
+
+  // One thread keeps every call in flight, topping up as each returns
+  return Serving::DriveLoad(
+      1, clients * requests,
+      [&](const int &count, Serving::LoadResult *result) {
+        const Serving::TensorMessage request = MakeRequest_(floats);
+        std::deque<std::pair<Clock::time_point,
+                             std::future<Serving::ProcessResult>>>
+            in_flight;
+
+        for (int sent = 0; sent < count || !in_flight.empty();) {
+          if (sent < count && static_cast<int>(in_flight.size()) < clients) {
+            in_flight.emplace_back(Clock::now(), client.ProcessAsync(request));
+            sent++;
+            continue;
+          }
+          Serving::ProcessResult done = in_flight.front().second.get();
+          Record_(in_flight.front().first, done.status, result);
+          in_flight.pop_front();
+        }
+      });
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const int clients = argc > 1 ? std::atoi(argv[1]) : 8;
+  const int requests = argc > 2 ? std::atoi(argv[2]) : 2000;
+  const int floats = argc > 3 ? std::atoi(argv[3]) : 1000;
+  if (clients <= 0 || requests <= 0 || floats <= 0) {
+    std::cerr << "Usage: " << argv[0]
+              << " [clients] [requests per client] [floats]" << std::endl;
+    return 1;
+  }
+
+  const std::string address = "127.0.0.1:50072";
+
+  Serving::TBServer server(new Serving::EchoServable());
+  server.StartInsecure(address);
+
+  std::cout << clients << " clients x " << requests << " requests of "
+            << floats << " floats" << std::endl;
+  Serving::PrintLoadHeader(12);
+  Serving::PrintLoadResult("stub", 12,
+                           RunStub_(address, clients, requests, floats),
+                           floats);
+  Serving::PrintLoadResult("client", 12,
+                           RunClient_(address, 1, clients, requests, floats),
+                           floats);
+  Serving::PrintLoadResult("client x4", 12,
+                           RunClient_(address, 4, clients, requests, floats),
+                           floats);
+  Serving::PrintLoadResult("async", 12,
+                           RunAsync_(address, clients, requests, floats),
+                           floats);
+
+  server.Stop();
+  return 0;
+}
@@ -0,0 +1,74 @@
+//
+// Created by Aman LaChapelle on 1/27/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Converts an MXNet .params file into the mapped format read by
+// Serving::MappedBindArgs. dlib .dat files don't need converting, the
+// DlibServable maps them as they are.
+//
+// Usage: ConvertParameters model-0000.params model.mparams
+
+// STL
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// MXNet
+#include "mxnet-cpp/MxNetCpp.h"
+
+// Project
+#include "MappedFile.hpp"
+
+namespace mx = mxnet::cpp;
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <input.params> <output.mparams>"
+              << std::endl;
+    return 1;
+  }
+
+  std::map<std::string, mx::NDArray> parameters =
+      mx::NDArray::LoadToMap(argv[1]);
+
+  std::vector<Serving::MappedArray> arrays;
+  for (auto &parameter : parameters) {
+    parameter.second.WaitToRead();
+    std::vector<mx_uint> shape = parameter.second.GetShape();
+
+    Serving::MappedArray array;
+    array.name = parameter.first;
+    array.shape.assign(shape.begin(), shape.end());
+    array.data = parameter.second.GetData();
+    array.size = parameter.second.Size();
+    arrays.push_back(array);
+  }
+
+  if (!Serving::WriteMappedParameters(argv[2], arrays)) {
+    std::cerr << "Unable to write " << argv[2] << std::endl;
+    return 1;
+  }
+
+  std::cout << "Wrote " << arrays.size() << " arrays to " << argv[2]
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,166 @@
+//
+// Created by Aman LaChapelle on 2/3/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+#ifndef BATCHING_RPC_SERVER_LOADGENERATOR_HPP
+#define BATCHING_RPC_SERVER_LOADGENERATOR_HPP
+
+// STL
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Project
+#include "Servable.hpp"
+
+namespace Serving {
+
+/**
+ * @brief Hands every request straight back, so a benchmark only measures
+ * the transport.
+ */
+class EchoServable : public Servable {
+public:
+  ReturnCodes SetBatchSize(const int &new_size) override { return OK; }
+
+  ReturnCodes AddToBatch(const TensorMessage &message) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    pending_[message.client_id()] = message;
+    return OK;
+  }
+
+  ReturnCodes GetResult(const std::string &client_id,
+                        TensorMessage *message) override {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto result = pending_.find(client_id);
+    if (result == pending_.end()) {
+      return NEXT_BATCH;
+    }
+    message->Swap(&result->second);
+    pending_.erase(result);
+    return OK;
+  }
+
+  ReturnCodes Bind(BindArgs &args) override { return OK; }
+
+private:
+  std::mutex mutex_;
+  std::map<std::string, TensorMessage> pending_;
+};
+
+/**
+ * @brief The outcome of a load run.
+ */
+struct LoadResult {
+  double seconds = 0.0;
+  int completed = 0;
+  int failed = 0;
+  std::vector<double> latencies_us; //!< sorted once the run is over
+};
+
+/**
+ * @brief Runs a closed loop load, every client sends its next request as
+ * soon as the last one returns.
+ *
+ * @param clients The number of client threads.
+ * @param requests The number of requests each client sends.
+ * @param client Called on each thread as client(requests, &result), it
+ * records the latency and outcome of each request it sends.
+ * @return The results of every client together.
+ */
+template <typename Client>
+LoadResult DriveLoad(const int &clients, const int &requests, Client client) {
+  std::vector<LoadResult> results(clients);
+  std::vector<std::thread> threads;
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  for (int i = 0; i < clients; i++) {
+    threads.emplace_back([&, i]() { client(requests, &results[i]); });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  LoadResult total;
+  total.seconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+  for (const LoadResult &result : results) {
+    total.completed += result.completed;
+    total.failed += result.failed;
+    total.latencies_us.insert(total.latencies_us.end(),
+                              result.latencies_us.begin(),
+                              result.latencies_us.end());
+  }
+  std::sort(total.latencies_us.begin(), total.latencies_us.end());
+  return total;
+}
+
+inline double Percentile(const std::vector<double> &sorted, const double &p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  return sorted[std::min(sorted.size() - 1,
+                         static_cast<size_t>(p * sorted.size()))];
+}
+
+inline void PrintLoadHeader(const int &label_width) {
+  std::cout << std::left << std::setw(label_width) << "" << std::right
+            << std::setw(10) << "req/s" << std::setw(10) << "MB/s"
+            << std::setw(10) << "p50 us" << std::setw(10) << "p90 us"
+            << std::setw(10) << "p99 us" << std::setw(8) << "failed"
+            << std::endl;
+}
+
+/**
+ * @brief Prints a row of throughput and latency.
+ *
+ * @param label What was measured.
+ * @param label_width The width of the label column.
+ * @param result The run's outcome.
+ * @param floats The size of each request's tensor, which each request
+ * carries there and back.
+ */
+inline void PrintLoadResult(const std::string &label, const int &label_width,
+                            const LoadResult &result, const size_t &floats) {
+  const double megabytes =
+      2.0 * result.completed * floats * sizeof(float) / 1e6;
+
+  std::cout << std::left << std::setw(label_width) << label << std::right
+            << std::fixed << std::setprecision(0) << std::setw(10)
+            << result.completed / result.seconds << std::setw(10)
+            << megabytes / result.seconds << std::setprecision(1)
+            << std::setw(10) << Percentile(result.latencies_us, 0.5)
+            << std::setw(10) << Percentile(result.latencies_us, 0.9)
+            << std::setw(10) << Percentile(result.latencies_us, 0.99)
+            << std::setw(8) << result.failed << std::endl;
+}
+
+} // namespace Serving
+
+#endif // BATCHING_RPC_SERVER_LOADGENERATOR_HPP
@@ -0,0 +1,84 @@
+//
+// Created by Aman LaChapelle on 2/10/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Runs a TBRouter in front of TBServers started elsewhere, on this host or
+// others, until it's interrupted. The backends have to be started with
+// TBServerOptions::require_connect off, clients Connect to the router.
+//
+// Usage: Router [--queue] <listen address> <backend address>...
+// Requests go to the backend with the fewest rows outstanding from this
+// router, or with --queue to the one with the shortest reported queue.
+
+// STL
+#include <iostream>
+#include <string>
+#include <vector>
+
+// POSIX
+#include <csignal>
+#include <pthread.h>
+
+// Project
+#include "TBRouter.hpp"
+
+int main(int argc, char *argv[]) {
+  Serving::TBRouterOptions options;
+  std::vector<std::string> addresses;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--queue") {
+      options.policy = Serving::SHORTEST_QUEUE;
+    } else {
+      addresses.emplace_back(argv[i]);
+    }
+  }
+
+  if (addresses.size() < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--queue] <listen address> <backend address>..."
+              << std::endl;
+    return 1;
+  }
+
+  // Block the signals before gRPC starts its threads so only sigwait sees
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  Serving::TBRouter router(
+      std::vector<std::string>(addresses.begin() + 1, addresses.end()),
+      options);
+  router.StartInsecure(addresses[0]);
+  std::cout << "Routing " << addresses[0] << " to " << addresses.size() - 1
+            << " backends" << std::endl;
+
+  int signal;
+  sigwait(&signals, &signal);
+
+  router.Stop();
+  for (const Serving::BackendLoad &load : router.Loads()) {
+    std::cout << load.address << ": last reported " << load.reported_rows
+              << " rows" << std::endl;
+  }
+  return 0;
+}
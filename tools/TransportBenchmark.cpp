@@ -0,0 +1,164 @@
+//
+// Created by Aman LaChapelle on 2/1/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Compares the cost of the transports TBServer offers to a caller on the
+// same host. An echo servable sits behind loopback TCP, a Unix domain socket
+// and the shared memory transport, and each is driven by the same closed loop
+// load: every client sends its next request as soon as the last one returns.
+//
+// Usage: TransportBenchmark [clients] [requests per client] [floats]
+// The defaults are 8 clients, 1000 requests each and a 224x224x3 tensor.
+
+// STL
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Project
+#include "LoadGenerator.hpp"
+#include "LocalTransport.hpp"
+#include "TBServer.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+Serving::TensorMessage MakeRequest_(const int &floats) {
+  Serving::TensorMessage request;
+  request.mutable_buffer()->Resize(floats, 0.5f);
+  request.set_n(1);
+  request.set_k(floats);
+  request.set_nr(1);
+  request.set_nc(1);
+  return request;
+}
+
+Serving::ConnectionReply Connect_(Serving::BatchingServer::Stub *stub) {
+  grpc::ClientContext context;
+  Serving::ConnectionReply reply;
+  stub->Connect(&context, Serving::ConnectionRequest(), &reply);
+  return reply;
+}
+
+void Record_(const Clock::time_point &sent, const grpc::Status &status,
+             Serving::LoadResult *result) {
+  result->latencies_us.push_back(
+      std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+  (status.ok() ? result->completed : result->failed)++;
+}
+
+Serving::LoadResult RunGrpc_(const std::string &address, const int &clients,
+                             const int &requests, const int &floats) {
+  return Serving::DriveLoad(
+      clients, requests, [&](const int &count, Serving::LoadResult *result) {
+        std::unique_ptr<Serving::BatchingServer::Stub> stub =
+            Serving::BatchingServer::NewStub(grpc::CreateChannel(
+                address, grpc::InsecureChannelCredentials()));
+
+        Serving::TensorMessage request = MakeRequest_(floats);
+        request.set_client_id(Connect_(stub.get()).client_id());
+        Serving::TensorMessage reply;
+
+        for (int i = 0; i < count; i++) {
+          grpc::ClientContext context;
+          Clock::time_point sent = Clock::now();
+          grpc::Status status = stub->Process(&context, request, &reply);
+          Record_(sent, status, result);
+        }
+      });
+}
+
+Serving::LoadResult RunLocal_(const std::string &address, const int &clients,
+                              const int &requests, const int &floats) {
+  return Serving::DriveLoad(
+      clients, requests, [&](const int &count, Serving::LoadResult *result) {
+        std::unique_ptr<Serving::BatchingServer::Stub> stub =
+            Serving::BatchingServer::NewStub(grpc::CreateChannel(
+                address, grpc::InsecureChannelCredentials()));
+        Serving::ConnectionReply connection = Connect_(stub.get());
+
+        Serving::LocalChannel channel;
+        float *input = nullptr;
+        if (channel.Open(connection.local_address(), connection.client_id())) {
+          input = channel.InputBuffer(floats);
+        }
+        if (input == nullptr) {
+          result->failed = count;
+          return;
+        }
+
+        // The tensor is written in place once, as a client producing it
+        // straight into shared memory would
+        Serving::TensorMessage request = MakeRequest_(0);
+        request.set_k(floats);
+        request.set_client_id(connection.client_id());
+        std::fill(input, input + floats, 0.5f);
+        Serving::TensorMessage reply;
+
+        for (int i = 0; i < count; i++) {
+          Clock::time_point sent = Clock::now();
+          grpc::Status status = channel.ProcessInPlace(request, floats, &reply);
+          Record_(sent, status, result);
+        }
+      });
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const int clients = argc > 1 ? std::atoi(argv[1]) : 8;
+  const int requests = argc > 2 ? std::atoi(argv[2]) : 1000;
+  const int floats = argc > 3 ? std::atoi(argv[3]) : 224 * 224 * 3;
+  if (clients <= 0 || requests <= 0 || floats <= 0) {
+    std::cerr << "Usage: " << argv[0]
+              << " [clients] [requests per client] [floats]" << std::endl;
+    return 1;
+  }
+
+  const std::string tcp_address = "127.0.0.1:50071";
+  const std::string unix_address = "unix:/tmp/TransportBenchmark.sock";
+
+  Serving::TBServer server(new Serving::EchoServable());
+  server.StartInsecure(std::vector<std::string>{tcp_address, unix_address});
+  if (!server.StartLocal("/tmp/TransportBenchmark-local.sock",
+                         floats * sizeof(float) + 4096)) {
+    std::cerr << "Unable to start the shared memory transport" << std::endl;
+    return 1;
+  }
+
+  std::cout << clients << " clients x " << requests << " requests of "
+            << floats << " floats" << std::endl;
+  Serving::PrintLoadHeader(8);
+  Serving::PrintLoadResult(
+      "tcp", 8, RunGrpc_(tcp_address, clients, requests, floats), floats);
+  Serving::PrintLoadResult(
+      "unix", 8, RunGrpc_(unix_address, clients, requests, floats), floats);
+  Serving::PrintLoadResult(
+      "shm", 8, RunLocal_(tcp_address, clients, requests, floats), floats);
+
+  server.Stop();
+  return 0;
+}
@@ -0,0 +1,155 @@
+//
+// Created by Aman LaChapelle on 2/3/18.
+//
+// BatchingRPCServer
+// Copyright (c) 2018 Aman LaChapelle
+// Full license at BatchingRPCServer/LICENSE.txt
+//
+
+/*
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+        http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+ */
+
+// Shows what the TBServerOptions do for large tensors. An echo servable is
+// served with a series of option sets, each driven by the same closed loop
+// load of requests carrying several 224x224x3 float images. Clients accept
+// replies of any size, so only the server's settings are being compared.
+//
+// Usage: TuningBenchmark [clients] [requests per client] [images per request]
+// The defaults are 8 clients, 200 requests each and 8 images (4.8 MB), which
+// is over gRPC's default 4 MB message limit.
+
+// STL
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// gRPC
+#include <grpc++/grpc++.h>
+
+// Project
+#include "LoadGenerator.hpp"
+#include "TBServer.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+Serving::LoadResult Run_(const std::string &address,
+                         const Serving::TBServerOptions &options,
+                         const int &clients, const int &requests,
+                         const int &images) {
+  const int floats = 224 * 224 * 3;
+
+  return Serving::DriveLoad(clients, requests, [&](const int &count,
+                                                   Serving::LoadResult
+                                                       *result) {
+    // The client matches the server's window so neither end is the limit
+    grpc::ChannelArguments arguments;
+    arguments.SetMaxReceiveMessageSize(-1);
+    arguments.SetMaxSendMessageSize(-1);
+    if (options.stream_window_bytes > 0) {
+      arguments.SetInt(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                       options.stream_window_bytes);
+    }
+    std::unique_ptr<Serving::BatchingServer::Stub> stub =
+        Serving::BatchingServer::NewStub(grpc::CreateCustomChannel(
+            address, grpc::InsecureChannelCredentials(), arguments));
+
+    Serving::ConnectionReply connection;
+    {
+      grpc::ClientContext context;
+      stub->Connect(&context, Serving::ConnectionRequest(), &connection);
+    }
+
+    Serving::TensorMessage request;
+    request.mutable_buffer()->Resize(images * floats, 0.5f);
+    request.set_n(images);
+    request.set_k(3);
+    request.set_nr(224);
+    request.set_nc(224);
+    request.set_client_id(connection.client_id());
+    Serving::TensorMessage reply;
+
+    for (int i = 0; i < count; i++) {
+      grpc::ClientContext context;
+      Clock::time_point sent = Clock::now();
+      grpc::Status status = stub->Process(&context, request, &reply);
+      result->latencies_us.push_back(
+          std::chrono::duration<double, std::micro>(Clock::now() - sent)
+              .count());
+      (status.ok() ? result->completed : result->failed)++;
+    }
+  });
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+  const int clients = argc > 1 ? std::atoi(argv[1]) : 8;
+  const int requests = argc > 2 ? std::atoi(argv[2]) : 200;
+  const int images = argc > 3 ? std::atoi(argv[3]) : 8;
+  if (clients <= 0 || requests <= 0 || images <= 0) {
+    std::cerr << "Usage: " << argv[0]
+              << " [clients] [requests per client] [images per request]"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<std::pair<std::string, Serving::TBServerOptions>> runs;
+
+  runs.emplace_back("default", Serving::TBServerOptions());
+
+  Serving::TBServerOptions messages;
+  messages.max_receive_message_bytes = -1;
+  messages.max_send_message_bytes = -1;
+  runs.emplace_back("messages", messages);
+
+  Serving::TBServerOptions windows = messages;
+  windows.stream_window_bytes = 16 << 20;
+  windows.write_buffer_bytes = 1 << 20;
+  runs.emplace_back("+windows", windows);
+
+  Serving::TBServerOptions pollers = messages;
+  pollers.num_cqs = 1;
+  pollers.min_pollers = clients;
+  pollers.max_pollers = 2 * clients;
+  runs.emplace_back("+pollers", pollers);
+
+  Serving::TBServerOptions all = windows;
+  all.num_cqs = pollers.num_cqs;
+  all.min_pollers = pollers.min_pollers;
+  all.max_pollers = pollers.max_pollers;
+  runs.emplace_back("+both", all);
+
+  std::vector<Serving::LoadResult> results;
+  int port = 50081;
+  for (const auto &run : runs) {
+    const std::string address = "127.0.0.1:" + std::to_string(port++);
+
+    Serving::TBServer server(new Serving::EchoServable(), run.second);
+    server.StartInsecure(address);
+    results.push_back(Run_(address, run.second, clients, requests, images));
+    server.Stop();
+  }
+
+  std::cout << clients << " clients x " << requests << " requests of "
+            << images << " 224x224x3 images" << std::endl;
+  Serving::PrintLoadHeader(12);
+  for (size_t i = 0; i < runs.size(); i++) {
+    Serving::PrintLoadResult(runs[i].first, 12, results[i],
+                             images * 224 * 224 * 3);
+  }
+
+  return 0;
+}